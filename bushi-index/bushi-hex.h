@@ -0,0 +1,36 @@
+#ifndef BUSHI_HEX_H
+#define BUSHI_HEX_H
+
+#include <stddef.h>
+
+// Hex parsing shared by the database and snapshot readers of the query
+// library. Not installed.
+
+static inline int
+hex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+// Pack the first len hex digits of hash into prefix, two to a byte with
+// the first in the high half. prefix must start zeroed and hold
+// (len + 1) / 2 bytes. Returns -1 on a character that is not a hex digit.
+static inline int
+parse_hex_prefix(const char *hash, size_t len, unsigned char *prefix)
+{
+	for (size_t i = 0; i < len; i++) {
+		int v = hex_digit(hash[i]);
+		if (v < 0)
+			return -1;
+		prefix[i / 2] |= i % 2 ? v : v << 4;
+	}
+	return 0;
+}
+
+#endif
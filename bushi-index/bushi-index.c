@@ -1,27 +1,53 @@
+// git-compat-util.h comes first, as in git itself: it sets the feature
+// test macros the system headers below need under strict ISO C.
+#define USE_THE_REPOSITORY_VARIABLE
+#include "git-compat-util.h"
+
 #include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sqlite3.h>
 #include <stdio.h>
+#include <sys/inotify.h>
 #include <unistd.h>
 
-#define USE_THE_REPOSITORY_VARIABLE
-#include "git-compat-util.h"
-
+#include "commit-graph.h"
 #include "commit.h"
 #include "config.h"
-#include "diff.h"
-#include "diffcore.h"
+#include "dir.h"
+#include "hashmap.h"
 #include "hex.h"
+#include "ident.h"
 #include "object.h"
+#include "odb.h"
+#include "pack-bitmap.h"
+#include "parse.h"
 #include "path.h"
 #include "refs.h"
 #include "repository.h"
+#include "revision.h"
 #include "setup.h"
 #include "strbuf.h"
 #include "strmap.h"
+#include "thread-utils.h"
+#include "tree-walk.h"
+#include "utf8.h"
 #include "version.h"
 
+#include "bushi-query.h"
+#include "bushi-snapshot.h"
+
 static bool debug = false;
 
+// worker threads for sync diffs and backfill, 0 means one per online CPU
+static int num_workers = 0;
+
+// ring slots per diff worker between the history walk and the writer
+#define PIPELINE_WINDOW_PER_WORKER 64
+
+// new commits one turn may index while other repositories wait for theirs
+#define SYNC_TURN_COMMITS 50000
+
 #define dbg(FMT, ...)                                                          \
 	do {                                                                   \
 		if (debug) {                                                   \
@@ -86,6 +112,11 @@ name_from_path(const char *path)
 
 #define SQL(...) #__VA_ARGS__
 
+// Rows per multi-row INSERT of a bulk import.
+#define BULK_ROWS 64
+#define BULK_VALUES_4(ROW) ROW ", " ROW ", " ROW ", " ROW
+#define BULK_VALUES(ROW) BULK_VALUES_4(BULK_VALUES_4(BULK_VALUES_4(ROW))) ";"
+
 enum {
 	STMT_INSERT_REPOSITORY,
 	STMT_GET_REPOSITORY_BY_PATH,
@@ -93,24 +124,58 @@ enum {
 	STMT_DELETE_REPOSITORY,
 	STMT_LIST_REPOSITORIES,
 
-	STMT_GET_COMMIT_ID,
+	STMT_LOAD_COMMIT_IDS,
+	STMT_NEXT_COMMIT_ID,
 	STMT_INSERT_COMMIT,
 
 	STMT_GET_PATH_ID,
 	STMT_INSERT_PATH,
 
+	STMT_GET_AUTHOR_ID,
+	STMT_INSERT_AUTHOR,
+
 	STMT_INSERT_CHANGE,
+	STMT_INSERT_RENAME,
+	STMT_INSERT_DELETION,
 
+	STMT_BULK_INSERT_COMMITS,
+	STMT_BULK_INSERT_CHANGES,
+
+	STMT_LOAD_REFS,
 	STMT_UPSERT_REF,
-	STMT_UPDATE_REFS_DIRTY,
-	STMT_DELETE_DIRTY_REFS,
+	STMT_DELETE_REF,
+	STMT_LIST_REF_TIPS,
 
-	STMT_BACKFILL_LIST_PATHS,
-	STMT_BACKFILL_PATH_COMMITS,
+	STMT_BACKFILL_LOAD_CHANGES,
 	STMT_BACKFILL_UPDATE_CHANGE,
+	STMT_BACKFILL_COUNT_COMMITS,
 	STMT_BACKFILL_LOAD_COMMITS,
+	STMT_BACKFILL_HAS_CHANGE,
+	STMT_BACKFILL_PATH_CANDIDATES,
+	STMT_GET_FIRST_PARENT,
 	STMT_UPDATE_FIRST_DEPTH,
 
+	STMT_GET_REF_COMMIT,
+	STMT_TIP_PATHS_GET,
+	STMT_TIP_PATHS_SET,
+	STMT_TIP_PATHS_DELETE,
+	STMT_TIP_PATHS_CLEAR,
+	STMT_TIP_PATHS_ABOVE,
+	STMT_TIP_PATHS_PRESERVE,
+	STMT_TIP_PATHS_ADVANCE,
+	STMT_TIP_PATHS_UNSHARE,
+	STMT_TIP_BASES_GET,
+	STMT_TIP_BASES_SET,
+	STMT_TIP_BASES_DROP,
+	STMT_TIP_BASES_DELETE,
+	STMT_GET_LAST_CHANGE,
+
+	STMT_SNAPSHOT_COMMITS,
+	STMT_SNAPSHOT_PATHS,
+	STMT_SNAPSHOT_CHANGES,
+	STMT_SNAPSHOT_REFS,
+	STMT_SNAPSHOT_TIPS,
+
 	STMT_STATUS_COMMIT_COUNT,
 	STMT_STATUS_FILE_COUNT,
 	STMT_STATUS_REF_COUNTS,
@@ -140,6 +205,7 @@ const char *texts[STMT_COUNT] = {
 	[STMT_GET_REPOSITORY_BY_NAME] = SQL(
 		SELECT repository_id
 		     , repository_path
+		     , repository_head
 		  FROM repositories
 		 WHERE repository_name = ?1
 		 LIMIT 1;
@@ -154,32 +220,60 @@ const char *texts[STMT_COUNT] = {
 		  FROM repositories
 		 ORDER BY repository_name;
 	),
-	[STMT_GET_COMMIT_ID] = SQL(
-		SELECT commit_id
+	[STMT_LOAD_COMMIT_IDS] = SQL(
+		SELECT commit_hash
+		     , commit_id
 		  FROM commits
-		 WHERE repository_id = ?1
-		   AND commit_hash = ?2
-		 LIMIT 1;
+		 WHERE repository_id = ?1;
+	),
+	[STMT_NEXT_COMMIT_ID] = SQL(
+		SELECT COALESCE(MAX(seq), 0) + 1
+		  FROM sqlite_sequence
+		 WHERE name = 'commits';
 	),
 	[STMT_INSERT_COMMIT] = SQL(
 		INSERT INTO commits
-		(      commit_hash
+		(      commit_id
+		     , commit_hash
 		     , parent_hash
 		     , repository_id
+		     , author_id
+		     , author_time
+		     , commit_time
+		     , subject
 		)
 		VALUES
-		    (?1, ?2, ?3);
+		    (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8);
 	),
 	[STMT_GET_PATH_ID] = SQL(
 		SELECT path_id
 		  FROM paths
-		 WHERE name = ?1
+		 WHERE parent_path_id = ?1
+		   AND basename = ?2
 		 LIMIT 1;
 	),
 	[STMT_INSERT_PATH] = SQL(
-		INSERT INTO paths(name)
+		INSERT INTO paths
+		(      parent_path_id
+		     , basename
+		)
+		VALUES
+		    (?1, ?2);
+	),
+	[STMT_GET_AUTHOR_ID] = SQL(
+		SELECT author_id
+		  FROM authors
+		 WHERE name = ?1
+		   AND email = ?2
+		 LIMIT 1;
+	),
+	[STMT_INSERT_AUTHOR] = SQL(
+		INSERT INTO authors
+		(      name
+		     , email
+		)
 		VALUES
-		    (?1);
+		    (?1, ?2);
 	),
 	[STMT_INSERT_CHANGE] = SQL(
 		INSERT INTO changes
@@ -189,6 +283,50 @@ const char *texts[STMT_COUNT] = {
 		VALUES
 		    (?1, ?2);
 	),
+	[STMT_INSERT_RENAME] = SQL(
+		INSERT INTO renames
+		(      commit_id
+		     , path_id
+		     , old_path_id
+		     , similarity
+		)
+		VALUES
+		    (?1, ?2, ?3, ?4);
+	),
+	[STMT_INSERT_DELETION] = SQL(
+		INSERT INTO deletions
+		(      commit_id
+		     , path_id
+		)
+		VALUES
+		    (?1, ?2);
+	),
+	[STMT_BULK_INSERT_COMMITS] = SQL(
+		INSERT INTO commits
+		(      commit_id
+		     , commit_hash
+		     , parent_hash
+		     , repository_id
+		     , author_id
+		     , author_time
+		     , commit_time
+		     , subject
+		)
+		VALUES
+	) BULK_VALUES("(?, ?, ?, ?, ?, ?, ?, ?)"),
+	[STMT_BULK_INSERT_CHANGES] = SQL(
+		INSERT INTO changes
+		(      commit_id
+		     , path_id
+		)
+		VALUES
+	) BULK_VALUES("(?, ?)"),
+	[STMT_LOAD_REFS] = SQL(
+		SELECT full_name
+		     , ref_oid
+		  FROM refs
+		 WHERE repository_id = ?1;
+	),
 	[STMT_UPSERT_REF] = SQL(
 		INSERT INTO refs
 		(      full_name
@@ -196,45 +334,41 @@ const char *texts[STMT_COUNT] = {
 		     , commit_id
 		     , ref_time
 		     , ref_type
-		     , is_dirty // always NULL here
+		     , ref_oid
 		     , repository_id
 		)
 		VALUES
-		    (?1, ?2, ?3, ?4, ?5, NULL, ?6)
+		    (?1, ?2, ?3, ?4, ?5, ?6, ?7)
 		ON CONFLICT(repository_id, full_name)
 		    DO UPDATE SET
 		      show_name = excluded.show_name
 		    , commit_id = excluded.commit_id
 		    , ref_time = excluded.ref_time
 		    , ref_type = excluded.ref_type
-		    , is_dirty = NULL;
-	),
-	[STMT_UPDATE_REFS_DIRTY] = SQL(
-		UPDATE refs
-		   SET is_dirty = 1
-		 WHERE repository_id = ?1;
+		    , ref_oid = excluded.ref_oid;
 	),
-	[STMT_DELETE_DIRTY_REFS] = SQL(
+	[STMT_DELETE_REF] = SQL(
 		DELETE FROM refs
 		 WHERE repository_id = ?1
-		   AND is_dirty IS NOT NULL;
+		   AND full_name = ?2;
 	),
-	[STMT_BACKFILL_LIST_PATHS] = SQL(
-		SELECT DISTINCT cg.path_id
-		  FROM changes AS cg
+	[STMT_LIST_REF_TIPS] = SQL(
+		SELECT DISTINCT c.commit_hash
+		  FROM refs AS r
 		  JOIN commits AS c
-		    ON c.commit_id = cg.commit_id
-		 WHERE c.repository_id = ?1
-		   AND cg.last_commit_id IS NULL;
+		    ON c.commit_id = r.commit_id
+		 WHERE r.repository_id = ?1;
 	),
-	[STMT_BACKFILL_PATH_COMMITS] = SQL(
+	[STMT_BACKFILL_LOAD_CHANGES] = SQL(
 		SELECT cg.commit_id
-		     , cg.last_commit_id IS NULL AS need_update
-		  FROM changes AS cg
-		  JOIN commits AS c
-		    ON c.commit_id = cg.commit_id
-		 WHERE cg.path_id = ?1
-		   AND c.repository_id = ?2;
+		     , cg.path_id
+		  FROM commits AS c
+		  JOIN changes AS cg
+		    ON cg.commit_id = c.commit_id
+		 WHERE c.repository_id = ?1
+		   AND c.first_depth IS NULL
+		 ORDER BY cg.commit_id
+		     , cg.path_id;
 	),
 	[STMT_BACKFILL_UPDATE_CHANGE] = SQL(
 		UPDATE changes
@@ -242,20 +376,330 @@ const char *texts[STMT_COUNT] = {
 		 WHERE commit_id = ?2
 		   AND path_id = ?3;
 	),
+	[STMT_BACKFILL_COUNT_COMMITS] = SQL(
+		SELECT COUNT(*)
+		  FROM commits
+		 WHERE repository_id = ?1
+		   AND first_depth IS NULL;
+	),
 	[STMT_BACKFILL_LOAD_COMMITS] = SQL(
 		SELECT c.commit_id
 		     , p.commit_id AS parent_id
+		     , c.commit_time
 		  FROM commits AS c
 		  LEFT JOIN commits AS p
 		    ON c.repository_id = p.repository_id
 		   AND c.parent_hash = p.commit_hash
 		 WHERE c.repository_id = ?1
+		   AND c.first_depth IS NULL
 		 ORDER BY c.commit_id;
 	),
+	[STMT_BACKFILL_HAS_CHANGE] = SQL(
+		SELECT 1
+		  FROM changes
+		 WHERE commit_id = ?1
+		   AND path_id = ?2;
+	),
+	[STMT_BACKFILL_PATH_CANDIDATES] = SQL(
+		SELECT cg.commit_id
+		     , c.first_depth
+		  FROM changes AS cg
+		  JOIN commits AS c
+		    ON c.commit_id = cg.commit_id
+		 WHERE cg.path_id = ?1
+		   AND c.repository_id = ?2
+		   AND c.first_depth <= ?3
+		 ORDER BY c.first_depth DESC;
+	),
+	[STMT_GET_FIRST_PARENT] = SQL(
+		SELECT c.first_depth
+		     , c.parent_id
+		     , c.jump_id
+		     , j.first_depth
+		     , c.chain_time
+		  FROM commits AS c
+		  JOIN commits AS j
+		    ON j.commit_id = c.jump_id
+		 WHERE c.commit_id = ?1;
+	),
 	[STMT_UPDATE_FIRST_DEPTH] = SQL(
 		UPDATE commits
-		   SET first_depth = ?1
-		 WHERE commit_id = ?2;
+		   SET parent_id = ?1
+		     , first_depth = ?2
+		     , jump_id = ?3
+		     , chain_time = ?5
+		 WHERE commit_id = ?4;
+	),
+	[STMT_GET_REF_COMMIT] = SQL(
+		SELECT commit_id
+		  FROM refs
+		 WHERE repository_id = ?1
+		   AND full_name = ?2;
+	),
+	[STMT_TIP_PATHS_GET] = SQL(
+		SELECT commit_id
+		  FROM tip_paths
+		 WHERE repository_id = ?1
+		   AND full_name = ?2
+		   AND path_id = ?3;
+	),
+	// The tip row, path 0, has no parent.
+	[STMT_TIP_PATHS_SET] = SQL(
+		INSERT OR REPLACE INTO tip_paths (
+			repository_id, full_name, path_id, parent_path_id,
+			commit_id, deleted
+		)
+		SELECT ?1, ?2, ?3
+		     , (SELECT parent_path_id FROM paths WHERE path_id = ?3)
+		     , ?4
+		     , EXISTS (
+			SELECT 1
+			  FROM deletions
+			 WHERE commit_id = ?4
+			   AND path_id = ?3
+		       );
+	),
+	[STMT_TIP_PATHS_DELETE] = SQL(
+		DELETE FROM tip_paths
+		 WHERE repository_id = ?1
+		   AND full_name = ?2
+		   AND path_id = ?3;
+	),
+	[STMT_TIP_PATHS_CLEAR] = SQL(
+		DELETE FROM tip_paths
+		 WHERE repository_id = ?1
+		   AND full_name = ?2;
+	),
+	[STMT_TIP_PATHS_ABOVE] = SQL(
+		SELECT tp.path_id
+		     , tp.commit_id
+		  FROM tip_paths AS tp
+		  JOIN commits AS c
+		    ON c.commit_id = tp.commit_id
+		 WHERE tp.repository_id = ?1
+		   AND tp.full_name = ?2
+		   AND tp.path_id != 0
+		   AND c.first_depth > ?3;
+	),
+	// Walk the first-parent chain from the tip ?3 down to, not including,
+	// depth ?4 and record the deepest commit changing each path. The bare
+	// commit_id comes from the row holding MAX(depth).
+	[STMT_TIP_PATHS_ADVANCE] = SQL(
+		WITH RECURSIVE chain(commit_id, depth) AS (
+			SELECT commit_id
+			     , first_depth
+			  FROM commits
+			 WHERE commit_id = ?3
+
+			UNION ALL
+
+			SELECT c.parent_id
+			     , h.depth - 1
+			  FROM chain AS h
+			  JOIN commits AS c
+			    ON c.commit_id = h.commit_id
+			 WHERE h.depth - 1 > ?4
+		)
+		INSERT OR REPLACE INTO tip_paths (
+			repository_id, full_name, path_id, parent_path_id,
+			commit_id, deleted
+		)
+		SELECT ?1, ?2, l.path_id, p.parent_path_id, l.commit_id
+		     , d.commit_id IS NOT NULL
+		  FROM (
+			SELECT cg.path_id
+			     , cg.commit_id
+			     , MAX(h.depth)
+			  FROM chain AS h
+			  JOIN changes AS cg
+			    ON cg.commit_id = h.commit_id
+			 GROUP BY cg.path_id
+		       ) AS l
+		  JOIN paths AS p
+		    ON p.path_id = l.path_id
+		  LEFT JOIN deletions AS d
+		    ON d.commit_id = l.commit_id
+		   AND d.path_id = l.path_id;
+	),
+	// Before ?2 advances over the same chain, every branch sharing its
+	// rows keeps a copy of those the advance replaces. The branches come
+	// first, so the chain is not walked when there are none.
+	[STMT_TIP_PATHS_PRESERVE] = SQL(
+		WITH RECURSIVE chain(commit_id, depth) AS (
+			SELECT commit_id
+			     , first_depth
+			  FROM commits
+			 WHERE commit_id = ?3
+
+			UNION ALL
+
+			SELECT c.parent_id
+			     , h.depth - 1
+			  FROM chain AS h
+			  JOIN commits AS c
+			    ON c.commit_id = h.commit_id
+			 WHERE h.depth - 1 > ?4
+		)
+		INSERT OR IGNORE INTO tip_paths (
+			repository_id, full_name, path_id, parent_path_id,
+			commit_id, deleted
+		)
+		SELECT b.repository_id, b.full_name, tp.path_id
+		     , tp.parent_path_id, tp.commit_id, tp.deleted
+		  FROM tip_bases AS b
+		 CROSS JOIN chain AS h
+		  JOIN changes AS cg
+		    ON cg.commit_id = h.commit_id
+		  JOIN tip_paths AS tp
+		    ON tp.repository_id = b.repository_id
+		   AND tp.full_name = b.base_name
+		   AND tp.path_id = cg.path_id
+		  JOIN commits AS c
+		    ON c.commit_id = tp.commit_id
+		 WHERE b.repository_id = ?1
+		   AND b.base_name = ?2
+		   AND c.first_depth <= b.base_depth;
+	),
+	// ?2 itself, and every branch sharing its rows, copies the rows it
+	// shares when its chain parts from the base above depth ?3. The rows
+	// it has of its own win.
+	[STMT_TIP_PATHS_UNSHARE] = SQL(
+		INSERT OR IGNORE INTO tip_paths (
+			repository_id, full_name, path_id, parent_path_id,
+			commit_id, deleted
+		)
+		SELECT b.repository_id, b.full_name, tp.path_id
+		     , tp.parent_path_id, tp.commit_id, tp.deleted
+		  FROM tip_bases AS b
+		  JOIN tip_paths AS tp
+		    ON tp.repository_id = b.repository_id
+		   AND tp.full_name = b.base_name
+		  JOIN commits AS c
+		    ON c.commit_id = tp.commit_id
+		 WHERE b.repository_id = ?1
+		   AND (b.full_name = ?2 OR b.base_name = ?2)
+		   AND b.base_depth > ?3
+		   AND tp.path_id != 0
+		   AND c.first_depth <= b.base_depth;
+	),
+	[STMT_TIP_BASES_GET] = SQL(
+		SELECT base_depth
+		  FROM tip_bases
+		 WHERE repository_id = ?1
+		   AND full_name = ?2;
+	),
+	[STMT_TIP_BASES_SET] = SQL(
+		INSERT OR REPLACE INTO tip_bases (
+			repository_id, full_name, base_name, base_depth
+		)
+		VALUES
+		    (?1, ?2, ?3, ?4);
+	),
+	[STMT_TIP_BASES_DROP] = SQL(
+		DELETE FROM tip_bases
+		 WHERE repository_id = ?1
+		   AND full_name = ?2;
+	),
+	// Once STMT_TIP_PATHS_UNSHARE copied the rows.
+	[STMT_TIP_BASES_DELETE] = SQL(
+		DELETE FROM tip_bases
+		 WHERE repository_id = ?1
+		   AND (full_name = ?2 OR base_name = ?2)
+		   AND base_depth > ?3;
+	),
+	[STMT_GET_LAST_CHANGE] = SQL(
+		SELECT cg.last_commit_id
+		     , c.first_depth
+		  FROM changes AS cg
+		  JOIN commits AS c
+		    ON c.commit_id = cg.last_commit_id
+		 WHERE cg.commit_id = ?1
+		   AND cg.path_id = ?2;
+	),
+	[STMT_SNAPSHOT_COMMITS] = SQL(
+		SELECT commit_id
+		     , commit_hash
+		     , parent_id
+		     , first_depth
+		     , jump_id
+		  FROM commits
+		 WHERE repository_id = ?1
+		 ORDER BY commit_id;
+	),
+	// The changed paths and the directories above them, whose full
+	// names are built from their parents'.
+	[STMT_SNAPSHOT_PATHS] = SQL(
+		WITH RECURSIVE used(path_id) AS (
+			SELECT cg.path_id
+			  FROM changes AS cg
+			  JOIN commits AS c
+			    ON c.commit_id = cg.commit_id
+			 WHERE c.repository_id = ?1
+
+			UNION
+
+			SELECT p.parent_path_id
+			  FROM used AS u
+			  JOIN paths AS p
+			    ON p.path_id = u.path_id
+			 WHERE p.parent_path_id != 0
+		)
+		SELECT p.path_id
+		     , p.parent_path_id
+		     , p.basename
+		  FROM used AS u
+		  JOIN paths AS p
+		    ON p.path_id = u.path_id
+		 ORDER BY p.path_id;
+	),
+	[STMT_SNAPSHOT_CHANGES] = SQL(
+		SELECT cg.path_id
+		     , cg.commit_id
+		     , cg.last_commit_id
+		  FROM changes AS cg
+		  JOIN commits AS c
+		    ON c.commit_id = cg.commit_id
+		 WHERE c.repository_id = ?1;
+	),
+	[STMT_SNAPSHOT_REFS] = SQL(
+		SELECT full_name
+		     , commit_id
+		  FROM refs
+		 WHERE repository_id = ?1
+		   AND commit_id IS NOT NULL
+		 ORDER BY full_name;
+	),
+	// The tip row, path 0, comes first. Shared rows count unless the
+	// branch has its own.
+	[STMT_SNAPSHOT_TIPS] = SQL(
+		SELECT path_id
+		     , commit_id
+		  FROM tip_paths
+		 WHERE repository_id = ?1
+		   AND full_name = ?2
+
+		UNION ALL
+
+		SELECT tp.path_id
+		     , tp.commit_id
+		  FROM tip_bases AS b
+		  JOIN tip_paths AS tp
+		    ON tp.repository_id = b.repository_id
+		   AND tp.full_name = b.base_name
+		  JOIN commits AS c
+		    ON c.commit_id = tp.commit_id
+		 WHERE b.repository_id = ?1
+		   AND b.full_name = ?2
+		   AND tp.path_id != 0
+		   AND c.first_depth <= b.base_depth
+		   AND NOT EXISTS (
+			SELECT 1
+			  FROM tip_paths AS o
+			 WHERE o.repository_id = ?1
+			   AND o.full_name = ?2
+			   AND o.path_id = tp.path_id
+		       )
+		 ORDER BY 1;
 	),
 	[STMT_STATUS_COMMIT_COUNT] = SQL(
 		SELECT COUNT(*)
@@ -270,7 +714,7 @@ const char *texts[STMT_COUNT] = {
 		  JOIN paths AS p
 		    ON p.path_id = cg.path_id
 		 WHERE c.repository_id = ?1
-		   AND p.name NOT LIKE '%/';
+		   AND p.basename NOT LIKE '%/';
 	),
 	[STMT_STATUS_REF_COUNTS] = SQL(
 		SELECT ref_type
@@ -282,10 +726,35 @@ const char *texts[STMT_COUNT] = {
 };
 // clang-format on
 
+static const char schema[] = {
+#embed "init.sql"
+    , '\0'};
+
 static sqlite3 *conn = NULL;
 static sqlite3_stmt *stmts[STMT_COUNT];
 
-static struct strmap path_map;
+static struct hashmap path_map;
+static struct strintmap author_map; // "name <email>" -> author_id
+
+// user_version of an existing database, or INT_MAX for a new one.
+static int
+schema_version(sqlite3 *db)
+{
+	sqlite3_stmt *stmt = NULL;
+	int version = INT_MAX;
+
+	if (sqlite3_prepare_v2(db,
+			       "SELECT (SELECT COUNT(*) FROM sqlite_schema), "
+			       "user_version FROM pragma_user_version",
+			       -1, &stmt, NULL) != SQLITE_OK)
+		return 0;
+
+	if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0))
+		version = sqlite3_column_int(stmt, 1);
+
+	sqlite3_finalize(stmt);
+	return version;
+}
 
 static sqlite3 *
 db_open(const char *path)
@@ -304,12 +773,27 @@ db_open(const char *path)
 
 	dbg("database opened, initializing schema");
 
-	const char schema[] = {
-#embed "init.sql"
-	    , '\0'};
+	// There is no migration; an older schema has to be regenerated, and
+	// one written by a newer build is left alone rather than downgraded.
+	int version = schema_version(db);
+	if (version < BUSHI_SCHEMA_VERSION) {
+		err("database '%s' uses an outdated schema, regenerate it",
+		    path);
+		sqlite3_close(db);
+		return NULL;
+	}
+	if (version != INT_MAX && version > BUSHI_SCHEMA_VERSION) {
+		err("database '%s' uses schema %d, newer than %d", path,
+		    version, BUSHI_SCHEMA_VERSION);
+		sqlite3_close(db);
+		return NULL;
+	}
 
+	// https://sqlite.org/pragma.html#pragma_synchronous
 	char *errmsg = NULL;
-	rc = sqlite3_exec(db, schema, NULL, NULL, &errmsg);
+	rc = sqlite3_exec(db, "PRAGMA synchronous = OFF", NULL, NULL, &errmsg);
+	if (rc == SQLITE_OK)
+		rc = sqlite3_exec(db, schema, NULL, NULL, &errmsg);
 	if (rc != SQLITE_OK) {
 		err("cannot initialize database '%s': %s", path,
 		    errmsg ? errmsg : sqlite3_errmsg(db));
@@ -318,6 +802,17 @@ db_open(const char *path)
 		return NULL;
 	}
 
+	char *pragma =
+	    sqlite3_mprintf("PRAGMA user_version = %d", BUSHI_SCHEMA_VERSION);
+	rc = sqlite3_exec(db, pragma, NULL, NULL, NULL);
+	sqlite3_free(pragma);
+	if (rc != SQLITE_OK) {
+		err("cannot set schema version of '%s': %s", path,
+		    sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return NULL;
+	}
+
 	dbg("schema initialized, preparing %d statements", STMT_COUNT);
 
 	for (int i = 0; i < STMT_COUNT; i++) {
@@ -389,20 +884,40 @@ static void
 print_usage(FILE *stream, const char *prog)
 {
 	fprintf(stream,
-		"Usage: %s [-t DATABASE] [OPTIONS] NAME\n"
+		"Usage: %s [-t DATABASE] [OPTIONS] NAME...\n"
+		"       %s [-t DATABASE] -q [-e|-F|-P CURSOR] [-L] [-b REF] [-n LIMIT] NAME [PATH...]\n"
+		"       %s [-t DATABASE] -q [-L] [-b [A..]REF] [-T SINCE..UNTIL] [-n LIMIT] NAME [PATH]\n"
+		"       %s -S DIR -q [-b REF] [-n LIMIT] NAME [PATH]\n"
 		"\n"
 		"Index git repository metadata into an SQLite database.\n"
 		"\n"
 		"\t-a PATH       Add a repository from PATH\n"
+		"\t-A            Sync all indexed repositories\n"
 		"\t-t DATABASE   SQLite database path\n"
 		"\t-c            Check repository consistency\n"
 		"\t-f            Fix missing objects\n"
 		"\t-s            Show repository status\n"
 		"\t-r            Remove a repository from the index\n"
 		"\t-l            List indexed repositories\n"
+		"\t-w            Watch all repositories, sync on ref updates\n"
+		"\t-q            Print the history of NAME, or of PATHs in it\n"
+		"\t-e            With -q, list the entries of directory PATH\n"
+		"\t-F            With -q, follow file PATH across renames\n"
+		"\t-L            With -q, add author date, author and subject\n"
+		"\t-b REF        Start -q at REF or a commit hash, not the default\n"
+		"\t              branch; A..REF leaves out the first-parent\n"
+		"\t              history of A\n"
+		"\t-T S..U       Only commits of -q with times from S to U, in\n"
+		"\t              seconds since the epoch; either may be empty\n"
+		"\t-P CURSOR     Print one page of -n commits from CURSOR, or the\n"
+		"\t              first for '-', and the next page's cursor on stderr\n"
+		"\t-n LIMIT      Print at most LIMIT commits or entries with -q\n"
+		"\t-S DIR        Write a snapshot of each synced repository to\n"
+		"\t              DIR/NAME.snap; with -q, read it instead\n"
+		"\t-j JOBS       Worker threads for sync and backfill (default: CPUs)\n"
 		"\t-d            Enable debug output\n"
 		"",
-		prog);
+		prog, prog, prog, prog);
 }
 
 enum Mode {
@@ -413,6 +928,8 @@ enum Mode {
 	MODE_STATUS, // -s
 	MODE_REMOVE, // -r
 	MODE_LIST,   // -l
+	MODE_WATCH,  // -w
+	MODE_QUERY,  // -q
 };
 
 void
@@ -523,6 +1040,26 @@ determine_repository_name(const char *path)
 	return name;
 }
 
+// bushi.renameLimit turns on rename detection for a repository. Files
+// moved unchanged are always found; the others only in commits with at
+// most that many pairs of deleted and added files to compare. -1 when
+// unset.
+static int64_t
+determine_rename_limit(void)
+{
+	char *value = value_from_config("bushi.renameLimit");
+	unsigned long limit;
+	int64_t ret = -1;
+
+	if (value && git_parse_ulong(value, &limit))
+		ret = limit > INT64_MAX ? INT64_MAX : (int64_t)limit;
+	else if (value)
+		err("invalid bushi.renameLimit: %s", value);
+
+	free(value);
+	return ret;
+}
+
 void
 run_add(const char *path)
 {
@@ -585,582 +1122,3771 @@ out:
 	free(gitdir);
 }
 
-static int64_t
-get_commit_id(int64_t repository_id, const char *hash)
+// Object ids are stored as raw hash BLOBs; hex only exists at the edges.
+static void
+bind_oid(sqlite3_stmt *stmt, int col, const struct object_id *oid)
 {
-	sqlite3_stmt *stmt = stmts[STMT_GET_COMMIT_ID];
-	sqlite3_reset(stmt);
-	sqlite3_bind_int64(stmt, 1, repository_id);
-	sqlite3_bind_text(stmt, 2, hash, -1, SQLITE_STATIC);
-
-	int64_t commit_id = 0;
-	int rc = sqlite3_step(stmt);
-	if (rc == SQLITE_ROW)
-		commit_id = sqlite3_column_int64(stmt, 0);
-	return commit_id;
+	if (oid)
+		sqlite3_bind_blob(stmt, col, oid->hash, the_hash_algo->rawsz,
+				  SQLITE_STATIC);
+	else
+		sqlite3_bind_null(stmt, col);
 }
 
 static bool
-commit_exists(int64_t repository_id, const char *hash)
+column_oid(sqlite3_stmt *stmt, int col, struct object_id *oid)
 {
-	return get_commit_id(repository_id, hash) != 0;
+	const void *hash = sqlite3_column_blob(stmt, col);
+
+	if (!hash ||
+	    (size_t)sqlite3_column_bytes(stmt, col) != the_hash_algo->rawsz)
+		return false;
+	oidread(oid, hash, the_hash_algo);
+	return true;
 }
 
+// Every commit of the repository being synced, hash -> commit_id. Open
+// addressing like struct idmap; the hash bytes are already uniformly
+// distributed, so their first word is the slot.
+struct commit_map {
+	unsigned char *hashes; // cap * rawsz bytes
+	int64_t *ids;	       // 0 means empty slot
+	size_t rawsz;
+	size_t cap;
+	size_t size;
+};
+
+static struct commit_map commit_map;
+
 static void
-insert_commit(int64_t repository_id, const char *hash, const char *parent_hash)
+commit_map_init(struct commit_map *m, size_t rawsz, size_t num_commits)
 {
-	sqlite3_stmt *stmt = stmts[STMT_INSERT_COMMIT];
-	sqlite3_reset(stmt);
-	sqlite3_bind_text(stmt, 1, hash, -1, SQLITE_STATIC);
-	sqlite3_bind_text(stmt, 2, parent_hash, -1, SQLITE_STATIC);
-	sqlite3_bind_int64(stmt, 3, repository_id);
-
-	int rc = sqlite3_step(stmt);
-	if (rc != SQLITE_DONE)
-		err("failed to insert commit %s: %s", hash,
-		    sqlite3_errmsg(conn));
+	m->rawsz = rawsz;
+	m->cap = 32;
+	while (m->cap < num_commits * 1.5)
+		m->cap *= 2;
+	CALLOC_ARRAY(m->hashes, st_mult(m->cap, rawsz));
+	CALLOC_ARRAY(m->ids, m->cap);
+	m->size = 0;
 }
 
-static int64_t
-get_or_insert_path_id(const char *path)
+static void
+commit_map_clear(struct commit_map *m)
 {
-	// Fast in-memory lookup for path_id.
-	int64_t path_id = (intptr_t)strmap_get(&path_map, path);
-	if (path_id)
-		return path_id;
-
-	// Cache miss: try the database first.
-	sqlite3_stmt *get_path = stmts[STMT_GET_PATH_ID];
-	sqlite3_reset(get_path);
-	sqlite3_bind_text(get_path, 1, path, -1, SQLITE_STATIC);
-	int rc = sqlite3_step(get_path);
-	if (rc == SQLITE_ROW) {
-		path_id = sqlite3_column_int64(get_path, 0);
-		goto cache;
-	}
+	free(m->hashes);
+	free(m->ids);
+	memset(m, 0, sizeof(*m));
+}
 
-	// Not in DB either: insert a new path.
-	sqlite3_stmt *insert_path = stmts[STMT_INSERT_PATH];
-	sqlite3_reset(insert_path);
-	sqlite3_bind_text(insert_path, 1, path, -1, SQLITE_STATIC);
-	rc = sqlite3_step(insert_path);
-	if (rc != SQLITE_DONE) {
-		err("failed to insert path %s: %s", path, sqlite3_errmsg(conn));
-		return 0;
+static size_t
+commit_map_slot(const struct commit_map *m, const unsigned char *hash)
+{
+	size_t i;
+	memcpy(&i, hash, sizeof(i));
+	i &= m->cap - 1;
+	while (m->ids[i] != 0 &&
+	       memcmp(m->hashes + i * m->rawsz, hash, m->rawsz)) {
+		i++;
+		if (i == m->cap)
+			i = 0;
 	}
-	path_id = sqlite3_last_insert_rowid(conn);
-
-cache:
-	strmap_put(&path_map, path, (void *)(intptr_t)path_id);
-	return path_id;
+	return i;
 }
 
 static void
-insert_change_row(int64_t commit_id, int64_t path_id, const char *path)
+commit_map_put(struct commit_map *m, const struct object_id *oid,
+	       int64_t commit_id)
 {
-	sqlite3_stmt *stmt = stmts[STMT_INSERT_CHANGE];
+	if (m->size * 3 >= m->cap * 2) {
+		struct commit_map old = *m;
+		commit_map_init(m, old.rawsz, old.cap);
+		for (size_t i = 0; i < old.cap; i++) {
+			if (!old.ids[i])
+				continue;
+			size_t j = commit_map_slot(m, old.hashes + i * old.rawsz);
+			memcpy(m->hashes + j * m->rawsz,
+			       old.hashes + i * old.rawsz, old.rawsz);
+			m->ids[j] = old.ids[i];
+			m->size++;
+		}
+		commit_map_clear(&old);
+	}
 
-	sqlite3_reset(stmt);
-	sqlite3_bind_int64(stmt, 1, commit_id);
-	sqlite3_bind_int64(stmt, 2, path_id);
+	size_t i = commit_map_slot(m, oid->hash);
+	if (m->ids[i] == 0) {
+		m->size++;
+		memcpy(m->hashes + i * m->rawsz, oid->hash, m->rawsz);
+	}
+	m->ids[i] = commit_id;
+}
 
-	int rc = sqlite3_step(stmt);
-	if (rc != SQLITE_DONE)
-		err("failed to insert change for path %s: %s", path,
-		    sqlite3_errmsg(conn));
+// use 0 to indicate "not found".
+static int64_t
+commit_map_get(const struct commit_map *m, const struct object_id *oid)
+{
+	return m->ids[commit_map_slot(m, oid->hash)];
 }
 
+// Load the commits of a repository once per sync, so the history walk
+// never has to ask the database whether a commit is indexed. kept is the
+// map a previous sync left, taken over as long as the database still
+// holds exactly as many commits.
 static void
-insert_changes_for_commit(int64_t repository_id, struct commit *commit)
+load_commit_map(int64_t repository_id, struct commit_map *kept)
 {
-	struct diff_options opt;
+	sqlite3_stmt *stmt = stmts[STMT_STATUS_COMMIT_COUNT];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, repository_id);
 
-	repo_diff_setup(the_repository, &opt);
-	opt.flags.recursive = 1;
-	opt.detect_rename = 0;
-	opt.output_format = DIFF_FORMAT_NO_OUTPUT;
-	diff_setup_done(&opt);
+	size_t num_commits = 0;
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		num_commits = sqlite3_column_int64(stmt, 0);
 
-	repo_parse_commit(the_repository, commit);
+	if (kept->ids && kept->size == num_commits) {
+		commit_map = *kept;
+		memset(kept, 0, sizeof(*kept));
+		dbg("reusing %zu known commits", commit_map.size);
+		return;
+	}
+	commit_map_clear(kept);
 
-	// Only diff against the first parent.
-	if (commit->parents)
-		diff_tree_oid(&commit->parents->item->object.oid,
-			      &commit->object.oid, "", &opt);
-	else
-		diff_root_tree_oid(&commit->object.oid, "", &opt);
+	commit_map_init(&commit_map, the_hash_algo->rawsz, num_commits);
 
-	diffcore_std(&opt);
+	stmt = stmts[STMT_LOAD_COMMIT_IDS];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, repository_id);
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		struct object_id oid;
+		int64_t commit_id = sqlite3_column_int64(stmt, 1);
 
-	struct strset dir_set;
-	strset_init(&dir_set);
-	struct strbuf dir = STRBUF_INIT;
+		if (!column_oid(stmt, 0, &oid)) {
+			err("invalid hash for commit %" PRId64, commit_id);
+			continue;
+		}
+		commit_map_put(&commit_map, &oid, commit_id);
+	}
 
-	int64_t commit_id =
-	    get_commit_id(repository_id, oid_to_hex(&commit->object.oid));
-	if (!commit_id)
-		goto cleanup;
+	dbg("loaded %zu known commits", commit_map.size);
+}
 
-	for (int i = 0; i < diff_queued_diff.nr; i++) {
-		struct diff_filepair *p = diff_queued_diff.queue[i];
-		const char *path = p->two->path ? p->two->path : p->one->path;
+// commits.commit_id is AUTOINCREMENT; the walker hands out ids itself, in
+// the same order the writer inserts them, so each queued commit knows its
+// commit_id before it reaches the database.
+static int64_t
+next_commit_id(void)
+{
+	sqlite3_stmt *stmt = stmts[STMT_NEXT_COMMIT_ID];
+	sqlite3_reset(stmt);
 
-		int64_t path_id = get_or_insert_path_id(path);
-		if (!path_id)
-			goto cleanup;
+	int64_t commit_id = 1;
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		commit_id = sqlite3_column_int64(stmt, 0);
+	return commit_id;
+}
 
-		insert_change_row(commit_id, path_id, path);
+// What the commits table keeps of a commit besides its links, read from
+// the commit object by a diff worker.
+struct commit_meta {
+	struct strbuf author_name; // empty when the author line is unparsable
+	struct strbuf author_email;
+	timestamp_t author_time;
+	timestamp_t commit_time;
+	struct strbuf subject;
+};
 
-		const char *slash = strchr(path, '/');
-		while (slash) {
-			const char *cur = slash;
-			slash = strchr(slash + 1, '/');
+// Rows added by a sync, staged by its writer and handed to backfill so
+// it does not have to read them back. Commits arrive in commit_id order,
+// and each one owns a run of path ids in path_ids.
+struct staged_commit {
+	int64_t commit_id;
+	struct object_id oid;
+	struct object_id parent_oid;
+	bool has_parent;
+	size_t changes_end; // end of this commit's run in path_ids
+
+	int64_t author_id; // 0 for none
+	timestamp_t author_time;
+	timestamp_t commit_time;
+	char *subject;
+};
 
-			// do not create a path record for root
-			if (cur == path)
-				continue;
+struct staged_rows {
+	int64_t repository_id;
 
-			strbuf_reset(&dir);
-			strbuf_add(&dir, path, cur - path + 1);
+	// A first import writes nothing until bulk_finish() loads the rows
+	// in primary-key order.
+	bool bulk;
+	int64_t existing_commits; // in the database, all repositories
 
-			// deduplicated within this commit
-			if (strset_contains(&dir_set, dir.buf))
-				continue;
+	// A commit row failed to go in after the walker mapped its id.
+	bool commits_failed;
 
-			strset_add(&dir_set, dir.buf);
-			int64_t dir_id = get_or_insert_path_id(dir.buf);
-			if (!dir_id)
-				goto cleanup;
+	struct staged_commit *commits;
+	size_t commits_nr;
+	size_t commits_alloc;
 
-			insert_change_row(commit_id, dir_id, dir.buf);
-		}
-	}
+	int64_t *path_ids;
+	size_t path_ids_nr;
+	size_t path_ids_alloc;
+};
 
-cleanup:
-	strbuf_release(&dir);
-	strset_clear(&dir_set);
-	diff_flush(&opt);
-}
+// Set during a sync.
+static struct staged_rows *staged = NULL;
 
 static void
-walk_commit_history(int64_t repository_id, struct commit *commit)
+bind_commit_meta(sqlite3_stmt *stmt, int col, int64_t author_id,
+		 timestamp_t author_time, timestamp_t commit_time,
+		 const char *subject)
+{
+	if (author_id)
+		sqlite3_bind_int64(stmt, col, author_id);
+	else
+		sqlite3_bind_null(stmt, col);
+	sqlite3_bind_int64(stmt, col + 1, author_time);
+	sqlite3_bind_int64(stmt, col + 2, commit_time);
+	sqlite3_bind_text(stmt, col + 3, subject, -1, SQLITE_STATIC);
+}
+
+static bool
+insert_commit(int64_t commit_id, int64_t repository_id,
+	      const struct object_id *oid, const struct object_id *parent_oid,
+	      int64_t author_id, const struct commit_meta *meta)
 {
-	struct commit_list *stack = NULL;
-	commit_list_insert(commit, &stack);
+	if (staged) {
+		ALLOC_GROW(staged->commits, staged->commits_nr + 1,
+			   staged->commits_alloc);
+		struct staged_commit *c =
+		    &staged->commits[staged->commits_nr++];
+		c->commit_id = commit_id;
+		oidcpy(&c->oid, oid);
+		c->has_parent = parent_oid != NULL;
+		if (parent_oid)
+			oidcpy(&c->parent_oid, parent_oid);
+		c->changes_end = staged->path_ids_nr;
+		c->author_id = author_id;
+		c->author_time = meta->author_time;
+		c->commit_time = meta->commit_time;
+		c->subject = NULL;
+		if (staged->bulk) {
+			// loaded by bulk_finish(), after the buffer is reused
+			c->subject = xstrdup(meta->subject.buf);
+			return true;
+		}
+	}
 
-	while (stack) {
-		struct commit *c = pop_commit(&stack);
-		const char *hash = oid_to_hex(&c->object.oid);
+	sqlite3_stmt *stmt = stmts[STMT_INSERT_COMMIT];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, commit_id);
+	bind_oid(stmt, 2, oid);
+	bind_oid(stmt, 3, parent_oid);
+	sqlite3_bind_int64(stmt, 4, repository_id);
+	bind_commit_meta(stmt, 5, author_id, meta->author_time,
+			 meta->commit_time, meta->subject.buf);
 
-		// If this commit is already indexed, skip it and its ancestors.
-		if (commit_exists(repository_id, hash))
-			continue;
+	int rc = sqlite3_step(stmt);
+	if (rc != SQLITE_DONE) {
+		char hex[GIT_MAX_HEXSZ + 1];
 
-		repo_parse_commit(the_repository, c);
+		// oid_to_hex() uses static buffers; this runs on the writer.
+		err("failed to insert commit %s: %s", oid_to_hex_r(hex, oid),
+		    sqlite3_errmsg(conn));
+		if (staged)
+			staged->commits_failed = true;
+		return false;
+	}
+	return true;
+}
 
-		// Record only the first parent in the commits table.
-		const char *parent_hash = NULL;
-		if (c->parents)
-			parent_hash = oid_to_hex(&c->parents->item->object.oid);
+// Cached path record, keyed by its parent directory and its basename.
+struct path_entry {
+	struct hashmap_entry ent;
+	int64_t parent_id;
+	int64_t path_id;
+	size_t len;
+	char name[FLEX_ARRAY];
+};
 
-		insert_commit(repository_id, hash, parent_hash);
-		insert_changes_for_commit(repository_id, c);
+struct path_key {
+	int64_t parent_id;
+	const char *name;
+	size_t len;
+};
 
-		// Walk up through *all* parents.
-		for (struct commit_list *p = c->parents; p; p = p->next)
-			commit_list_insert(p->item, &stack);
-	}
+static unsigned int
+path_hash(const struct path_key *key)
+{
+	return memhash(key->name, key->len) ^
+	       (unsigned int)(key->parent_id * 0x9e3779b1u);
 }
 
+// Entries are unique, so the map only ever compares an entry to a key.
 static int
-walk_ref_commits(const struct reference *ref, void *cb_data)
+path_entry_cmp(const void *cmp_data UNUSED, const struct hashmap_entry *eptr,
+	       const struct hashmap_entry *entry_or_key UNUSED,
+	       const void *keydata)
+{
+	const struct path_entry *e =
+	    container_of(eptr, const struct path_entry, ent);
+	const struct path_key *key = keydata;
+
+	return e->parent_id != key->parent_id || e->len != key->len ||
+	       memcmp(e->name, key->name, key->len);
+}
+
+static int64_t
+get_or_insert_path_id(int64_t parent_id, const char *name, size_t len)
 {
-	int64_t repository_id = *(int64_t *)cb_data;
+	struct path_key key = {parent_id, name, len};
+	unsigned int hash = path_hash(&key);
+
+	// Fast in-memory lookup for path_id.
+	struct path_entry *e = hashmap_get_entry_from_hash(
+	    &path_map, hash, &key, struct path_entry, ent);
+	if (e)
+		return e->path_id;
 
-	// Resolve ref to a commit; skip anything that is not a commit.
-	struct commit *commit =
-	    lookup_commit_reference_gently(the_repository, ref->oid, 1);
-	if (!commit)
+	// Cache miss: try the database first.
+	int64_t path_id;
+	sqlite3_stmt *get_path = stmts[STMT_GET_PATH_ID];
+	sqlite3_reset(get_path);
+	sqlite3_bind_int64(get_path, 1, parent_id);
+	sqlite3_bind_text(get_path, 2, name, len, SQLITE_STATIC);
+	int rc = sqlite3_step(get_path);
+	if (rc == SQLITE_ROW) {
+		path_id = sqlite3_column_int64(get_path, 0);
+		goto cache;
+	}
+
+	// Not in DB either: insert a new path.
+	sqlite3_stmt *insert_path = stmts[STMT_INSERT_PATH];
+	sqlite3_reset(insert_path);
+	sqlite3_bind_int64(insert_path, 1, parent_id);
+	sqlite3_bind_text(insert_path, 2, name, len, SQLITE_STATIC);
+	rc = sqlite3_step(insert_path);
+	if (rc != SQLITE_DONE) {
+		err("failed to insert path %.*s under %" PRId64 ": %s",
+		    (int)len, name, parent_id, sqlite3_errmsg(conn));
 		return 0;
+	}
+	path_id = sqlite3_last_insert_rowid(conn);
 
-	walk_commit_history(repository_id, commit);
-	return 0;
+cache:
+	FLEX_ALLOC_MEM(e, name, name, len);
+	e->parent_id = parent_id;
+	e->path_id = path_id;
+	e->len = len;
+	hashmap_entry_init(&e->ent, hash);
+	hashmap_add(&path_map, &e->ent);
+	return path_id;
 }
 
-static int
-insert_ref(const struct reference *ref, void *cb_data)
+// The author record of a commit, looked up like a path record, or 0 when
+// the commit has no parsable author.
+static int64_t
+get_or_insert_author_id(const struct commit_meta *meta)
 {
-	int64_t repository_id = *(int64_t *)cb_data;
+	struct strbuf key = STRBUF_INIT;
+	int64_t author_id;
 
-	struct commit *commit =
-	    lookup_commit_reference_gently(the_repository, ref->oid, 1);
-	if (!commit)
+	if (!meta->author_name.len && !meta->author_email.len)
 		return 0;
 
-	int64_t commit_id =
-	    get_commit_id(repository_id, oid_to_hex(&commit->object.oid));
-	if (!commit_id) {
-		err("ref %s points to unknown commit %s", ref->name,
-		    oid_to_hex(&commit->object.oid));
-		return 0;
+	strbuf_addf(&key, "%s <%s>", meta->author_name.buf,
+		    meta->author_email.buf);
+	author_id = strintmap_get(&author_map, key.buf);
+	if (author_id)
+		goto out;
+
+	sqlite3_stmt *get_author = stmts[STMT_GET_AUTHOR_ID];
+	sqlite3_reset(get_author);
+	sqlite3_bind_text(get_author, 1, meta->author_name.buf, -1,
+			  SQLITE_STATIC);
+	sqlite3_bind_text(get_author, 2, meta->author_email.buf, -1,
+			  SQLITE_STATIC);
+	if (sqlite3_step(get_author) == SQLITE_ROW) {
+		author_id = sqlite3_column_int64(get_author, 0);
+		goto cache;
 	}
 
-	const char *show_name = ref->name;
-	int ref_type = 0;
-	if (starts_with(ref->name, "refs/heads/")) {
-		show_name = ref->name + strlen("refs/heads/");
-		ref_type = 0;
-	} else if (starts_with(ref->name, "refs/tags/")) {
-		show_name = ref->name + strlen("refs/tags/");
-		ref_type = 1;
-	} else {
-		return 0; // skip refs/notes, refs/remotes, etc.
+	sqlite3_stmt *insert_author = stmts[STMT_INSERT_AUTHOR];
+	sqlite3_reset(insert_author);
+	sqlite3_bind_text(insert_author, 1, meta->author_name.buf, -1,
+			  SQLITE_STATIC);
+	sqlite3_bind_text(insert_author, 2, meta->author_email.buf, -1,
+			  SQLITE_STATIC);
+	if (sqlite3_step(insert_author) != SQLITE_DONE) {
+		err("failed to insert author %s: %s", key.buf,
+		    sqlite3_errmsg(conn));
+		goto out;
 	}
+	author_id = sqlite3_last_insert_rowid(conn);
+
+cache:
+	strintmap_set(&author_map, key.buf, author_id);
+out:
+	strbuf_release(&key);
+	return author_id;
+}
+
+static void
+insert_change_row(int64_t commit_id, int64_t path_id)
+{
+	if (staged) {
+		// always for the commit staged last
+		ALLOC_GROW(staged->path_ids, staged->path_ids_nr + 1,
+			   staged->path_ids_alloc);
+		staged->path_ids[staged->path_ids_nr++] = path_id;
+		staged->commits[staged->commits_nr - 1].changes_end =
+		    staged->path_ids_nr;
+		if (staged->bulk)
+			return;
+	}
+
+	sqlite3_stmt *stmt = stmts[STMT_INSERT_CHANGE];
 
-	// ref_time is the commit timestamp in Unix seconds.
-	sqlite3_stmt *stmt = stmts[STMT_UPSERT_REF];
 	sqlite3_reset(stmt);
-	sqlite3_bind_text(stmt, 1, ref->name, -1, SQLITE_STATIC);
-	sqlite3_bind_text(stmt, 2, show_name, -1, SQLITE_STATIC);
-	sqlite3_bind_int64(stmt, 3, commit_id);
-	sqlite3_bind_int64(stmt, 4, commit->date);
-	sqlite3_bind_int64(stmt, 5, ref_type);
-	sqlite3_bind_int64(stmt, 6, repository_id);
+	sqlite3_bind_int64(stmt, 1, commit_id);
+	sqlite3_bind_int64(stmt, 2, path_id);
 
 	int rc = sqlite3_step(stmt);
 	if (rc != SQLITE_DONE)
-		err("failed to insert ref %s: %s", ref->name,
-		    sqlite3_errmsg(conn));
+		err("failed to insert change for path %" PRId64 ": %s",
+		    path_id, sqlite3_errmsg(conn));
+}
 
-	return 0;
+static void
+insert_deletion(int64_t commit_id, int64_t path_id)
+{
+	sqlite3_stmt *stmt = stmts[STMT_INSERT_DELETION];
+
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, commit_id);
+	sqlite3_bind_int64(stmt, 2, path_id);
+
+	int rc = sqlite3_step(stmt);
+	if (rc != SQLITE_DONE)
+		err("failed to insert deletion of path %" PRId64 ": %s",
+		    path_id, sqlite3_errmsg(conn));
 }
 
-struct idmap {
-	int64_t *keys;	// 0 means empty slot
-	uint32_t *vals; // local_idx, UINT32_MAX = not found
-	size_t cap;
-	size_t size;
+// Pairs of deleted and added files a commit may compare by content to
+// find renames in the repository being synced, or -1 when it does not
+// detect them. Set before the diff workers start.
+static int64_t rename_limit = -1;
+
+// Blobs larger than this are only matched when moved unchanged.
+#define RENAME_MAX_BLOB_SIZE (1ul << 20)
+
+// Share of the content a file has to keep to count as renamed, as git's
+// default for -M.
+#define RENAME_MIN_SCORE 50
+
+// A regular file that one side of a commit has and the other does not.
+struct rename_candidate {
+	struct object_id oid;
+	size_t path; // position in the paths of the job
+	bool deleted;
+	bool paired;
+};
+
+// The file at path was renamed from the one at old_path.
+struct rename_pair {
+	size_t path;
+	size_t old_path;
+	int score; // percent of the content kept
+};
+
+// The first len bytes of the changed path at position path name a path the
+// commit removed: the whole of it for a file, up to and including a '/'
+// for a directory.
+struct removed_path {
+	size_t path;
+	size_t len;
+};
+
+// One commit handed from the walker to the diff workers and then, in
+// walk order, to the writer. The slot is reused once the writer is done.
+struct diff_job {
+	int64_t commit_id;
+	struct object_id oid;
+	struct object_id parent_oid; // first parent only
+	bool has_parent;
+	bool done;
+
+	// changed file paths in diff order, each terminated by '\0'
+	struct strbuf paths;
+	size_t nr_paths;
+
+	// removals among them, in the same order
+	struct removed_path *removed;
+	size_t removed_nr, removed_alloc;
+
+	// filled in when renames are detected
+	struct rename_candidate *candidates;
+	size_t candidates_nr, candidates_alloc;
+	struct rename_pair *renames;
+	size_t renames_nr, renames_alloc;
+
+	struct commit_meta meta;
+};
+
+// Commits are enumerated on the calling thread, diffed by a pool of
+// workers and written by a single thread that owns conn. Jobs live in a
+// ring of `window` slots indexed by sequence number, so the writer sees
+// them in exactly the order the walker produced them.
+struct sync_pipeline {
+	int64_t repository_id;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t job_ready;  // walker -> workers
+	pthread_cond_t job_done;   // workers -> writer
+	pthread_cond_t slot_freed; // writer -> walker
+
+	struct diff_job *ring;
+	size_t window;
+
+	uint64_t next_walk;  // next sequence number to enqueue
+	uint64_t next_diff;  // next sequence number to diff
+	uint64_t next_write; // next sequence number to write
+	bool finished;	     // walker has enqueued everything
+
+	pthread_t *workers;
+	int nr_workers;
+	pthread_t writer;
+
+	// walker only
+	int64_t next_commit_id;
+	uint64_t budget; // commits this turn may queue
+	bool cut;	 // the walk stopped at the budget
 };
 
 static void
-idmap_init(struct idmap *m, size_t num_commits)
+collect_path(struct diff_job *job, const struct strbuf *base,
+	     const struct name_entry *entry)
 {
-	m->cap = 32;
-	while (m->cap < num_commits * 1.5)
-		m->cap *= 2;
-	CALLOC_ARRAY(m->keys, m->cap);
-	CALLOC_ARRAY(m->vals, m->cap);
-	m->size = 0;
+	strbuf_addbuf(&job->paths, base);
+	strbuf_add(&job->paths, entry->path, entry->pathlen);
+	strbuf_addch(&job->paths, '\0');
+	job->nr_paths++;
 }
 
+// Empty files are all alike, so moving one says nothing about another.
 static void
-idmap_clear(struct idmap *m)
+add_rename_candidate(struct diff_job *job, const struct name_entry *entry,
+		     bool deleted)
 {
-	free(m->keys);
-	free(m->vals);
-	m->keys = NULL;
-	m->vals = NULL;
-	m->cap = 0;
-	m->size = 0;
-}
+	if (!S_ISREG(entry->mode) ||
+	    oideq(&entry->oid, the_hash_algo->empty_blob))
+		return;
 
-static size_t
-idmap_slot(const struct idmap *m, int64_t key)
-{
-	size_t i = (size_t)(key & (int64_t)(m->cap - 1));
-	while (m->keys[i] != 0 && m->keys[i] != key) {
-		i++;
-		if (i == m->cap)
-			i = 0;
-	}
-	return i;
+	ALLOC_GROW(job->candidates, job->candidates_nr + 1,
+		   job->candidates_alloc);
+	struct rename_candidate *c = &job->candidates[job->candidates_nr++];
+	oidcpy(&c->oid, &entry->oid);
+	c->path = job->nr_paths;
+	c->deleted = deleted;
+	c->paired = false;
 }
 
-static void
-idmap_put(struct idmap *m, int64_t key, uint32_t val)
+// Character at position i of a tree entry name, where directory names
+// behave as if they had a trailing '/', which is how git sorts trees.
+static unsigned char
+tree_entry_char(const struct name_entry *entry, size_t i)
 {
-	size_t i = idmap_slot(m, key);
-	if (m->keys[i] == 0) {
-		m->size++;
-		m->keys[i] = key;
-	}
-	m->vals[i] = val;
+	if (i < (size_t)entry->pathlen)
+		return entry->path[i];
+	return S_ISDIR(entry->mode) ? '/' : '\0';
 }
 
-// use UINT32_MAX to indicate "not found".
-static uint32_t
-idmap_get(const struct idmap *m, int64_t key)
+static int
+tree_entry_cmp(const struct name_entry *a, const struct name_entry *b)
 {
-	size_t i = idmap_slot(m, key);
-	return m->keys[i] == key ? m->vals[i] : UINT32_MAX;
+	size_t len = a->pathlen < b->pathlen ? a->pathlen : b->pathlen;
+	int cmp = memcmp(a->path, b->path, len);
+	if (cmp)
+		return cmp;
+	return tree_entry_char(a, len) - tree_entry_char(b, len);
 }
 
-struct backfill_index {
-	uint32_t num_commits;
-
-	struct idmap idmap; // global commit_id -> commit local_idx
-
-	// input commit local_idx
-	int64_t *commit_ids;	// -> global commit_id
-	uint32_t *parent_local; // -> parent local_idx (UINT32_MAX = none)
-	uint32_t *first_depth;	// -> first-parent depth (UINT32_MAX = unknown)
-};
+static void collect_tree_changes(struct strbuf *base,
+				 const struct object_id *old_tree,
+				 const struct object_id *new_tree,
+				 struct diff_job *job);
 
 static void
-backfill_index_free(struct backfill_index *idx)
+add_removed_path(struct diff_job *job, size_t len)
 {
-	if (!idx)
-		return;
-	free(idx->commit_ids);
-	free(idx->parent_local);
-	free(idx->first_depth);
-	idmap_clear(&idx->idmap);
-	free(idx);
+	ALLOC_GROW(job->removed, job->removed_nr + 1, job->removed_alloc);
+	job->removed[job->removed_nr].path = job->nr_paths;
+	job->removed[job->removed_nr].len = len;
+	job->removed_nr++;
 }
 
-struct local_index_stack {
-	uint32_t *items;
-	size_t count;
-	size_t alloc;
-};
-
+// An entry that exists on one side only: a file is a change by itself, a
+// directory contributes every file below it. On the old side the entry
+// is removed, unless it is a directory without a file below it.
 static void
-update_first_depth(int64_t commit_id, uint32_t depth)
+collect_one_side(struct strbuf *base, const struct name_entry *entry,
+		 bool is_old, struct diff_job *job)
 {
-	sqlite3_stmt *stmt = stmts[STMT_UPDATE_FIRST_DEPTH];
-	sqlite3_reset(stmt);
-	sqlite3_bind_int64(stmt, 1, depth);
-	sqlite3_bind_int64(stmt, 2, commit_id);
+	if (!S_ISDIR(entry->mode)) {
+		if (rename_limit >= 0)
+			add_rename_candidate(job, entry, is_old);
+		if (is_old)
+			add_removed_path(job, base->len + entry->pathlen);
+		collect_path(job, base, entry);
+		return;
+	}
 
-	int rc = sqlite3_step(stmt);
-	if (rc != SQLITE_DONE)
-		err("failed to update first_depth: %s", sqlite3_errmsg(conn));
+	size_t baselen = base->len;
+	size_t first = job->nr_paths;
+	strbuf_add(base, entry->path, entry->pathlen);
+	strbuf_addch(base, '/');
+	if (is_old) {
+		add_removed_path(job, base->len);
+		collect_tree_changes(base, &entry->oid, NULL, job);
+		if (job->nr_paths == first)
+			job->removed_nr--;
+	} else {
+		collect_tree_changes(base, NULL, &entry->oid, job);
+	}
+	strbuf_setlen(base, baselen);
 }
 
+// Recursive two-way tree walk producing the same paths, in the same order,
+// as diff_tree_oid() with opt.flags.recursive and no rename detection.
+// diff_tree_oid() queues into the global diff_queued_diff, so it cannot be
+// used from the worker threads.
 static void
-backfill_first_depths(struct backfill_index *idx)
+collect_tree_changes(struct strbuf *base, const struct object_id *old_tree,
+		     const struct object_id *new_tree, struct diff_job *job)
 {
-	struct local_index_stack trail = {0};
+	struct tree_desc t1, t2;
+	struct name_entry e1, e2;
 
-	for (uint32_t i = 0; i < idx->num_commits; i++) {
-		uint32_t curr = i;
-		uint32_t depth;
+	void *buf1 = fill_tree_descriptor(the_repository, &t1, old_tree);
+	void *buf2 = fill_tree_descriptor(the_repository, &t2, new_tree);
 
-		if (idx->first_depth[i] != UINT32_MAX)
-			continue;
+	bool has1 = tree_entry(&t1, &e1);
+	bool has2 = tree_entry(&t2, &e2);
 
-		trail.count = 0;
+	while (has1 || has2) {
+		int cmp = !has1 ? 1 : !has2 ? -1 : tree_entry_cmp(&e1, &e2);
 
-		while (curr != UINT32_MAX &&
-		       idx->first_depth[curr] == UINT32_MAX) {
-			ALLOC_GROW(trail.items, trail.count + 1, trail.alloc);
-			trail.items[trail.count++] = curr;
-			curr = idx->parent_local[curr];
+		if (cmp < 0) {
+			collect_one_side(base, &e1, true, job);
+			has1 = tree_entry(&t1, &e1);
+			continue;
+		}
+		if (cmp > 0) {
+			collect_one_side(base, &e2, false, job);
+			has2 = tree_entry(&t2, &e2);
+			continue;
 		}
 
-		if (curr == UINT32_MAX)
-			depth = 0;
-		else
-			depth = idx->first_depth[curr] + 1;
-
-		while (trail.count) {
-			uint32_t v = trail.items[--trail.count];
-			idx->first_depth[v] = depth;
-			update_first_depth(idx->commit_ids[v], depth);
-			depth++;
+		if (e1.mode != e2.mode || !oideq(&e1.oid, &e2.oid)) {
+			if (S_ISDIR(e1.mode)) {
+				size_t baselen = base->len;
+				strbuf_add(base, e1.path, e1.pathlen);
+				strbuf_addch(base, '/');
+				collect_tree_changes(base, &e1.oid, &e2.oid,
+						     job);
+				strbuf_setlen(base, baselen);
+			} else {
+				collect_path(job, base, &e2);
+			}
 		}
+		has1 = tree_entry(&t1, &e1);
+		has2 = tree_entry(&t2, &e2);
 	}
 
-	free(trail.items);
+	free(buf1);
+	free(buf2);
 }
 
-static struct backfill_index *
-build_backfill_index(int64_t repository_id)
+// Bytes of a blob that fall in chunks with the same hash. A chunk is a
+// line, or 64 bytes of a longer one, as in git's rename detection.
+struct chunk_count {
+	uint32_t hash;
+	uint32_t bytes;
+};
+
+struct blob_chunks {
+	struct chunk_count *chunks;
+	size_t nr, alloc;
+	unsigned long size;
+	bool valid;
+};
+
+static int
+chunk_count_cmp(const void *va, const void *vb)
 {
-	struct backfill_index *idx = xcalloc(1, sizeof(*idx));
-	struct backfill_index *result = NULL;
+	const struct chunk_count *a = va, *b = vb;
 
-	sqlite3_stmt *stmt = stmts[STMT_BACKFILL_LOAD_COMMITS];
-	sqlite3_reset(stmt);
-	sqlite3_bind_int64(stmt, 1, repository_id);
+	return a->hash < b->hash ? -1 : a->hash > b->hash;
+}
 
-	int64_t *commit_ids = NULL;
-	int64_t *parent_ids = NULL;
-	size_t commit_ids_alloc = 0;
-	size_t parent_ids_alloc = 0;
-	uint32_t num = 0; // local index, starts at 0
+static void
+count_blob_chunks(const struct object_id *oid, struct blob_chunks *bc)
+{
+	enum object_type type;
+	unsigned long size;
 
-	while (sqlite3_step(stmt) == SQLITE_ROW) {
-		ALLOC_GROW(commit_ids, num + 1, commit_ids_alloc);
-		ALLOC_GROW(parent_ids, num + 1, parent_ids_alloc);
+	type = odb_read_object_info(the_repository->objects, oid, &size);
+	if (type != OBJ_BLOB || size > RENAME_MAX_BLOB_SIZE)
+		return;
+	unsigned char *buf =
+	    odb_read_object(the_repository->objects, oid, &type, &size);
+	if (!buf)
+		return;
 
-		commit_ids[num] = sqlite3_column_int64(stmt, 0);
-		if (sqlite3_column_type(stmt, 1) == SQLITE_NULL)
-			parent_ids[num] = 0;
-		else
-			parent_ids[num] = sqlite3_column_int64(stmt, 1);
-		num++;
+	for (unsigned long i = 0; i < size;) {
+		uint32_t hash = 2166136261u;
+		uint32_t len = 0;
 
-		if (num == UINT32_MAX) {
-			err("backfill index reached UINT32_MAX commits");
-			break;
+		while (i + len < size && len < 64) {
+			unsigned char c = buf[i + len++];
+			hash = (hash ^ c) * 16777619u;
+			if (c == '\n')
+				break;
 		}
+		ALLOC_GROW(bc->chunks, bc->nr + 1, bc->alloc);
+		bc->chunks[bc->nr].hash = hash;
+		bc->chunks[bc->nr].bytes = len;
+		bc->nr++;
+		i += len;
+	}
+	free(buf);
+
+	// Sorted and merged, two blobs compare in one pass.
+	QSORT(bc->chunks, bc->nr, chunk_count_cmp);
+	size_t nr = 0;
+	for (size_t i = 0; i < bc->nr; i++) {
+		if (nr && bc->chunks[nr - 1].hash == bc->chunks[i].hash)
+			bc->chunks[nr - 1].bytes += bc->chunks[i].bytes;
+		else
+			bc->chunks[nr++] = bc->chunks[i];
 	}
+	bc->nr = nr;
+	bc->size = size;
+	bc->valid = true;
+}
 
-	REALLOC_ARRAY(commit_ids, num);
-	idx->commit_ids = commit_ids;
-	idx->num_commits = num;
+// Percent of the larger blob that the other one has too.
+static int
+blob_similarity(const struct blob_chunks *a, const struct blob_chunks *b)
+{
+	unsigned long max = a->size > b->size ? a->size : b->size;
+	unsigned long min = a->size < b->size ? a->size : b->size;
+	uint64_t common = 0;
 
-	if (num == 0 || num == UINT32_MAX)
-		goto cleanup;
+	if (!a->valid || !b->valid || !max ||
+	    min * 100 < max * RENAME_MIN_SCORE)
+		return 0;
 
-	idmap_init(&idx->idmap, num);
-	for (uint32_t i = 0; i < num; i++)
-		idmap_put(&idx->idmap, idx->commit_ids[i], i);
+	for (size_t i = 0, j = 0; i < a->nr && j < b->nr;) {
+		if (a->chunks[i].hash < b->chunks[j].hash) {
+			i++;
+		} else if (a->chunks[i].hash > b->chunks[j].hash) {
+			j++;
+		} else {
+			uint32_t x = a->chunks[i++].bytes;
+			uint32_t y = b->chunks[j++].bytes;
+			common += x < y ? x : y;
+		}
+	}
+	return common * 100 / max;
+}
 
-	CALLOC_ARRAY(idx->parent_local, num);
-	CALLOC_ARRAY(idx->first_depth, num);
-	for (uint32_t i = 0; i < num; i++) {
-		idx->parent_local[i] = UINT32_MAX;
-		idx->first_depth[i] = UINT32_MAX;
-		int64_t parent_id = parent_ids[i];
-		if (!parent_id)
+static void
+add_rename_pair(struct diff_job *job, size_t path, size_t old_path,
+		int score)
+{
+	ALLOC_GROW(job->renames, job->renames_nr + 1, job->renames_alloc);
+	job->renames[job->renames_nr].path = path;
+	job->renames[job->renames_nr].old_path = old_path;
+	job->renames[job->renames_nr].score = score;
+	job->renames_nr++;
+}
+
+// Same content first, deleted before added, then in diff order.
+static int
+rename_candidate_cmp(const void *va, const void *vb)
+{
+	const struct rename_candidate *a = va, *b = vb;
+	int cmp = oidcmp(&a->oid, &b->oid);
+
+	if (cmp)
+		return cmp;
+	if (a->deleted != b->deleted)
+		return a->deleted ? -1 : 1;
+	return a->path < b->path ? -1 : a->path > b->path;
+}
+
+// Best score first, then in candidate order, so that ties always resolve
+// the same way.
+static int
+rename_pair_cmp(const void *va, const void *vb)
+{
+	const struct rename_pair *a = va, *b = vb;
+
+	if (a->score != b->score)
+		return b->score - a->score;
+	if (a->path != b->path)
+		return a->path < b->path ? -1 : 1;
+	return a->old_path < b->old_path ? -1 : a->old_path > b->old_path;
+}
+
+// Match the files the commit added to those it deleted whose content they
+// have, at most rename_limit comparisons.
+static void
+match_similar_files(struct diff_job *job)
+{
+	struct rename_candidate *c = job->candidates;
+	size_t *deleted = NULL, *added = NULL;
+	size_t deleted_nr = 0, deleted_alloc = 0;
+	size_t added_nr = 0, added_alloc = 0;
+
+	for (size_t i = 0; i < job->candidates_nr; i++) {
+		if (c[i].paired)
 			continue;
+		if (c[i].deleted) {
+			ALLOC_GROW(deleted, deleted_nr + 1, deleted_alloc);
+			deleted[deleted_nr++] = i;
+		} else {
+			ALLOC_GROW(added, added_nr + 1, added_alloc);
+			added[added_nr++] = i;
+		}
+	}
 
-		uint32_t parent_local = idmap_get(&idx->idmap, parent_id);
-		if (parent_local == UINT32_MAX) {
-			err("parent %" PRId64 " not found in backfill index",
-			    parent_id);
-			goto cleanup;
+	// Like git's diff.renameLimit, a commit over the limit gets no
+	// inexact matching at all rather than an arbitrary part of it.
+	if (!deleted_nr || !added_nr ||
+	    (uint64_t)deleted_nr * added_nr > (uint64_t)rename_limit) {
+		if (deleted_nr && added_nr)
+			dbg("commit %" PRId64 ": %zu x %zu files exceed "
+			    "bushi.renameLimit",
+			    job->commit_id, deleted_nr, added_nr);
+		goto out;
+	}
+
+	struct blob_chunks *chunks;
+	CALLOC_ARRAY(chunks, job->candidates_nr);
+	for (size_t i = 0; i < deleted_nr; i++)
+		count_blob_chunks(&c[deleted[i]].oid, &chunks[deleted[i]]);
+	for (size_t i = 0; i < added_nr; i++)
+		count_blob_chunks(&c[added[i]].oid, &chunks[added[i]]);
+
+	size_t first = job->renames_nr;
+	for (size_t i = 0; i < added_nr; i++) {
+		for (size_t j = 0; j < deleted_nr; j++) {
+			int score = blob_similarity(&chunks[added[i]],
+						    &chunks[deleted[j]]);
+			if (score >= RENAME_MIN_SCORE)
+				add_rename_pair(job, added[i], deleted[j],
+						score);
 		}
-		idx->parent_local[i] = parent_local;
 	}
+	for (size_t i = 0; i < job->candidates_nr; i++)
+		free(chunks[i].chunks);
+	free(chunks);
+
+	// Scores refer to candidates until each file has kept its best
+	// match; only then do they become paths.
+	struct rename_pair *pairs = job->renames + first;
+	size_t nr = job->renames_nr - first, kept = 0;
+	QSORT(pairs, nr, rename_pair_cmp);
+	for (size_t i = 0; i < nr; i++) {
+		struct rename_candidate *to = &c[pairs[i].path];
+		struct rename_candidate *from = &c[pairs[i].old_path];
+		if (to->paired || from->paired)
+			continue;
+		to->paired = from->paired = true;
+		pairs[kept].path = to->path;
+		pairs[kept].old_path = from->path;
+		pairs[kept].score = pairs[i].score;
+		kept++;
+	}
+	job->renames_nr = first + kept;
+out:
+	free(deleted);
+	free(added);
+}
 
-	result = idx;
+// Find the files the commit moved. Files moved unchanged pair up by
+// object id, which costs nothing beyond sorting; the rest are compared by
+// content within rename_limit.
+static void
+detect_renames(struct diff_job *job)
+{
+	struct rename_candidate *c = job->candidates;
+	size_t nr = job->candidates_nr;
+
+	QSORT(c, nr, rename_candidate_cmp);
+	for (size_t i = 0; i < nr;) {
+		size_t end = i, added;
+		while (end < nr && oideq(&c[end].oid, &c[i].oid))
+			end++;
+		for (added = i; added < end && c[added].deleted; added++)
+			;
+
+		for (size_t j = added; i < added && j < end; i++, j++) {
+			c[i].paired = c[j].paired = true;
+			add_rename_pair(job, c[j].path, c[i].path, 100);
+		}
+		i = end;
+	}
 
-cleanup:
-	free(parent_ids);
-	if (!result)
-		backfill_index_free(idx);
-	return result;
+	if (rename_limit > 0)
+		match_similar_files(job);
 }
 
-struct backfill_buf {
-	uint8_t *bitmap;
-	size_t bitmap_size;
-	uint32_t *pending;
-	size_t pending_cap;
-};
+static void
+diff_commit(struct diff_job *job)
+{
+	struct strbuf base = STRBUF_INIT;
 
+	strbuf_reset(&job->paths);
+	job->nr_paths = 0;
+	job->removed_nr = 0;
+	job->candidates_nr = 0;
+	job->renames_nr = 0;
+
+	// Only diff against the first parent. Commit oids are peeled to
+	// their trees by fill_tree_descriptor().
+	collect_tree_changes(&base, job->has_parent ? &job->parent_oid : NULL,
+			     &job->oid, job);
+
+	// A separate pass over what the diff collected, still on the worker.
+	if (job->candidates_nr)
+		detect_renames(job);
+
+	strbuf_release(&base);
+}
+
+// Longest subject stored, in bytes.
+#define COMMIT_SUBJECT_MAX 256
+
+// Name, email and time of an "author" or "committer" header line.
 static void
-update_last_commit_id(int64_t path_id, int64_t commit_id,
-		      int64_t last_commit_id)
+parse_ident(const char *line, const char *eol, struct strbuf *name,
+	    struct strbuf *email, timestamp_t *time)
 {
-	sqlite3_stmt *stmt = stmts[STMT_BACKFILL_UPDATE_CHANGE];
+	struct ident_split ident;
+
+	if (split_ident_line(&ident, line, eol - line))
+		return;
+	if (name) {
+		strbuf_add(name, ident.name_begin,
+			   ident.name_end - ident.name_begin);
+		strbuf_add(email, ident.mail_begin,
+			   ident.mail_end - ident.mail_begin);
+	}
+	if (ident.date_begin)
+		*time = parse_timestamp(ident.date_begin, NULL, 10);
+}
+
+// Convert a commit object to UTF-8 when its encoding header names another
+// encoding, as git log does, so the index stores text of one encoding.
+// What iconv cannot convert keeps only its ASCII, the rest replaced by
+// '?'. Without the header, git takes a commit to be UTF-8 already.
+static void
+commit_to_utf8(char **buf, unsigned long *size)
+{
+	const char *p = *buf, *end = *buf + *size, *value;
+	char *encoding = NULL;
+
+	while (p < end && *p != '\n') {
+		const char *eol = memchr(p, '\n', end - p);
+
+		if (!eol)
+			eol = end;
+		if (skip_prefix(p, "encoding ", &value)) {
+			encoding = xmemdupz(value, eol - value);
+			break;
+		}
+		p = eol < end ? eol + 1 : end;
+	}
+	if (!encoding || is_encoding_utf8(encoding))
+		goto out;
+
+	size_t len;
+	char *utf8 = reencode_string_len(*buf, *size, "UTF-8", encoding, &len);
+	if (utf8) {
+		free(*buf);
+		*buf = utf8;
+		*size = len;
+		goto out;
+	}
+	for (unsigned long i = 0; i < *size; i++)
+		if ((unsigned char)(*buf)[i] >= 0x80)
+			(*buf)[i] = '?';
+out:
+	free(encoding);
+}
+
+// Read what a history listing shows of the commit. The walk takes parents
+// from the commit-graph, which has neither authors nor messages, so the
+// object is read here, on the worker, like the trees.
+static void
+read_commit_meta(struct diff_job *job)
+{
+	struct commit_meta *meta = &job->meta;
+	enum object_type type;
+	unsigned long size;
+
+	strbuf_reset(&meta->author_name);
+	strbuf_reset(&meta->author_email);
+	strbuf_reset(&meta->subject);
+	meta->author_time = meta->commit_time = 0;
+
+	char *buf = odb_read_object(the_repository->objects, &job->oid, &type,
+				    &size);
+	if (!buf || type != OBJ_COMMIT) {
+		char hex[GIT_MAX_HEXSZ + 1];
+
+		err("cannot read commit %s", oid_to_hex_r(hex, &job->oid));
+		free(buf);
+		return;
+	}
+	commit_to_utf8(&buf, &size);
+
+	// Header lines end at the first empty line; continuation lines,
+	// such as those of a signature, start with a space.
+	const char *p = buf, *end = buf + size, *value;
+	while (p < end && *p != '\n') {
+		const char *eol = memchr(p, '\n', end - p);
+
+		if (!eol)
+			eol = end;
+		if (skip_prefix(p, "author ", &value))
+			parse_ident(value, eol, &meta->author_name,
+				    &meta->author_email, &meta->author_time);
+		else if (skip_prefix(p, "committer ", &value))
+			parse_ident(value, eol, NULL, NULL,
+				    &meta->commit_time);
+		p = eol < end ? eol + 1 : end;
+	}
+
+	// The subject is the first paragraph, its lines joined by spaces.
+	while (p < end && isspace(*p))
+		p++;
+	while (p < end && meta->subject.len <= COMMIT_SUBJECT_MAX) {
+		const char *eol = memchr(p, '\n', end - p);
+		const char *line = p;
+
+		if (!eol)
+			eol = end;
+		p = eol < end ? eol + 1 : end;
+		while (line < eol && isspace(*line))
+			line++;
+		if (line == eol)
+			break;
+		if (meta->subject.len)
+			strbuf_addch(&meta->subject, ' ');
+		strbuf_add(&meta->subject, line, eol - line);
+		strbuf_rtrim(&meta->subject);
+	}
+
+	// Cut a long subject where a UTF-8 character starts.
+	if (meta->subject.len > COMMIT_SUBJECT_MAX) {
+		size_t len = COMMIT_SUBJECT_MAX;
+
+		while (len && (meta->subject.buf[len] & 0xc0) == 0x80)
+			len--;
+		strbuf_setlen(&meta->subject, len);
+	}
+	free(buf);
+}
+
+static void
+insert_rename(int64_t commit_id, int64_t path_id, int64_t old_path_id,
+	      int score)
+{
+	sqlite3_stmt *stmt = stmts[STMT_INSERT_RENAME];
+
 	sqlite3_reset(stmt);
-	sqlite3_bind_int64(stmt, 1, last_commit_id);
-	sqlite3_bind_int64(stmt, 2, commit_id);
-	sqlite3_bind_int64(stmt, 3, path_id);
+	sqlite3_bind_int64(stmt, 1, commit_id);
+	sqlite3_bind_int64(stmt, 2, path_id);
+	sqlite3_bind_int64(stmt, 3, old_path_id);
+	sqlite3_bind_int(stmt, 4, score);
 
 	int rc = sqlite3_step(stmt);
 	if (rc != SQLITE_DONE)
-		err("failed to update last_commit_id: %s",
-		    sqlite3_errmsg(conn));
+		err("failed to insert rename of path %" PRId64 ": %s",
+		    old_path_id, sqlite3_errmsg(conn));
 }
 
+// A directory of the previous path: its record and the offset just past
+// its '/' in that path.
+struct dir_frame {
+	int64_t path_id;
+	size_t end;
+};
+
+// Insert a change row for every file path of the commit and for each of
+// its directories, which are the parent links of the file's record, and a
+// deletion row for each path it removed. Tree diffs list paths
+// depth-first, so the directories shared with the previous path need
+// neither a lookup nor another change row.
 static void
-backfill_one_path(int64_t path_id, int64_t repository_id,
-		  const struct backfill_index *idx, struct backfill_buf *buf)
+insert_changes_for_commit(int64_t commit_id, const struct diff_job *job)
 {
-	sqlite3_stmt *get_commits = stmts[STMT_BACKFILL_PATH_COMMITS];
+	struct dir_frame *dirs = NULL;
+	size_t dirs_nr = 0, dirs_alloc = 0;
+	const char *prev = "";
+
+	// Renames refer to files by their position in the diff.
+	int64_t *file_ids = NULL;
+	if (job->renames_nr)
+		CALLOC_ARRAY(file_ids, job->nr_paths);
+
+	size_t removed = 0;
+	const char *path = job->paths.buf;
+	for (size_t i = 0; i < job->nr_paths; i++, path += strlen(path) + 1) {
+		size_t start = 0;
+		size_t keep = 0;
+		while (keep < dirs_nr &&
+		       !strncmp(prev + start, path + start,
+				dirs[keep].end - start))
+			start = dirs[keep++].end;
+		dirs_nr = keep;
+
+		int64_t parent_id = keep ? dirs[keep - 1].path_id : 0;
+		const char *slash;
+		while ((slash = strchr(path + start, '/'))) {
+			size_t end = slash - path + 1;
+			int64_t dir_id = get_or_insert_path_id(
+			    parent_id, path + start, end - start);
+			if (!dir_id)
+				goto cleanup;
 
-	memset(buf->bitmap, 0, buf->bitmap_size);
-	size_t pending_count = 0;
+			insert_change_row(commit_id, dir_id);
 
-	// Build bitmap of all commits that touched this path in this
-	// repository, and collect pending commit_ids that need updating.
-	sqlite3_reset(get_commits);
-	sqlite3_bind_int64(get_commits, 1, path_id);
-	sqlite3_bind_int64(get_commits, 2, repository_id);
-	while (sqlite3_step(get_commits) == SQLITE_ROW) {
-		int64_t commit_id = sqlite3_column_int64(get_commits, 0);
-		int need_update = sqlite3_column_int(get_commits, 1);
+			ALLOC_GROW(dirs, dirs_nr + 1, dirs_alloc);
+			dirs[dirs_nr].path_id = dir_id;
+			dirs[dirs_nr].end = end;
+			dirs_nr++;
 
-		uint32_t commit_local = idmap_get(&idx->idmap, commit_id);
-		if (commit_local == UINT32_MAX) {
-			err("commit %" PRId64 " not found in backfill index",
-			    commit_id);
-			continue;
+			parent_id = dir_id;
+			start = end;
 		}
 
-		buf->bitmap[commit_local / 8] |= 1u << (commit_local % 8);
+		int64_t path_id = get_or_insert_path_id(
+		    parent_id, path + start, strlen(path + start));
+		if (!path_id)
+			goto cleanup;
 
-		if (need_update) {
-			ALLOC_GROW(buf->pending, pending_count + 1,
-				   buf->pending_cap);
-			buf->pending[pending_count++] = commit_local;
+		insert_change_row(commit_id, path_id);
+		if (file_ids)
+			file_ids[i] = path_id;
+		prev = path;
+
+		// A removed directory is one of those above this file.
+		size_t len = start + strlen(path + start);
+		for (; removed < job->removed_nr &&
+		       job->removed[removed].path == i;
+		     removed++) {
+			size_t end = job->removed[removed].len;
+			int64_t id = end == len ? path_id : 0;
+
+			for (size_t k = 0; !id && k < dirs_nr; k++)
+				if (dirs[k].end == end)
+					id = dirs[k].path_id;
+			if (id)
+				insert_deletion(commit_id, id);
 		}
 	}
 
-	// For each pending commit, walk first-parent chain.
-	for (size_t i = 0; i < pending_count; i++) {
-		uint32_t curr = buf->pending[i];
-		uint32_t last = curr;
+	for (size_t i = 0; i < job->renames_nr; i++) {
+		const struct rename_pair *r = &job->renames[i];
+		insert_rename(commit_id, file_ids[r->path],
+			      file_ids[r->old_path], r->score);
+	}
 
-		uint32_t ancestor = idx->parent_local[curr];
-		while (ancestor != UINT32_MAX) {
-			if (buf->bitmap[ancestor / 8] &
-			    (1u << (ancestor % 8))) {
-				last = ancestor;
-				break;
-			}
-			ancestor = idx->parent_local[ancestor];
+cleanup:
+	free(file_ids);
+	free(dirs);
+}
+
+static void *
+diff_worker(void *data)
+{
+	struct sync_pipeline *pipe = data;
+
+	pthread_mutex_lock(&pipe->mutex);
+	for (;;) {
+		while (pipe->next_diff == pipe->next_walk && !pipe->finished)
+			pthread_cond_wait(&pipe->job_ready, &pipe->mutex);
+		if (pipe->next_diff == pipe->next_walk)
+			break;
+
+		struct diff_job *job =
+		    &pipe->ring[pipe->next_diff++ % pipe->window];
+
+		pthread_mutex_unlock(&pipe->mutex);
+		diff_commit(job);
+		read_commit_meta(job);
+		pthread_mutex_lock(&pipe->mutex);
+
+		job->done = true;
+		pthread_cond_signal(&pipe->job_done);
+	}
+	pthread_mutex_unlock(&pipe->mutex);
+
+	return NULL;
+}
+
+static void *
+write_worker(void *data)
+{
+	struct sync_pipeline *pipe = data;
+
+	pthread_mutex_lock(&pipe->mutex);
+	for (;;) {
+		struct diff_job *job =
+		    &pipe->ring[pipe->next_write % pipe->window];
+
+		while (!job->done &&
+		       !(pipe->finished && pipe->next_write == pipe->next_walk))
+			pthread_cond_wait(&pipe->job_done, &pipe->mutex);
+		if (!job->done)
+			break;
+
+		pthread_mutex_unlock(&pipe->mutex);
+
+		int64_t author_id = get_or_insert_author_id(&job->meta);
+		if (insert_commit(job->commit_id, pipe->repository_id,
+				  &job->oid,
+				  job->has_parent ? &job->parent_oid : NULL,
+				  author_id, &job->meta))
+			insert_changes_for_commit(job->commit_id, job);
+
+		pthread_mutex_lock(&pipe->mutex);
+		job->done = false;
+		pipe->next_write++;
+		pthread_cond_signal(&pipe->slot_freed);
+	}
+	pthread_mutex_unlock(&pipe->mutex);
+
+	return NULL;
+}
+
+static void
+pipeline_start(struct sync_pipeline *pipe, int64_t repository_id,
+	       uint64_t budget)
+{
+	int nr_workers = num_workers > 0 ? num_workers : online_cpus();
+
+	memset(pipe, 0, sizeof(*pipe));
+	pipe->repository_id = repository_id;
+	pipe->budget = budget;
+	pipe->nr_workers = nr_workers;
+	pipe->window = PIPELINE_WINDOW_PER_WORKER * nr_workers;
+
+	pipe->next_commit_id = next_commit_id();
+	CALLOC_ARRAY(pipe->ring, pipe->window);
+	for (size_t i = 0; i < pipe->window; i++) {
+		struct diff_job *job = &pipe->ring[i];
+
+		strbuf_init(&job->paths, 0);
+		strbuf_init(&job->meta.author_name, 0);
+		strbuf_init(&job->meta.author_email, 0);
+		strbuf_init(&job->meta.subject, 0);
+	}
+
+	pthread_mutex_init(&pipe->mutex, NULL);
+	pthread_cond_init(&pipe->job_ready, NULL);
+	pthread_cond_init(&pipe->job_done, NULL);
+	pthread_cond_init(&pipe->slot_freed, NULL);
+
+	// Workers read trees concurrently; let the object store serialize
+	// its own state while inflating outside the lock.
+	enable_obj_read_lock();
+
+	dbg("starting %d diff workers", nr_workers);
+
+	int rc;
+	CALLOC_ARRAY(pipe->workers, nr_workers);
+	for (int i = 0; i < nr_workers; i++) {
+		rc = pthread_create(&pipe->workers[i], NULL, diff_worker, pipe);
+		if (rc) {
+			err("cannot start diff worker: %s", strerror(rc));
+			exit(1);
 		}
+	}
+	rc = pthread_create(&pipe->writer, NULL, write_worker, pipe);
+	if (rc) {
+		err("cannot start writer: %s", strerror(rc));
+		exit(1);
+	}
+}
+
+// Whether the walk may queue another commit in this turn. Once it may not,
+// the rest of the history is left to the next turn.
+static bool
+pipeline_has_room(struct sync_pipeline *pipe)
+{
+	if (pipe->next_walk < pipe->budget)
+		return true;
+	pipe->cut = true;
+	return false;
+}
+
+// Queue a commit that is not indexed yet. It becomes known right away, so
+// the walker will not queue it a second time.
+static void
+pipeline_push(struct sync_pipeline *pipe, struct commit *c)
+{
+	int64_t commit_id = pipe->next_commit_id++;
+	commit_map_put(&commit_map, &c->object.oid, commit_id);
+
+	pthread_mutex_lock(&pipe->mutex);
+	while (pipe->next_walk - pipe->next_write == pipe->window)
+		pthread_cond_wait(&pipe->slot_freed, &pipe->mutex);
+
+	// Record only the first parent in the commits table.
+	struct diff_job *job = &pipe->ring[pipe->next_walk % pipe->window];
+	job->commit_id = commit_id;
+	oidcpy(&job->oid, &c->object.oid);
+	job->has_parent = c->parents != NULL;
+	if (c->parents)
+		oidcpy(&job->parent_oid, &c->parents->item->object.oid);
+
+	pipe->next_walk++;
+	pthread_cond_signal(&pipe->job_ready);
+	pthread_mutex_unlock(&pipe->mutex);
+}
 
-		update_last_commit_id(path_id, idx->commit_ids[curr],
-				      idx->commit_ids[last]);
+static void
+pipeline_finish(struct sync_pipeline *pipe)
+{
+	pthread_mutex_lock(&pipe->mutex);
+	pipe->finished = true;
+	pthread_cond_broadcast(&pipe->job_ready);
+	pthread_cond_broadcast(&pipe->job_done);
+	pthread_mutex_unlock(&pipe->mutex);
+
+	for (int i = 0; i < pipe->nr_workers; i++)
+		pthread_join(pipe->workers[i], NULL);
+	pthread_join(pipe->writer, NULL);
+
+	disable_obj_read_lock();
+
+	dbg("pipeline done: %" PRIu64 " commits", pipe->next_write);
+
+	for (size_t i = 0; i < pipe->window; i++) {
+		strbuf_release(&pipe->ring[i].paths);
+		free(pipe->ring[i].removed);
+		free(pipe->ring[i].candidates);
+		free(pipe->ring[i].renames);
+		strbuf_release(&pipe->ring[i].meta.author_name);
+		strbuf_release(&pipe->ring[i].meta.author_email);
+		strbuf_release(&pipe->ring[i].meta.subject);
 	}
+	free(pipe->ring);
+	free(pipe->workers);
+	pthread_mutex_destroy(&pipe->mutex);
+	pthread_cond_destroy(&pipe->job_ready);
+	pthread_cond_destroy(&pipe->job_done);
+	pthread_cond_destroy(&pipe->slot_freed);
 }
 
+// A commit on the current path of the history walk and the parents of it
+// that are left to visit.
+struct walk_frame {
+	struct commit *commit;
+	struct commit_list *parents;
+};
+
+// Depth-first over *all* parents, queueing each commit after its parents.
+// Whatever a walk cut short by its budget has queued is then closed under
+// ancestry, which is what lets the next walk stop at indexed commits. The
+// stack is the current path, so a parent on it would be a cycle; every
+// other parent is new or already indexed or queued.
 static void
-backfill_repository(int64_t repository_id)
+walk_commit_history(struct sync_pipeline *pipe, struct commit *commit)
 {
-	dbg("backfilling repository %" PRId64, repository_id);
+	struct walk_frame *stack = NULL;
+	size_t nr = 0, alloc = 0;
 
-	struct backfill_index *idx = build_backfill_index(repository_id);
-	if (!idx)
+	// If this commit is already indexed or queued, skip it and its
+	// ancestors.
+	if (commit_map_get(&commit_map, &commit->object.oid))
 		return;
 
-	backfill_first_depths(idx);
+	// Parents come from the commit-graph when there is one.
+	repo_parse_commit(the_repository, commit);
+	ALLOC_GROW(stack, nr + 1, alloc);
+	stack[nr++] = (struct walk_frame){commit, commit->parents};
+
+	while (nr && pipeline_has_room(pipe)) {
+		struct walk_frame *top = &stack[nr - 1];
 
-	// List paths with at least one unfilled change in this repository.
-	sqlite3_stmt *list_paths = stmts[STMT_BACKFILL_LIST_PATHS];
-	sqlite3_reset(list_paths);
-	sqlite3_bind_int64(list_paths, 1, repository_id);
+		while (top->parents &&
+		       commit_map_get(&commit_map,
+				      &top->parents->item->object.oid))
+			top->parents = top->parents->next;
 
-	size_t bitmap_size = (idx->num_commits + 7) / 8;
-	struct backfill_buf buf = {
-	    .bitmap = NULL,
-	    .bitmap_size = bitmap_size,
-	    .pending = NULL,
-	    .pending_cap = 0,
-	};
-	CALLOC_ARRAY(buf.bitmap, bitmap_size);
+		if (!top->parents) {
+			pipeline_push(pipe, top->commit);
+			nr--;
+			continue;
+		}
+
+		struct commit *parent = top->parents->item;
+		top->parents = top->parents->next;
+
+		repo_parse_commit(the_repository, parent);
+		ALLOC_GROW(stack, nr + 1, alloc);
+		stack[nr++] = (struct walk_frame){parent, parent->parents};
+	}
+
+	free(stack);
+}
+
+// The kind of ref the refs table records, or -1 for anything else.
+static int
+ref_type_of(const char *full_name, const char **show_name)
+{
+	if (skip_prefix(full_name, "refs/heads/", show_name))
+		return 0;
+	if (skip_prefix(full_name, "refs/tags/", show_name))
+		return 1;
+	return -1; // skip refs/notes, refs/remotes, etc.
+}
+
+struct ref_entry {
+	char *name;
+	struct object_id oid; // as read, before peeling
+	bool seen;
+};
+
+// Current branches and tags compared with the refs table. Only created
+// and moved refs are peeled, walked and written; refs that no longer
+// exist are deleted; everything else is left alone.
+struct ref_delta {
+	struct ref_entry *recorded;
+	size_t recorded_nr, recorded_alloc;
+	struct strmap by_name; // full_name -> entry in recorded
+
+	struct ref_entry *moved; // created or moved
+	size_t moved_nr, moved_alloc;
+	size_t deleted;
+};
+
+static int
+diff_ref(const struct reference *ref, void *cb_data)
+{
+	struct ref_delta *delta = cb_data;
+	const char *show_name;
+
+	if (ref_type_of(ref->name, &show_name) < 0)
+		return 0;
+
+	struct ref_entry *recorded = strmap_get(&delta->by_name, ref->name);
+	if (recorded) {
+		recorded->seen = true;
+		if (oideq(&recorded->oid, ref->oid))
+			return 0;
+	}
+
+	ALLOC_GROW(delta->moved, delta->moved_nr + 1, delta->moved_alloc);
+	struct ref_entry *moved = &delta->moved[delta->moved_nr++];
+	moved->name = xstrdup(ref->name);
+	oidcpy(&moved->oid, ref->oid);
+	moved->seen = true;
+	return 0;
+}
+
+static void
+load_ref_delta(int64_t repository_id, struct ref_delta *delta)
+{
+	memset(delta, 0, sizeof(*delta));
+
+	sqlite3_stmt *stmt = stmts[STMT_LOAD_REFS];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, repository_id);
+
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		ALLOC_GROW(delta->recorded, delta->recorded_nr + 1,
+			   delta->recorded_alloc);
+		struct ref_entry *ref = &delta->recorded[delta->recorded_nr];
+		if (!column_oid(stmt, 1, &ref->oid))
+			continue;
+		ref->name = xstrdup((const char *)sqlite3_column_text(stmt, 0));
+		ref->seen = false;
+		delta->recorded_nr++;
+	}
+
+	// The array is complete, so pointers into it stay valid.
+	strmap_init(&delta->by_name);
+	for (size_t i = 0; i < delta->recorded_nr; i++)
+		strmap_put(&delta->by_name, delta->recorded[i].name,
+			   &delta->recorded[i]);
+
+	refs_for_each_ref(get_main_ref_store(the_repository), diff_ref, delta);
+
+	for (size_t i = 0; i < delta->recorded_nr; i++)
+		if (!delta->recorded[i].seen)
+			delta->deleted++;
+
+	dbg("refs: %zu recorded, %zu created or moved, %zu deleted",
+	    delta->recorded_nr, delta->moved_nr, delta->deleted);
+}
+
+static void
+ref_delta_release(struct ref_delta *delta)
+{
+	for (size_t i = 0; i < delta->recorded_nr; i++)
+		free(delta->recorded[i].name);
+	for (size_t i = 0; i < delta->moved_nr; i++)
+		free(delta->moved[i].name);
+	free(delta->recorded);
+	free(delta->moved);
+	strmap_clear(&delta->by_name, 0);
+}
+
+// Resolve a ref to a commit; NULL for anything that is not a commit.
+static struct commit *
+peel_ref(const struct ref_entry *ref)
+{
+	return lookup_commit_reference_gently(the_repository, &ref->oid, 1);
+}
+
+// History of the recorded refs is indexed already.
+static void
+walk_moved_refs(struct sync_pipeline *pipe, const struct ref_delta *delta)
+{
+	for (size_t i = 0; i < delta->moved_nr && !pipe->cut; i++) {
+		struct commit *commit = peel_ref(&delta->moved[i]);
+		if (commit)
+			walk_commit_history(pipe, commit);
+	}
+}
+
+// Tips recorded by the previous sync. Everything reachable from them is
+// indexed already, because every sync walks the full history of each ref.
+static void
+add_recorded_tips(int64_t repository_id, struct rev_info *revs)
+{
+	sqlite3_stmt *stmt = stmts[STMT_LIST_REF_TIPS];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, repository_id);
+
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		struct object_id oid;
+
+		if (!column_oid(stmt, 0, &oid))
+			continue;
+
+		// Skip tips that have been pruned since.
+		struct commit *commit =
+		    lookup_commit_reference_gently(the_repository, &oid, 1);
+		if (commit)
+			add_pending_oid(revs, oid_to_hex(&oid), &oid,
+					UNINTERESTING);
+	}
+}
+
+// The bitmap walk has no way to pass a payload through to the callback.
+static struct commit **bitmap_commits;
+static size_t bitmap_commits_nr, bitmap_commits_alloc;
+
+static int
+collect_bitmap_commit(const struct object_id *oid, enum object_type type,
+		      int flags UNUSED, uint32_t hash UNUSED,
+		      struct packed_git *found_pack UNUSED,
+		      off_t found_offset UNUSED, void *payload UNUSED)
+{
+	if (type != OBJ_COMMIT)
+		return 0;
+
+	ALLOC_GROW(bitmap_commits, bitmap_commits_nr + 1, bitmap_commits_alloc);
+	bitmap_commits[bitmap_commits_nr++] =
+	    lookup_commit(the_repository, oid);
+	return 1;
+}
+
+// Order commits parents first with Kahn's algorithm over the parent links
+// inside the set. Generation numbers would do only for commits the
+// commit-graph covers; the others all have GENERATION_NUMBER_INFINITY.
+static void
+topo_sort_commits(struct commit **commits, size_t nr)
+{
+	struct commit_map index;
+	size_t *indegree, *first_child, *children, *queue;
+	struct commit **sorted;
+	size_t head = 0, tail = 0;
+
+	// Positions are stored plus one, as 0 marks an empty slot.
+	commit_map_init(&index, the_hash_algo->rawsz, nr);
+	for (size_t i = 0; i < nr; i++)
+		commit_map_put(&index, &commits[i]->object.oid, i + 1);
+
+	// Children of each commit in one array, as runs indexed by parent.
+	CALLOC_ARRAY(indegree, nr);
+	CALLOC_ARRAY(first_child, nr + 1);
+	for (size_t i = 0; i < nr; i++) {
+		for (struct commit_list *p = commits[i]->parents; p;
+		     p = p->next) {
+			int64_t parent = commit_map_get(&index,
+							&p->item->object.oid);
+			if (parent) {
+				indegree[i]++;
+				first_child[parent - 1]++;
+			}
+		}
+	}
+	for (size_t i = 1; i <= nr; i++)
+		first_child[i] += first_child[i - 1];
+	ALLOC_ARRAY(children, first_child[nr]);
+	for (size_t i = nr; i--;) {
+		for (struct commit_list *p = commits[i]->parents; p;
+		     p = p->next) {
+			int64_t parent = commit_map_get(&index,
+							&p->item->object.oid);
+			if (parent)
+				children[--first_child[parent - 1]] = i;
+		}
+	}
+
+	// A commit whose parents are all out, or already placed, is next.
+	ALLOC_ARRAY(queue, nr);
+	for (size_t i = 0; i < nr; i++)
+		if (!indegree[i])
+			queue[tail++] = i;
+	while (head < tail) {
+		size_t c = queue[head++];
+
+		for (size_t j = first_child[c]; j < first_child[c + 1]; j++)
+			if (!--indegree[children[j]])
+				queue[tail++] = children[j];
+	}
+
+	ALLOC_ARRAY(sorted, nr);
+	for (size_t i = 0; i < nr; i++)
+		sorted[i] = commits[queue[i]];
+	COPY_ARRAY(commits, sorted, nr);
+
+	free(sorted);
+	free(queue);
+	free(children);
+	free(first_child);
+	free(indegree);
+	commit_map_clear(&index);
+}
+
+// Compute the new commits as the bitmap difference between the created
+// or moved ref tips and the tips recorded at the last sync, instead of
+// walking down from every ref until the indexed region is found. Returns
+// false when the repository has no usable reachability bitmap.
+static bool
+find_bitmap_difference(int64_t repository_id, const struct ref_delta *delta)
+{
+	struct rev_info revs;
+	struct bitmap_index *bitmap;
+
+	repo_init_revisions(the_repository, &revs, NULL);
+	for (size_t i = 0; i < delta->moved_nr; i++) {
+		struct commit *commit = peel_ref(&delta->moved[i]);
+		if (commit)
+			add_pending_oid(&revs, delta->moved[i].name,
+					&commit->object.oid, 0);
+	}
+	add_recorded_tips(repository_id, &revs);
+
+	bitmap = prepare_bitmap_walk(&revs, 0);
+	if (!bitmap) {
+		release_revisions(&revs);
+		return false;
+	}
+
+	traverse_bitmap_commit_list(bitmap, &revs, collect_bitmap_commit);
+	free_bitmap_index(bitmap);
+	release_revisions(&revs);
+
+	for (size_t i = 0; i < bitmap_commits_nr; i++)
+		repo_parse_commit(the_repository, bitmap_commits[i]);
+
+	topo_sort_commits(bitmap_commits, bitmap_commits_nr);
+	return true;
+}
+
+// Queue the new commits in order until the budget runs out, and drop the
+// ones done from bitmap_commits; what is left is for the next turn.
+static void
+walk_bitmap_difference(struct sync_pipeline *pipe)
+{
+	size_t queued = 0, i;
+
+	// Parents come first, so a turn that stops at its budget leaves no
+	// holes in the indexed history.
+	for (i = 0; i < bitmap_commits_nr; i++) {
+		struct commit *c = bitmap_commits[i];
+
+		// A recorded tip that was pruned since is not excluded.
+		if (commit_map_get(&commit_map, &c->object.oid))
+			continue;
+
+		if (!pipeline_has_room(pipe))
+			break;
+		pipeline_push(pipe, c);
+		queued++;
+	}
+
+	dbg("bitmap walk: %zu reachable, %zu new", bitmap_commits_nr, queued);
+
+	bitmap_commits_nr -= i;
+	MOVE_ARRAY(bitmap_commits, bitmap_commits + i, bitmap_commits_nr);
+}
+
+static void
+release_bitmap_difference(void)
+{
+	FREE_AND_NULL(bitmap_commits);
+	bitmap_commits_nr = bitmap_commits_alloc = 0;
+}
+
+// A ref without a commit to point to is recorded all the same, so that
+// the next sync finds its ref_oid unchanged and leaves it alone.
+static void
+upsert_ref(int64_t repository_id, const struct ref_entry *ref)
+{
+	struct commit *commit = peel_ref(ref);
+	int64_t commit_id = 0;
+
+	if (commit) {
+		commit_id = commit_map_get(&commit_map, &commit->object.oid);
+		if (!commit_id)
+			err("ref %s points to unknown commit %s", ref->name,
+			    oid_to_hex(&commit->object.oid));
+	}
+
+	const char *show_name;
+	int ref_type = ref_type_of(ref->name, &show_name);
+
+	// ref_time is the commit timestamp in Unix seconds.
+	sqlite3_stmt *stmt = stmts[STMT_UPSERT_REF];
+	sqlite3_reset(stmt);
+	sqlite3_bind_text(stmt, 1, ref->name, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, show_name, -1, SQLITE_STATIC);
+	if (commit_id) {
+		sqlite3_bind_int64(stmt, 3, commit_id);
+		sqlite3_bind_int64(stmt, 4, commit->date);
+	} else {
+		sqlite3_bind_null(stmt, 3);
+		sqlite3_bind_null(stmt, 4);
+	}
+	sqlite3_bind_int64(stmt, 5, ref_type);
+	bind_oid(stmt, 6, &ref->oid);
+	sqlite3_bind_int64(stmt, 7, repository_id);
+
+	int rc = sqlite3_step(stmt);
+	if (rc != SQLITE_DONE)
+		err("failed to insert ref %s: %s", ref->name,
+		    sqlite3_errmsg(conn));
+}
+
+static void
+delete_ref(int64_t repository_id, const struct ref_entry *ref)
+{
+	sqlite3_stmt *stmt = stmts[STMT_DELETE_REF];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, repository_id);
+	sqlite3_bind_text(stmt, 2, ref->name, -1, SQLITE_STATIC);
+
+	int rc = sqlite3_step(stmt);
+	if (rc != SQLITE_DONE)
+		err("failed to delete ref %s: %s", ref->name,
+		    sqlite3_errmsg(conn));
+}
+
+struct idmap {
+	int64_t *keys;	// 0 means empty slot
+	uint32_t *vals; // local_idx, UINT32_MAX = not found
+	size_t cap;
+	size_t size;
+};
+
+static void
+idmap_init(struct idmap *m, size_t num_commits)
+{
+	m->cap = 32;
+	while (m->cap < num_commits * 1.5)
+		m->cap *= 2;
+	CALLOC_ARRAY(m->keys, m->cap);
+	CALLOC_ARRAY(m->vals, m->cap);
+	m->size = 0;
+}
+
+static void
+idmap_clear(struct idmap *m)
+{
+	free(m->keys);
+	free(m->vals);
+	m->keys = NULL;
+	m->vals = NULL;
+	m->cap = 0;
+	m->size = 0;
+}
+
+static size_t
+idmap_slot(const struct idmap *m, int64_t key)
+{
+	size_t i = (size_t)(key & (int64_t)(m->cap - 1));
+	while (m->keys[i] != 0 && m->keys[i] != key) {
+		i++;
+		if (i == m->cap)
+			i = 0;
+	}
+	return i;
+}
+
+static void
+idmap_put(struct idmap *m, int64_t key, uint32_t val)
+{
+	size_t i = idmap_slot(m, key);
+	if (m->keys[i] == 0) {
+		m->size++;
+		m->keys[i] = key;
+	}
+	m->vals[i] = val;
+}
+
+// use UINT32_MAX to indicate "not found".
+static uint32_t
+idmap_get(const struct idmap *m, int64_t key)
+{
+	size_t i = idmap_slot(m, key);
+	return m->keys[i] == key ? m->vals[i] : UINT32_MAX;
+}
+
+// Only commits without a first_depth are loaded: those a sync added since
+// the last backfill. Everything older is already filled in and is read
+// from the database where the new commits attach to it.
+struct backfill_index {
+	uint32_t num_commits;
+
+	struct idmap idmap; // global commit_id -> commit local_idx
+
+	// input commit local_idx
+	int64_t *commit_ids;	// -> global commit_id
+	int64_t *parent_ids;	// -> parent global commit_id (0 = none)
+	uint32_t *parent_local; // -> parent local_idx (UINT32_MAX = old or none)
+	uint32_t *first_depth;	// -> first-parent depth (UINT32_MAX = unknown)
+	int64_t *jump_ids;	// -> jump pointer global commit_id
+	int64_t *commit_times;	// -> commit_time
+	int64_t *chain_times;	// -> chain_time
+	uint32_t *boundary;	// -> first old commit up the chain (see below)
+
+	// Old commits that new first-parent chains continue from.
+	struct idmap boundary_map; // global commit_id -> boundaries index
+	struct backfill_boundary *boundaries;
+	size_t boundaries_nr, boundaries_alloc;
+};
+
+// Old commits right above a boundary are probed for a path before its
+// candidates are checked one by one.
+#define BOUNDARY_PROBE_DEPTH 32
+
+struct backfill_boundary {
+	int64_t commit_id;
+	uint32_t depth;
+	int64_t chain[BOUNDARY_PROBE_DEPTH]; // chain[0] is commit_id
+	int chain_nr;			     // 0 until loaded
+};
+
+static void
+backfill_index_free(struct backfill_index *idx)
+{
+	if (!idx)
+		return;
+	free(idx->commit_ids);
+	free(idx->parent_ids);
+	free(idx->parent_local);
+	free(idx->first_depth);
+	free(idx->jump_ids);
+	free(idx->commit_times);
+	free(idx->chain_times);
+	free(idx->boundary);
+	free(idx->boundaries);
+	idmap_clear(&idx->idmap);
+	idmap_clear(&idx->boundary_map);
+	free(idx);
+}
+
+struct local_index_stack {
+	uint32_t *items;
+	size_t count;
+	size_t alloc;
+};
+
+struct first_parent_links {
+	uint32_t depth;
+	int64_t parent_id; // 0 = none
+	int64_t jump_id;
+	uint32_t jump_depth;
+	int64_t chain_time;
+};
+
+static bool
+load_first_parent_links(int64_t commit_id, struct first_parent_links *links)
+{
+	sqlite3_stmt *stmt = stmts[STMT_GET_FIRST_PARENT];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, commit_id);
+
+	if (sqlite3_step(stmt) != SQLITE_ROW) {
+		err("commit %" PRId64 " has no first-parent links", commit_id);
+		return false;
+	}
+
+	links->depth = sqlite3_column_int64(stmt, 0);
+	links->parent_id = sqlite3_column_int64(stmt, 1);
+	links->jump_id = sqlite3_column_int64(stmt, 2);
+	links->jump_depth = sqlite3_column_int64(stmt, 3);
+	links->chain_time = sqlite3_column_int64(stmt, 4);
+	return true;
+}
+
+// first_depth and jump_id of a commit, new or old. New commits have to be
+// filled in already, which holds for ancestors of the one being filled.
+static bool
+commit_depth_and_jump(const struct backfill_index *idx, int64_t commit_id,
+		      uint32_t *depth, int64_t *jump_id)
+{
+	uint32_t local = idmap_get(&idx->idmap, commit_id);
+	if (local != UINT32_MAX) {
+		*depth = idx->first_depth[local];
+		*jump_id = idx->jump_ids[local];
+		return true;
+	}
+
+	struct first_parent_links links;
+	if (!load_first_parent_links(commit_id, &links))
+		return false;
+	*depth = links.depth;
+	*jump_id = links.jump_id;
+	return true;
+}
+
+// chain_time of a commit, new or old, under the same condition.
+static bool
+commit_chain_time(const struct backfill_index *idx, int64_t commit_id,
+		  int64_t *chain_time)
+{
+	uint32_t local = idmap_get(&idx->idmap, commit_id);
+	if (local != UINT32_MAX) {
+		*chain_time = idx->chain_times[local];
+		return true;
+	}
+
+	struct first_parent_links links;
+	if (!load_first_parent_links(commit_id, &links))
+		return false;
+	*chain_time = links.chain_time;
+	return true;
+}
+
+static void
+update_first_depth(int64_t commit_id, int64_t parent_id, uint32_t depth,
+		   int64_t jump_id, int64_t chain_time)
+{
+	sqlite3_stmt *stmt = stmts[STMT_UPDATE_FIRST_DEPTH];
+	sqlite3_reset(stmt);
+	if (parent_id)
+		sqlite3_bind_int64(stmt, 1, parent_id);
+	else
+		sqlite3_bind_null(stmt, 1);
+	sqlite3_bind_int64(stmt, 2, depth);
+	sqlite3_bind_int64(stmt, 3, jump_id);
+	sqlite3_bind_int64(stmt, 4, commit_id);
+	sqlite3_bind_int64(stmt, 5, chain_time);
+
+	int rc = sqlite3_step(stmt);
+	if (rc != SQLITE_DONE)
+		err("failed to update first_depth: %s", sqlite3_errmsg(conn));
+}
+
+// Skew-binary jump pointer of a commit whose first parent is parent_id:
+// when the parent's jump and its jump's jump span equal distances, the
+// two merge into one twice as long, otherwise the jump is the parent.
+// This keeps one pointer per commit and any ancestor O(log n) jumps
+// away.
+static bool
+first_parent_jump(const struct backfill_index *idx, int64_t parent_id,
+		  uint32_t *depth, int64_t *jump_id)
+{
+	uint32_t jump_depth, jump2_depth;
+	int64_t jump, jump2, unused;
+
+	if (!commit_depth_and_jump(idx, parent_id, depth, &jump) ||
+	    !commit_depth_and_jump(idx, jump, &jump_depth, &jump2) ||
+	    !commit_depth_and_jump(idx, jump2, &jump2_depth, &unused))
+		return false;
+
+	if (*depth - jump_depth == jump_depth - jump2_depth)
+		*jump_id = jump2;
+	else
+		*jump_id = parent_id;
+	return true;
+}
+
+static uint32_t
+add_boundary(struct backfill_index *idx, int64_t commit_id, uint32_t depth)
+{
+	uint32_t i = idmap_get(&idx->boundary_map, commit_id);
+	if (i != UINT32_MAX)
+		return i;
+
+	i = idx->boundaries_nr;
+	ALLOC_GROW(idx->boundaries, idx->boundaries_nr + 1,
+		   idx->boundaries_alloc);
+	idx->boundaries[idx->boundaries_nr++] = (struct backfill_boundary){
+	    .commit_id = commit_id,
+	    .depth = depth,
+	};
+	idmap_put(&idx->boundary_map, commit_id, i);
+	return i;
+}
+
+// Give every new commit its depth, jump pointer and chain time, parents
+// before their children. A new commit whose first parent is old also
+// records that parent as the boundary of its chain; its descendants
+// inherit it.
+static bool
+backfill_first_depths(struct backfill_index *idx)
+{
+	struct local_index_stack trail = {0};
+	bool ok = true;
+
+	CALLOC_ARRAY(idx->jump_ids, idx->num_commits);
+	CALLOC_ARRAY(idx->chain_times, idx->num_commits);
+	ALLOC_ARRAY(idx->boundary, idx->num_commits);
+	idmap_init(&idx->boundary_map, idx->num_commits);
+
+	for (uint32_t i = 0; ok && i < idx->num_commits; i++) {
+		uint32_t curr = i;
+
+		if (idx->first_depth[i] != UINT32_MAX)
+			continue;
+
+		trail.count = 0;
+
+		while (curr != UINT32_MAX &&
+		       idx->first_depth[curr] == UINT32_MAX) {
+			ALLOC_GROW(trail.items, trail.count + 1, trail.alloc);
+			trail.items[trail.count++] = curr;
+			curr = idx->parent_local[curr];
+		}
+
+		while (ok && trail.count) {
+			uint32_t v = trail.items[--trail.count];
+			uint32_t parent = idx->parent_local[v];
+			int64_t parent_id = idx->parent_ids[v];
+			int64_t parent_time;
+			uint32_t parent_depth;
+
+			idx->chain_times[v] = idx->commit_times[v];
+			if (!parent_id) {
+				idx->first_depth[v] = 0;
+				idx->jump_ids[v] = idx->commit_ids[v];
+				idx->boundary[v] = UINT32_MAX;
+			} else if (first_parent_jump(idx, parent_id,
+						     &parent_depth,
+						     &idx->jump_ids[v]) &&
+				   commit_chain_time(idx, parent_id,
+						     &parent_time)) {
+				idx->first_depth[v] = parent_depth + 1;
+				if (parent_time > idx->chain_times[v])
+					idx->chain_times[v] = parent_time;
+				idx->boundary[v] =
+				    parent != UINT32_MAX
+					? idx->boundary[parent]
+					: add_boundary(idx, parent_id,
+						       parent_depth);
+			} else {
+				ok = false;
+				break;
+			}
+
+			update_first_depth(idx->commit_ids[v], parent_id,
+					   idx->first_depth[v],
+					   idx->jump_ids[v],
+					   idx->chain_times[v]);
+		}
+	}
+
+	dbg("first_depth for %" PRIu32 " commits, %zu boundaries",
+	    idx->num_commits, idx->boundaries_nr);
+	free(trail.items);
+	return ok;
+}
+
+// With rows, the commits come from what the sync staged; their parents
+// are all in commit_map by now.
+static struct backfill_index *
+build_backfill_index(int64_t repository_id, const struct staged_rows *rows)
+{
+	struct backfill_index *idx = xcalloc(1, sizeof(*idx));
+	struct backfill_index *result = NULL;
+
+	int64_t *commit_ids = NULL;
+	int64_t *parent_ids = NULL;
+	int64_t *commit_times = NULL;
+	size_t commit_ids_alloc = 0;
+	size_t parent_ids_alloc = 0;
+	size_t commit_times_alloc = 0;
+	uint32_t num = 0; // local index, starts at 0
+
+	if (rows) {
+		if (rows->commits_nr >= UINT32_MAX) {
+			err("too many commits to backfill");
+			goto cleanup;
+		}
+		num = rows->commits_nr;
+		ALLOC_ARRAY(commit_ids, num);
+		ALLOC_ARRAY(parent_ids, num);
+		ALLOC_ARRAY(commit_times, num);
+		for (uint32_t i = 0; i < num; i++) {
+			const struct staged_commit *c = &rows->commits[i];
+			commit_ids[i] = c->commit_id;
+			commit_times[i] = c->commit_time;
+			parent_ids[i] =
+			    c->has_parent
+				? commit_map_get(&commit_map, &c->parent_oid)
+				: 0;
+		}
+	} else {
+		sqlite3_stmt *stmt = stmts[STMT_BACKFILL_LOAD_COMMITS];
+		sqlite3_reset(stmt);
+		sqlite3_bind_int64(stmt, 1, repository_id);
+
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			ALLOC_GROW(commit_ids, num + 1, commit_ids_alloc);
+			ALLOC_GROW(parent_ids, num + 1, parent_ids_alloc);
+			ALLOC_GROW(commit_times, num + 1, commit_times_alloc);
+
+			commit_ids[num] = sqlite3_column_int64(stmt, 0);
+			if (sqlite3_column_type(stmt, 1) == SQLITE_NULL)
+				parent_ids[num] = 0;
+			else
+				parent_ids[num] = sqlite3_column_int64(stmt, 1);
+			commit_times[num] = sqlite3_column_int64(stmt, 2);
+			num++;
+
+			if (num == UINT32_MAX) {
+				err("backfill index reached UINT32_MAX commits");
+				break;
+			}
+		}
+	}
+
+	REALLOC_ARRAY(commit_ids, num);
+	REALLOC_ARRAY(parent_ids, num);
+	REALLOC_ARRAY(commit_times, num);
+	idx->commit_ids = commit_ids;
+	idx->parent_ids = parent_ids;
+	idx->commit_times = commit_times;
+	idx->num_commits = num;
+
+	if (num == 0 || num == UINT32_MAX)
+		goto cleanup;
+
+	idmap_init(&idx->idmap, num);
+	for (uint32_t i = 0; i < num; i++)
+		idmap_put(&idx->idmap, idx->commit_ids[i], i);
+
+	ALLOC_ARRAY(idx->parent_local, num);
+	ALLOC_ARRAY(idx->first_depth, num);
+	for (uint32_t i = 0; i < num; i++) {
+		idx->first_depth[i] = UINT32_MAX;
+		idx->parent_local[i] = parent_ids[i]
+					   ? idmap_get(&idx->idmap, parent_ids[i])
+					   : UINT32_MAX;
+	}
+
+	result = idx;
+
+cleanup:
+	if (!result)
+		backfill_index_free(idx);
+	return result;
+}
+
+static void
+update_last_commit_id(int64_t path_id, int64_t commit_id,
+		      int64_t last_commit_id)
+{
+	sqlite3_stmt *stmt = stmts[STMT_BACKFILL_UPDATE_CHANGE];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, last_commit_id);
+	sqlite3_bind_int64(stmt, 2, commit_id);
+	sqlite3_bind_int64(stmt, 3, path_id);
+
+	int rc = sqlite3_step(stmt);
+	if (rc != SQLITE_DONE)
+		err("failed to update last_commit_id: %s",
+		    sqlite3_errmsg(conn));
+}
+
+// Whether ancestor_id, at ancestor_depth, lies on the first-parent chain
+// of commit_id: follow jump pointers down to that depth.
+static bool
+is_first_parent_ancestor(int64_t ancestor_id, uint32_t ancestor_depth,
+			 int64_t commit_id)
+{
+	struct first_parent_links links;
+
+	for (;;) {
+		if (!load_first_parent_links(commit_id, &links))
+			return false;
+		if (links.depth <= ancestor_depth)
+			return commit_id == ancestor_id;
+
+		if (links.jump_depth >= ancestor_depth)
+			commit_id = links.jump_id;
+		else
+			commit_id = links.parent_id;
+	}
+}
+
+static bool
+commit_has_change(int64_t commit_id, int64_t path_id)
+{
+	sqlite3_stmt *stmt = stmts[STMT_BACKFILL_HAS_CHANGE];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, commit_id);
+	sqlite3_bind_int64(stmt, 2, path_id);
+	return sqlite3_step(stmt) == SQLITE_ROW;
+}
+
+// Latest old commit on the first-parent chain from a boundary, itself
+// included, that changed path_id, or 0 when there is none. Frequently
+// changed paths turn up within a few commits of the boundary; for the
+// rest, the commits that changed the path are checked from the deepest
+// one down, as in a query's start-point search.
+static int64_t
+boundary_last_change(int64_t repository_id, struct backfill_boundary *b,
+		     int64_t path_id)
+{
+	if (!b->chain_nr) {
+		int64_t commit_id = b->commit_id;
+		struct first_parent_links links;
+
+		while (commit_id && b->chain_nr < BOUNDARY_PROBE_DEPTH) {
+			b->chain[b->chain_nr++] = commit_id;
+			if (!load_first_parent_links(commit_id, &links))
+				break;
+			commit_id = links.parent_id;
+		}
+	}
+
+	for (int i = 0; i < b->chain_nr; i++)
+		if (commit_has_change(b->chain[i], path_id))
+			return b->chain[i];
+
+	// The whole chain was probed down to the root.
+	if (b->depth < (uint32_t)b->chain_nr)
+		return 0;
+
+	sqlite3_stmt *stmt = stmts[STMT_BACKFILL_PATH_CANDIDATES];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, path_id);
+	sqlite3_bind_int64(stmt, 2, repository_id);
+	sqlite3_bind_int64(stmt, 3, b->depth - b->chain_nr);
+
+	int64_t found = 0;
+	while (!found && sqlite3_step(stmt) == SQLITE_ROW) {
+		int64_t candidate = sqlite3_column_int64(stmt, 0);
+		uint32_t depth = sqlite3_column_int64(stmt, 1);
+		if (is_first_parent_ancestor(candidate, depth, b->commit_id))
+			found = candidate;
+	}
+	sqlite3_reset(stmt);
+	return found;
+}
+
+struct backfill_change {
+	int64_t path_id;
+	uint32_t last; // -> last commit local_idx (UINT32_MAX = not new)
+};
+
+struct backfill_frame {
+	uint32_t commit;
+	bool leave;
+};
+
+struct backfill_undo {
+	uint32_t slot;
+	uint32_t prev;
+};
+
+// Backfill splits paths by path_id modulo the number of parts, so every
+// part sees all changes of its paths and nothing else. A part's changes
+// are grouped by commit, and only commits that have some are listed:
+// group g is commit local_idx commits[g] and owns changes[offsets[g]] up
+// to changes[offsets[g + 1]], counted in 32 bits like local indexes.
+// order holds the enter and leave events of the part's groups, in the
+// order of the walk over all commits.
+struct backfill_part {
+	uint32_t nr_parts;
+
+	struct backfill_change *changes;
+	size_t nr, alloc;
+	uint32_t *commits; // ascending
+	uint32_t *offsets;
+	size_t nr_commits, commits_alloc, offsets_alloc;
+	uint32_t nr_slots; // path_id / nr_parts is below this
+
+	struct backfill_frame *order; // commit is a group here
+	size_t order_nr;
+
+	pthread_t thread;
+};
+
+static bool
+add_backfill_change(struct backfill_part *parts, uint32_t nr_parts,
+		    uint32_t commit_local, int64_t path_id)
+{
+	struct backfill_part *part = &parts[path_id % nr_parts];
+	if (part->nr == UINT32_MAX) {
+		err("backfill part reached UINT32_MAX changes");
+		return false;
+	}
+
+	// Changes arrive in commit order, so a commit's group is the last.
+	if (!part->nr_commits ||
+	    part->commits[part->nr_commits - 1] != commit_local) {
+		ALLOC_GROW(part->commits, part->nr_commits + 1,
+			   part->commits_alloc);
+		ALLOC_GROW(part->offsets, part->nr_commits + 2,
+			   part->offsets_alloc);
+		part->commits[part->nr_commits] = commit_local;
+		part->offsets[part->nr_commits] = part->nr;
+		part->nr_commits++;
+	}
+
+	ALLOC_GROW(part->changes, part->nr + 1, part->alloc);
+	struct backfill_change *change = &part->changes[part->nr++];
+	change->path_id = path_id;
+	change->last = UINT32_MAX;
+	part->offsets[part->nr_commits] = part->nr;
+
+	if (path_id / nr_parts >= part->nr_slots)
+		part->nr_slots = path_id / nr_parts + 1;
+	return true;
+}
+
+static int
+int64_cmp(const void *va, const void *vb)
+{
+	int64_t a = *(const int64_t *)va;
+	int64_t b = *(const int64_t *)vb;
+	return a < b ? -1 : a > b;
+}
+
+// Every change of a new commit still waits for its last_commit_id. With
+// rows, they are the staged path ids, in the same commit order as the
+// index built from them.
+static bool
+load_backfill_changes(int64_t repository_id, struct staged_rows *rows,
+		      const struct backfill_index *idx,
+		      struct backfill_part *parts, uint32_t nr_parts)
+{
+	if (rows) {
+		size_t start = 0;
+		for (uint32_t i = 0; i < idx->num_commits; i++) {
+			size_t end = rows->commits[i].changes_end;
+
+			// The order the updates are written in.
+			QSORT(rows->path_ids + start, end - start, int64_cmp);
+			for (; start < end; start++)
+				if (!add_backfill_change(parts, nr_parts, i,
+							 rows->path_ids[start]))
+					return false;
+		}
+		return true;
+	}
+
+	sqlite3_stmt *stmt = stmts[STMT_BACKFILL_LOAD_CHANGES];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, repository_id);
+
+	// Rows come in commit_id order, which is local_idx order too.
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		int64_t commit_id = sqlite3_column_int64(stmt, 0);
+		uint32_t commit_local = idmap_get(&idx->idmap, commit_id);
+		if (commit_local == UINT32_MAX) {
+			err("commit %" PRId64 " not found in backfill index",
+			    commit_id);
+			return false;
+		}
+
+		if (!add_backfill_change(parts, nr_parts, commit_local,
+					 sqlite3_column_int64(stmt, 1)))
+			return false;
+	}
+	return true;
+}
+
+// Enter and leave events of a depth-first walk of the first-parent
+// forest, two per commit.
+static struct backfill_frame *
+first_parent_order(const struct backfill_index *idx)
+{
+	uint32_t num = idx->num_commits;
+	uint32_t *first_child, *children, *nr_children;
+	struct backfill_frame *stack, *order;
+	size_t stack_nr = 0, order_nr = 0;
+
+	CALLOC_ARRAY(first_child, num + 1);
+	CALLOC_ARRAY(nr_children, num);
+	ALLOC_ARRAY(children, num);
+	ALLOC_ARRAY(stack, st_mult(num, 2));
+	ALLOC_ARRAY(order, st_mult(num, 2));
+	for (uint32_t i = 0; i < num; i++)
+		if (idx->parent_local[i] != UINT32_MAX)
+			first_child[idx->parent_local[i] + 1]++;
+	for (uint32_t i = 0; i < num; i++)
+		first_child[i + 1] += first_child[i];
+	for (uint32_t i = 0; i < num; i++) {
+		uint32_t parent = idx->parent_local[i];
+		if (parent == UINT32_MAX)
+			stack[stack_nr++] = (struct backfill_frame){i, false};
+		else
+			children[first_child[parent] + nr_children[parent]++] = i;
+	}
+
+	while (stack_nr) {
+		struct backfill_frame frame = stack[--stack_nr];
+
+		order[order_nr++] = frame;
+		if (frame.leave)
+			continue;
+
+		uint32_t v = frame.commit;
+		stack[stack_nr++] = (struct backfill_frame){v, true};
+		for (uint32_t c = first_child[v]; c < first_child[v + 1]; c++)
+			stack[stack_nr++] =
+			    (struct backfill_frame){children[c], false};
+	}
+
+	free(stack);
+	free(children);
+	free(nr_children);
+	free(first_child);
+	return order;
+}
+
+// Give every part the events of its own groups, in one pass over the walk
+// of all commits, so that no part replays the commits it has nothing in.
+static void
+split_first_parent_order(const struct backfill_index *idx,
+			 struct backfill_part *parts, uint32_t nr_parts)
+{
+	uint32_t num = idx->num_commits;
+	struct backfill_frame *order = first_parent_order(idx);
+	uint32_t *group_start, *group_parts, *groups;
+	size_t nr_groups = 0;
+
+	// The groups of each commit, as runs indexed by local_idx.
+	CALLOC_ARRAY(group_start, num + 1);
+	for (uint32_t p = 0; p < nr_parts; p++) {
+		for (size_t g = 0; g < parts[p].nr_commits; g++)
+			group_start[parts[p].commits[g]]++;
+		nr_groups += parts[p].nr_commits;
+		ALLOC_ARRAY(parts[p].order, st_mult(parts[p].nr_commits, 2));
+	}
+	for (uint32_t i = 0; i < num; i++)
+		group_start[i + 1] += group_start[i];
+	ALLOC_ARRAY(group_parts, nr_groups);
+	ALLOC_ARRAY(groups, nr_groups);
+	for (uint32_t p = nr_parts; p--;) {
+		for (size_t g = parts[p].nr_commits; g--;) {
+			uint32_t slot = --group_start[parts[p].commits[g]];
+			group_parts[slot] = p;
+			groups[slot] = g;
+		}
+	}
+
+	for (size_t k = 0; k < st_mult(num, 2); k++) {
+		uint32_t v = order[k].commit;
+		for (uint32_t j = group_start[v]; j < group_start[v + 1]; j++) {
+			struct backfill_part *part = &parts[group_parts[j]];
+			part->order[part->order_nr++] =
+			    (struct backfill_frame){groups[j], order[k].leave};
+		}
+	}
+
+	free(groups);
+	free(group_parts);
+	free(group_start);
+	free(order);
+}
+
+// Replay the walk for one part. last_touch[] holds, for every path of
+// the part, the latest new commit on the current chain that changed it;
+// entering a commit resolves its changes against it and leaving restores
+// what the commit overwrote. Every group and change of the part is
+// visited once. Changes with no earlier new commit are left to the
+// boundary.
+static void *
+backfill_worker(void *data)
+{
+	struct backfill_part *part = data;
+	struct backfill_undo *undo = NULL;
+	size_t undo_nr = 0, undo_alloc = 0;
+	uint32_t *last_touch;
+
+	ALLOC_ARRAY(last_touch, part->nr_slots);
+	memset(last_touch, 0xff, st_mult(sizeof(*last_touch), part->nr_slots));
+
+	for (size_t k = 0; k < part->order_nr; k++) {
+		struct backfill_frame frame = part->order[k];
+		uint32_t g = frame.commit, v = part->commits[g];
+		uint32_t begin = part->offsets[g], end = part->offsets[g + 1];
+
+		if (frame.leave) {
+			for (uint32_t i = begin; i < end; i++) {
+				undo_nr--;
+				last_touch[undo[undo_nr].slot] = undo[undo_nr].prev;
+			}
+			continue;
+		}
+
+		for (uint32_t i = begin; i < end; i++) {
+			struct backfill_change *change = &part->changes[i];
+			uint32_t slot = change->path_id / part->nr_parts;
+			uint32_t prev = last_touch[slot];
+
+			change->last = prev;
+
+			ALLOC_GROW(undo, undo_nr + 1, undo_alloc);
+			undo[undo_nr].slot = slot;
+			undo[undo_nr].prev = prev;
+			undo_nr++;
+			last_touch[slot] = v;
+		}
+	}
+
+	free(undo);
+	free(last_touch);
+	return NULL;
+}
+
+static int64_t
+count_unfilled_commits(int64_t repository_id)
+{
+	sqlite3_stmt *stmt = stmts[STMT_BACKFILL_COUNT_COMMITS];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, repository_id);
+	if (sqlite3_step(stmt) != SQLITE_ROW)
+		return -1;
+	return sqlite3_column_int64(stmt, 0);
+}
+
+// Fill in the commits of a repository that have no first_depth yet. When
+// rows holds exactly those commits, as after a sync that backfills in
+// the same transaction, they are taken from there instead of the
+// database.
+static void
+backfill_repository(int64_t repository_id, struct staged_rows *rows)
+{
+	dbg("backfilling repository %" PRId64, repository_id);
+
+	if (rows && (int64_t)rows->commits_nr !=
+			count_unfilled_commits(repository_id))
+		rows = NULL;
+
+	struct backfill_index *idx = build_backfill_index(repository_id, rows);
+	if (!idx)
+		return;
+
+	uint32_t nr_parts = num_workers > 0 ? num_workers : online_cpus();
+	struct backfill_part *parts;
+	size_t *next = NULL;
+	size_t nr_changes = 0;
+
+	// Changes are found through the commits still missing first_depth,
+	// so load them before filling it in.
+	CALLOC_ARRAY(parts, nr_parts);
+	if (!load_backfill_changes(repository_id, rows, idx, parts, nr_parts) ||
+	    !backfill_first_depths(idx))
+		goto cleanup;
+	for (uint32_t p = 0; p < nr_parts; p++)
+		nr_changes += parts[p].nr;
+	if (!nr_changes)
+		goto cleanup;
+
+	dbg("backfill %zu changes with %" PRIu32 " workers", nr_changes,
+	    nr_parts);
+
+	split_first_parent_order(idx, parts, nr_parts);
+	for (uint32_t p = 0; p < nr_parts; p++) {
+		parts[p].nr_parts = nr_parts;
+		int rc = pthread_create(&parts[p].thread, NULL,
+					backfill_worker, &parts[p]);
+		if (rc) {
+			err("cannot start backfill worker: %s", strerror(rc));
+			exit(1);
+		}
+	}
+	for (uint32_t p = 0; p < nr_parts; p++)
+		pthread_join(parts[p].thread, NULL);
+
+	// This thread alone owns the connection. Writing commit by commit
+	// keeps the updates close to the primary key order of changes; the
+	// groups of each part are in commit order already.
+	CALLOC_ARRAY(next, nr_parts);
+	for (uint32_t i = 0; i < idx->num_commits; i++) {
+		for (uint32_t p = 0; p < nr_parts; p++) {
+			const struct backfill_part *part = &parts[p];
+			size_t g = next[p];
+			if (g == part->nr_commits || part->commits[g] != i)
+				continue;
+			next[p]++;
+
+			uint32_t end = part->offsets[g + 1];
+			for (uint32_t j = part->offsets[g]; j < end; j++) {
+				const struct backfill_change *change =
+				    &part->changes[j];
+				int64_t last_id = 0;
+
+				if (change->last != UINT32_MAX)
+					last_id = idx->commit_ids[change->last];
+				else if (idx->boundary[i] != UINT32_MAX)
+					last_id = boundary_last_change(
+					    repository_id,
+					    &idx->boundaries[idx->boundary[i]],
+					    change->path_id);
+
+				// First change of the path: points to itself.
+				if (!last_id)
+					last_id = idx->commit_ids[i];
+				update_last_commit_id(change->path_id,
+						      idx->commit_ids[i],
+						      last_id);
+			}
+		}
+	}
+
+cleanup:
+	for (uint32_t p = 0; p < nr_parts; p++) {
+		free(parts[p].changes);
+		free(parts[p].commits);
+		free(parts[p].offsets);
+		free(parts[p].order);
+	}
+	free(parts);
+	free(next);
+	backfill_index_free(idx);
+
+	dbg("backfill done for repository %" PRId64, repository_id);
+}
+
+// Deepest commit on the first-parent chains of both a and b, or 0 when the
+// chains share no commit. The jump of a commit only depends on its depth,
+// so two commits at the same depth can jump together for as long as their
+// jumps differ.
+static int64_t
+first_parent_meet(int64_t a, int64_t b)
+{
+	struct first_parent_links la, lb;
+
+	if (!load_first_parent_links(a, &la) ||
+	    !load_first_parent_links(b, &lb))
+		return 0;
+
+	while (la.depth != lb.depth) {
+		struct first_parent_links *l = la.depth > lb.depth ? &la : &lb;
+		int64_t *c = la.depth > lb.depth ? &a : &b;
+		uint32_t depth = la.depth > lb.depth ? lb.depth : la.depth;
+
+		*c = l->jump_depth >= depth ? l->jump_id : l->parent_id;
+		if (!load_first_parent_links(*c, l))
+			return 0;
+	}
+
+	while (a != b) {
+		// Two different roots.
+		if (!la.depth)
+			return 0;
+
+		if (la.jump_id != lb.jump_id) {
+			a = la.jump_id;
+			b = lb.jump_id;
+		} else {
+			a = la.parent_id;
+			b = lb.parent_id;
+		}
+		if (!load_first_parent_links(a, &la) ||
+		    !load_first_parent_links(b, &lb))
+			return 0;
+	}
+	return a;
+}
+
+// Latest commit at or below depth on the first-parent chain of commit_id
+// that changed path_id, found by following the path's last_commit_id
+// links; 0 when there is none.
+static int64_t
+last_change_at_depth(int64_t commit_id, int64_t path_id, uint32_t depth)
+{
+	sqlite3_stmt *stmt = stmts[STMT_GET_LAST_CHANGE];
+
+	for (;;) {
+		sqlite3_reset(stmt);
+		sqlite3_bind_int64(stmt, 1, commit_id);
+		sqlite3_bind_int64(stmt, 2, path_id);
+		if (sqlite3_step(stmt) != SQLITE_ROW)
+			return 0;
+
+		int64_t last_id = sqlite3_column_int64(stmt, 0);
+		uint32_t last_depth = sqlite3_column_int64(stmt, 1);
+		if (last_id == commit_id)
+			return 0;
+		if (last_depth <= depth)
+			return last_id;
+		commit_id = last_id;
+	}
+}
+
+static int64_t
+tip_paths_get(int64_t repository_id, const char *full_name, int64_t path_id)
+{
+	sqlite3_stmt *stmt = stmts[STMT_TIP_PATHS_GET];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, repository_id);
+	sqlite3_bind_text(stmt, 2, full_name, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 3, path_id);
+	return sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0)
+						: 0;
+}
+
+static void
+tip_paths_exec(int id, int64_t repository_id, const char *full_name,
+	       int64_t a, int64_t b)
+{
+	sqlite3_stmt *stmt = stmts[id];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, repository_id);
+	sqlite3_bind_text(stmt, 2, full_name, -1, SQLITE_STATIC);
+	if (id != STMT_TIP_PATHS_CLEAR && id != STMT_TIP_BASES_DROP)
+		sqlite3_bind_int64(stmt, 3, a);
+	if (id == STMT_TIP_PATHS_SET || id == STMT_TIP_PATHS_PRESERVE ||
+	    id == STMT_TIP_PATHS_ADVANCE)
+		sqlite3_bind_int64(stmt, 4, b);
+
+	if (sqlite3_step(stmt) != SQLITE_DONE)
+		err("failed to update start points of %s: %s", full_name,
+		    sqlite3_errmsg(conn));
+}
+
+// Depth where the chain of full_name parts from the branch whose rows it
+// shares, or -1 when it has no base.
+static int64_t
+tip_base_depth(int64_t repository_id, const char *full_name)
+{
+	sqlite3_stmt *stmt = stmts[STMT_TIP_BASES_GET];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, repository_id);
+	sqlite3_bind_text(stmt, 2, full_name, -1, SQLITE_STATIC);
+	return sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0)
+						: -1;
+}
+
+static void
+set_tip_base(int64_t repository_id, const char *full_name,
+	     const char *base_name, uint32_t base_depth)
+{
+	sqlite3_stmt *stmt = stmts[STMT_TIP_BASES_SET];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, repository_id);
+	sqlite3_bind_text(stmt, 2, full_name, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 3, base_name, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 4, base_depth);
+
+	if (sqlite3_step(stmt) != SQLITE_DONE)
+		err("failed to share start points of %s: %s", base_name,
+		    sqlite3_errmsg(conn));
+}
+
+struct tip_path {
+	int64_t path_id;
+	int64_t commit_id;
+};
+
+// The tip moved off the chain above meet: rows pointing there fall back to
+// the latest change at or below meet, which the path's own links reach.
+// The rows are read from from, which is full_name itself or the branch a
+// new full_name shares rows with; only its own rows without such a change
+// are removed.
+static void
+rewind_tip_paths(int64_t repository_id, const char *full_name,
+		 const char *from, uint32_t meet_depth)
+{
+	struct tip_path *rows = NULL;
+	size_t nr = 0, alloc = 0;
+
+	sqlite3_stmt *stmt = stmts[STMT_TIP_PATHS_ABOVE];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, repository_id);
+	sqlite3_bind_text(stmt, 2, from, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 3, meet_depth);
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		ALLOC_GROW(rows, nr + 1, alloc);
+		rows[nr].path_id = sqlite3_column_int64(stmt, 0);
+		rows[nr].commit_id = sqlite3_column_int64(stmt, 1);
+		nr++;
+	}
+
+	dbg("rewinding %zu start points of %s", nr, full_name);
+
+	for (size_t i = 0; i < nr; i++) {
+		int64_t last_id = last_change_at_depth(
+		    rows[i].commit_id, rows[i].path_id, meet_depth);
+		if (last_id)
+			tip_paths_exec(STMT_TIP_PATHS_SET, repository_id,
+				       full_name, rows[i].path_id, last_id);
+		else if (!strcmp(from, full_name))
+			tip_paths_exec(STMT_TIP_PATHS_DELETE, repository_id,
+				       full_name, rows[i].path_id, 0);
+	}
+
+	free(rows);
+}
+
+// Bring the start points of a ref up to its current tip. A fast-forward
+// only adds what the new first-parent commits changed; a rewound or
+// rewritten ref first falls back to where the old and new chains meet. A
+// new ref shares the rows of seed, when it shares history with it, rather
+// than starting from an empty set, and only gets rows of its own for the
+// paths changed since the chains part.
+static void
+update_tip_paths(int64_t repository_id, const char *full_name,
+		 const char *seed)
+{
+	int64_t old_tip = tip_paths_get(repository_id, full_name, 0);
+	int64_t new_tip = 0;
+	bool seeded = false;
+
+	sqlite3_stmt *stmt = stmts[STMT_GET_REF_COMMIT];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, repository_id);
+	sqlite3_bind_text(stmt, 2, full_name, -1, SQLITE_STATIC);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		new_tip = sqlite3_column_int64(stmt, 0);
+
+	if (old_tip == new_tip)
+		return;
+
+	if (!old_tip && new_tip && seed) {
+		old_tip = tip_paths_get(repository_id, seed, 0);
+		seeded = true;
+	}
+
+	int64_t meet = 0;
+	struct first_parent_links links;
+	if (old_tip && new_tip)
+		meet = first_parent_meet(old_tip, new_tip);
+	if (meet && !load_first_parent_links(meet, &links))
+		meet = 0;
+
+	if (meet && seeded) {
+		// A base has no base of its own, and then no sharing branch.
+		if (tip_base_depth(repository_id, seed) >= 0) {
+			tip_paths_exec(STMT_TIP_PATHS_UNSHARE, repository_id,
+				       seed, -1, 0);
+			tip_paths_exec(STMT_TIP_BASES_DELETE, repository_id,
+				       seed, -1, 0);
+		}
+		set_tip_base(repository_id, full_name, seed, links.depth);
+		rewind_tip_paths(repository_id, full_name, seed, links.depth);
+	} else if (!meet) {
+		tip_paths_exec(STMT_TIP_BASES_DROP, repository_id, full_name,
+			       0, 0);
+		tip_paths_exec(STMT_TIP_PATHS_UNSHARE, repository_id,
+			       full_name, -1, 0);
+		tip_paths_exec(STMT_TIP_BASES_DELETE, repository_id,
+			       full_name, -1, 0);
+		tip_paths_exec(STMT_TIP_PATHS_CLEAR, repository_id, full_name,
+			       0, 0);
+	} else if (meet != old_tip) {
+		tip_paths_exec(STMT_TIP_PATHS_UNSHARE, repository_id,
+			       full_name, links.depth, 0);
+		tip_paths_exec(STMT_TIP_BASES_DELETE, repository_id,
+			       full_name, links.depth, 0);
+		rewind_tip_paths(repository_id, full_name, full_name,
+				 links.depth);
+	}
+
+	if (!new_tip)
+		return;
+
+	dbg("advancing start points of %s from %" PRId64 " to %" PRId64,
+	    full_name, meet, new_tip);
+
+	int64_t meet_depth = meet ? (int64_t)links.depth : -1;
+	tip_paths_exec(STMT_TIP_PATHS_PRESERVE, repository_id, full_name,
+		       new_tip, meet_depth);
+	tip_paths_exec(STMT_TIP_PATHS_ADVANCE, repository_id, full_name,
+		       new_tip, meet_depth);
+	tip_paths_exec(STMT_TIP_PATHS_SET, repository_id, full_name, 0,
+		       new_tip);
+}
+
+// Start points follow every branch a sync created, moved or deleted. The
+// default branch goes first, so that new branches can share its rows.
+static void
+update_branch_tips(int64_t repository_id, const struct ref_delta *delta,
+		   const char *head_ref)
+{
+	const char *show_name;
+
+	if (head_ref)
+		update_tip_paths(repository_id, head_ref, NULL);
+
+	for (size_t i = 0; i < delta->moved_nr; i++) {
+		const char *name = delta->moved[i].name;
+		if (ref_type_of(name, &show_name) == 0 &&
+		    (!head_ref || strcmp(name, head_ref)))
+			update_tip_paths(repository_id, name, head_ref);
+	}
+	for (size_t i = 0; i < delta->recorded_nr; i++) {
+		const char *name = delta->recorded[i].name;
+		if (!delta->recorded[i].seen &&
+		    ref_type_of(name, &show_name) == 0)
+			update_tip_paths(repository_id, name, NULL);
+	}
+}
+
+// Maintained per row, in random key order, unless a bulk import drops
+// them first; init.sql creates them again. UNIQUE (parent_path_id,
+// basename) on paths is a table constraint that path lookups need while
+// the walk runs, so it stays. Replaying the rows of a 1e6-commit import
+// with a small SQLite-only harness took 23-29 s row at a time and 5-6 s
+// bulk with these dropped. That excludes tree diffing and was not taken
+// through bushi-index, so it bounds the database side only.
+static const char *deferred_indexes[] = {
+    "idx_commit_hash",
+    "idx_parent_hash",
+    "idx_commit_hash_only",
+    "idx_changes_path_last",
+    NULL,
+};
+
+static void
+stage_begin(int64_t repository_id, bool bulk)
+{
+	staged = xcalloc(1, sizeof(*staged));
+	staged->repository_id = repository_id;
+	staged->bulk = bulk;
+	if (bulk) {
+		staged->existing_commits = next_commit_id() - 1;
+		dbg("bulk import for repository %" PRId64, repository_id);
+	}
+}
+
+static void
+stage_end(void)
+{
+	for (size_t i = 0; i < staged->commits_nr; i++)
+		free(staged->commits[i].subject);
+	free(staged->commits);
+	free(staged->path_ids);
+	FREE_AND_NULL(staged);
+}
+
+static void
+bind_staged_commit(sqlite3_stmt *stmt, int col, const struct staged_commit *c)
+{
+	sqlite3_bind_int64(stmt, col, c->commit_id);
+	bind_oid(stmt, col + 1, &c->oid);
+	bind_oid(stmt, col + 2, c->has_parent ? &c->parent_oid : NULL);
+	sqlite3_bind_int64(stmt, col + 3, staged->repository_id);
+	bind_commit_meta(stmt, col + 4, c->author_id, c->author_time,
+			 c->commit_time, c->subject);
+}
+
+static void
+bulk_insert_commits(void)
+{
+	sqlite3_stmt *many = stmts[STMT_BULK_INSERT_COMMITS];
+	sqlite3_stmt *one = stmts[STMT_INSERT_COMMIT];
+	size_t i = 0;
+
+	for (; i + BULK_ROWS <= staged->commits_nr; i += BULK_ROWS) {
+		sqlite3_reset(many);
+		for (int r = 0; r < BULK_ROWS; r++)
+			bind_staged_commit(many, r * 8 + 1,
+					   &staged->commits[i + r]);
+		if (sqlite3_step(many) != SQLITE_DONE) {
+			err("failed to load commits: %s", sqlite3_errmsg(conn));
+			staged->commits_failed = true;
+		}
+	}
+
+	for (; i < staged->commits_nr; i++) {
+		sqlite3_reset(one);
+		bind_staged_commit(one, 1, &staged->commits[i]);
+		if (sqlite3_step(one) != SQLITE_DONE) {
+			err("failed to load commits: %s", sqlite3_errmsg(conn));
+			staged->commits_failed = true;
+		}
+	}
+}
+
+static void
+bulk_insert_changes(void)
+{
+	sqlite3_stmt *many = stmts[STMT_BULK_INSERT_CHANGES];
+	sqlite3_stmt *one = stmts[STMT_INSERT_CHANGE];
+	int64_t rows[BULK_ROWS][2];
+	int nr_rows = 0;
+	size_t start = 0;
+
+	for (size_t i = 0; i < staged->commits_nr; i++) {
+		const struct staged_commit *c = &staged->commits[i];
+		int64_t *path_ids = staged->path_ids + start;
+		size_t nr = c->changes_end - start;
+
+		// changes is WITHOUT ROWID on (commit_id, path_id), and
+		// commits already come in commit_id order.
+		QSORT(path_ids, nr, int64_cmp);
+
+		for (size_t j = 0; j < nr; j++) {
+			rows[nr_rows][0] = c->commit_id;
+			rows[nr_rows][1] = path_ids[j];
+			if (++nr_rows < BULK_ROWS)
+				continue;
+
+			sqlite3_reset(many);
+			for (int r = 0; r < BULK_ROWS; r++) {
+				sqlite3_bind_int64(many, r * 2 + 1, rows[r][0]);
+				sqlite3_bind_int64(many, r * 2 + 2, rows[r][1]);
+			}
+			if (sqlite3_step(many) != SQLITE_DONE)
+				err("failed to load changes: %s",
+				    sqlite3_errmsg(conn));
+			nr_rows = 0;
+		}
+		start = c->changes_end;
+	}
+
+	for (int r = 0; r < nr_rows; r++) {
+		sqlite3_reset(one);
+		sqlite3_bind_int64(one, 1, rows[r][0]);
+		sqlite3_bind_int64(one, 2, rows[r][1]);
+		if (sqlite3_step(one) != SQLITE_DONE)
+			err("failed to load changes: %s", sqlite3_errmsg(conn));
+	}
+}
+
+// Load the staged rows. When the import outweighs what the database
+// already holds, the secondary indexes are dropped first and built once
+// at the end instead of being maintained row by row.
+static void
+bulk_finish(void)
+{
+	bool defer = (int64_t)staged->commits_nr > staged->existing_commits;
+
+	dbg("bulk load: %zu commits, %zu changes, %s indexes",
+	    staged->commits_nr, staged->path_ids_nr,
+	    defer ? "deferred" : "maintained");
+
+	if (defer) {
+		for (size_t i = 0; deferred_indexes[i]; i++) {
+			char *sql = sqlite3_mprintf("DROP INDEX IF EXISTS %s",
+						    deferred_indexes[i]);
+			db_exec(sql);
+			sqlite3_free(sql);
+		}
+	}
+
+	bulk_insert_commits();
+	bulk_insert_changes();
+
+	if (defer)
+		db_exec(schema);
+}
+
+// Snapshots -S writes after each completed sync, one file per repository
+// in this directory; NULL when not asked for.
+static const char *snapshot_dir;
+
+// A process that keeps running writes the snapshot of a repository that
+// keeps changing at most this often; the syncs in between only mark it
+// stale.
+#define SNAPSHOT_INTERVAL_MS 5000
+
+static int64_t
+monotonic_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+struct snapshot_path_row {
+	int64_t path_id;
+	int64_t parent_id;
+	char *basename;
+	char *name; // full name, built from the parent's
+	uint32_t index; // in name order
+};
+
+struct snapshot_order {
+	const void *key; // hash or name
+	uint32_t index;
+};
+
+struct snapshot {
+	struct bushi_snapshot_header header;
+
+	int64_t *commit_ids; // sorted; the position is the snapshot commit
+	unsigned char *hashes;
+	struct bushi_snapshot_commit *commits;
+	uint32_t *by_hash;
+	size_t commits_alloc, hashes_alloc, ids_alloc;
+
+	struct snapshot_path_row *path_rows; // by path_id
+	struct bushi_snapshot_path *paths;
+	size_t path_rows_alloc;
+
+	struct bushi_snapshot_change *changes;
+	size_t changes_alloc;
+
+	struct bushi_snapshot_ref *refs;
+	size_t refs_alloc;
+	struct bushi_snapshot_tip *tips;
+	size_t tips_alloc;
+
+	struct strbuf strings;
+};
+
+static int
+snapshot_hash_cmp(const void *va, const void *vb)
+{
+	const struct snapshot_order *a = va, *b = vb;
+	return memcmp(a->key, b->key, the_hash_algo->rawsz);
+}
+
+static int
+snapshot_name_cmp(const void *va, const void *vb)
+{
+	const struct snapshot_order *a = va, *b = vb;
+	return strcmp(a->key, b->key);
+}
+
+static int
+snapshot_tip_cmp(const void *va, const void *vb)
+{
+	const struct bushi_snapshot_tip *a = va, *b = vb;
+	return a->path < b->path ? -1 : a->path > b->path;
+}
+
+static uint32_t
+snapshot_commit(const struct snapshot *snap, int64_t commit_id)
+{
+	size_t lo = 0, hi = snap->header.nr_commits;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (snap->commit_ids[mid] == commit_id)
+			return mid;
+		if (snap->commit_ids[mid] < commit_id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return BUSHI_SNAPSHOT_NONE;
+}
+
+static struct snapshot_path_row *
+snapshot_path_row(const struct snapshot *snap, int64_t path_id)
+{
+	size_t lo = 0, hi = snap->header.nr_paths;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (snap->path_rows[mid].path_id == path_id)
+			return &snap->path_rows[mid];
+		if (snap->path_rows[mid].path_id < path_id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+// The change of path at commit, found by its depth among the changes of
+// the path, deepest first.
+static uint32_t
+snapshot_change(const struct snapshot *snap, uint32_t path, uint32_t commit)
+{
+	const struct bushi_snapshot_path *p = &snap->paths[path];
+	uint32_t depth = snap->commits[commit].depth;
+	size_t lo = p->changes, hi = p->changes + p->nr_changes;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const struct bushi_snapshot_change *c = &snap->changes[mid];
+		uint32_t d = snap->commits[c->commit].depth;
+
+		if (c->commit == commit)
+			return mid;
+		if (d > depth || (d == depth && c->commit < commit))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return BUSHI_SNAPSHOT_NONE;
+}
+
+static uint32_t
+snapshot_string(struct snapshot *snap, const char *s, size_t len)
+{
+	uint32_t offset = snap->strings.len;
+
+	strbuf_add(&snap->strings, s, len);
+	strbuf_addch(&snap->strings, '\0');
+	return offset;
+}
+
+static bool
+snapshot_load_commits(struct snapshot *snap, int64_t repository_id)
+{
+	size_t rawsz = the_hash_algo->rawsz;
+	int64_t *links = NULL; // parent_id and jump_id of each commit
+	size_t nr = 0, links_alloc = 0;
+	bool ok = true;
+
+	sqlite3_stmt *stmt = stmts[STMT_SNAPSHOT_COMMITS];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, repository_id);
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		if ((size_t)sqlite3_column_bytes(stmt, 1) != rawsz ||
+		    sqlite3_column_type(stmt, 3) == SQLITE_NULL ||
+		    nr >= BUSHI_SNAPSHOT_NONE) {
+			ok = false;
+			break;
+		}
+
+		ALLOC_GROW(snap->commit_ids, nr + 1, snap->ids_alloc);
+		ALLOC_GROW(snap->hashes, (nr + 1) * rawsz, snap->hashes_alloc);
+		ALLOC_GROW(snap->commits, nr + 1, snap->commits_alloc);
+		ALLOC_GROW(links, 2 * (nr + 1), links_alloc);
+
+		snap->commit_ids[nr] = sqlite3_column_int64(stmt, 0);
+		memcpy(snap->hashes + nr * rawsz,
+		       sqlite3_column_blob(stmt, 1), rawsz);
+		snap->commits[nr].depth = sqlite3_column_int64(stmt, 3);
+		links[2 * nr] = sqlite3_column_int64(stmt, 2);
+		links[2 * nr + 1] = sqlite3_column_int64(stmt, 4);
+		nr++;
+	}
+	snap->header.nr_commits = nr;
+
+	for (size_t i = 0; ok && i < nr; i++) {
+		struct bushi_snapshot_commit *c = &snap->commits[i];
+
+		c->parent = links[2 * i] ? snapshot_commit(snap, links[2 * i])
+					 : BUSHI_SNAPSHOT_NONE;
+		c->jump = snapshot_commit(snap, links[2 * i + 1]);
+		if (c->jump == BUSHI_SNAPSHOT_NONE ||
+		    (links[2 * i] && c->parent == BUSHI_SNAPSHOT_NONE))
+			ok = false;
+	}
+	free(links);
+
+	if (ok) {
+		struct snapshot_order *order;
+
+		ALLOC_ARRAY(order, nr);
+		for (size_t i = 0; i < nr; i++) {
+			order[i].key = snap->hashes + i * rawsz;
+			order[i].index = i;
+		}
+		QSORT(order, nr, snapshot_hash_cmp);
+		ALLOC_ARRAY(snap->by_hash, nr);
+		for (size_t i = 0; i < nr; i++)
+			snap->by_hash[i] = order[i].index;
+		free(order);
+	}
+	return ok;
+}
+
+static const char *
+snapshot_path_name(struct snapshot *snap, struct snapshot_path_row *row)
+{
+	if (!row->name) {
+		struct snapshot_path_row *parent =
+		    row->parent_id ? snapshot_path_row(snap, row->parent_id)
+				   : NULL;
+		row->name = parent ? xstrfmt("%s%s",
+					     snapshot_path_name(snap, parent),
+					     row->basename)
+				   : xstrdup(row->basename);
+	}
+	return row->name;
+}
+
+static bool
+snapshot_load_paths(struct snapshot *snap, int64_t repository_id)
+{
+	size_t nr = 0;
+
+	sqlite3_stmt *stmt = stmts[STMT_SNAPSHOT_PATHS];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, repository_id);
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		ALLOC_GROW(snap->path_rows, nr + 1, snap->path_rows_alloc);
+		struct snapshot_path_row *row = &snap->path_rows[nr++];
+
+		row->path_id = sqlite3_column_int64(stmt, 0);
+		row->parent_id = sqlite3_column_int64(stmt, 1);
+		row->basename = xstrdup(
+		    (const char *)sqlite3_column_text(stmt, 2));
+		row->name = NULL;
+	}
+	snap->header.nr_paths = nr;
+
+	struct snapshot_order *order;
+	ALLOC_ARRAY(order, nr);
+	for (size_t i = 0; i < nr; i++) {
+		order[i].key = snapshot_path_name(snap, &snap->path_rows[i]);
+		order[i].index = i;
+	}
+	QSORT(order, nr, snapshot_name_cmp);
+
+	CALLOC_ARRAY(snap->paths, nr);
+	for (size_t i = 0; i < nr; i++) {
+		struct snapshot_path_row *row =
+			&snap->path_rows[order[i].index];
+
+		row->index = i;
+		snap->paths[i].name_len = strlen(row->name);
+		snap->paths[i].name = snapshot_string(snap, row->name,
+						      snap->paths[i].name_len);
+	}
+	free(order);
+	return true;
+}
+
+struct snapshot_change_row {
+	uint32_t path;
+	uint32_t depth;
+	uint32_t commit;
+	uint32_t last; // commit
+};
+
+static int
+snapshot_change_cmp(const void *va, const void *vb)
+{
+	const struct snapshot_change_row *a = va, *b = vb;
+
+	if (a->path != b->path)
+		return a->path < b->path ? -1 : 1;
+	if (a->depth != b->depth)
+		return a->depth > b->depth ? -1 : 1;
+	return a->commit < b->commit ? -1 : a->commit > b->commit;
+}
+
+static bool
+snapshot_load_changes(struct snapshot *snap, int64_t repository_id)
+{
+	struct snapshot_change_row *rows = NULL;
+	size_t nr = 0, alloc = 0;
+	bool ok = true;
+
+	sqlite3_stmt *stmt = stmts[STMT_SNAPSHOT_CHANGES];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, repository_id);
+	while (ok && sqlite3_step(stmt) == SQLITE_ROW) {
+		struct snapshot_path_row *path =
+		    snapshot_path_row(snap, sqlite3_column_int64(stmt, 0));
+		uint32_t commit =
+		    snapshot_commit(snap, sqlite3_column_int64(stmt, 1));
+		uint32_t last =
+		    snapshot_commit(snap, sqlite3_column_int64(stmt, 2));
+
+		if (!path || commit == BUSHI_SNAPSHOT_NONE ||
+		    last == BUSHI_SNAPSHOT_NONE || nr >= BUSHI_SNAPSHOT_NONE) {
+			ok = false;
+			break;
+		}
+
+		ALLOC_GROW(rows, nr + 1, alloc);
+		rows[nr].path = path->index;
+		rows[nr].depth = snap->commits[commit].depth;
+		rows[nr].commit = commit;
+		rows[nr].last = last;
+		nr++;
+	}
+
+	QSORT(rows, nr, snapshot_change_cmp);
+	snap->header.nr_changes = nr;
+	ALLOC_ARRAY(snap->changes, nr);
+	for (size_t i = 0; i < nr; i++) {
+		struct bushi_snapshot_path *p = &snap->paths[rows[i].path];
+
+		if (!p->nr_changes++)
+			p->changes = i;
+		snap->changes[i].commit = rows[i].commit;
+	}
+
+	// The chains link changes of the same path.
+	for (size_t i = 0; ok && i < nr; i++) {
+		uint32_t last =
+			snapshot_change(snap, rows[i].path, rows[i].last);
+		if (last == BUSHI_SNAPSHOT_NONE)
+			ok = false;
+		snap->changes[i].last = last;
+	}
+
+	free(rows);
+	return ok;
+}
+
+// Branches keep their start points in tip_paths; they are only used while
+// they were computed for the commit the ref points to.
+static bool
+snapshot_load_tips(struct snapshot *snap, int64_t repository_id,
+		   const char *full_name, int64_t commit_id,
+		   struct bushi_snapshot_ref *ref)
+{
+	size_t nr = snap->header.nr_tips;
+	bool ok = true;
+
+	ref->tips = nr;
+	sqlite3_stmt *stmt = stmts[STMT_SNAPSHOT_TIPS];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, repository_id);
+	sqlite3_bind_text(stmt, 2, full_name, -1, SQLITE_STATIC);
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		int64_t path_id = sqlite3_column_int64(stmt, 0);
+		int64_t tip_id = sqlite3_column_int64(stmt, 1);
+
+		if (!path_id) {
+			ref->materialized = tip_id == commit_id;
+			continue;
+		}
+		if (!ref->materialized)
+			break;
+
+		struct snapshot_path_row *path =
+			snapshot_path_row(snap, path_id);
+		uint32_t commit = snapshot_commit(snap, tip_id);
+		if (!path || commit == BUSHI_SNAPSHOT_NONE) {
+			ok = false;
+			break;
+		}
+
+		ALLOC_GROW(snap->tips, nr + 1, snap->tips_alloc);
+		snap->tips[nr].path = path->index;
+		snap->tips[nr].change = snapshot_change(snap, path->index,
+							commit);
+		if (snap->tips[nr].change == BUSHI_SNAPSHOT_NONE) {
+			ok = false;
+			break;
+		}
+		nr++;
+	}
+	sqlite3_reset(stmt);
+
+	if (!ok || !ref->materialized) {
+		ref->materialized = 0;
+		nr = ref->tips;
+	}
+	ref->nr_tips = nr - ref->tips;
+	QSORT(snap->tips + ref->tips, ref->nr_tips, snapshot_tip_cmp);
+	snap->header.nr_tips = nr;
+	return ok;
+}
+
+static bool
+snapshot_load_refs(struct snapshot *snap, int64_t repository_id,
+		   const char *head_ref)
+{
+	struct strbuf name = STRBUF_INIT;
+	size_t nr = 0;
+	bool ok = true;
+
+	snap->header.head = BUSHI_SNAPSHOT_NONE;
+
+	// The tips statement runs while this one is stepped.
+	sqlite3_stmt *stmt = stmts[STMT_SNAPSHOT_REFS];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, repository_id);
+	while (ok && sqlite3_step(stmt) == SQLITE_ROW) {
+		int64_t commit_id = sqlite3_column_int64(stmt, 1);
+		uint32_t commit = snapshot_commit(snap, commit_id);
+
+		strbuf_reset(&name);
+		strbuf_addstr(&name,
+			      (const char *)sqlite3_column_text(stmt, 0));
+		if (commit == BUSHI_SNAPSHOT_NONE) {
+			ok = false;
+			break;
+		}
+
+		ALLOC_GROW(snap->refs, nr + 1, snap->refs_alloc);
+		struct bushi_snapshot_ref *ref = &snap->refs[nr];
+		memset(ref, 0, sizeof(*ref));
+		ref->name_len = name.len;
+		ref->name = snapshot_string(snap, name.buf, name.len);
+		ref->commit = commit;
+		ok = snapshot_load_tips(snap, repository_id, name.buf,
+					commit_id, ref);
+
+		if (head_ref && !strcmp(name.buf, head_ref))
+			snap->header.head = nr;
+		nr++;
+	}
+	snap->header.nr_refs = nr;
+
+	strbuf_release(&name);
+	return ok;
+}
+
+static void
+snapshot_section(struct strbuf *out, uint64_t *offset, const void *data,
+		 size_t size)
+{
+	strbuf_addchars(out, 0, (8 - out->len % 8) % 8);
+	*offset = out->len;
+	strbuf_add(out, data, size);
+}
+
+static void
+snapshot_release(struct snapshot *snap)
+{
+	for (size_t i = 0; i < snap->header.nr_paths; i++) {
+		free(snap->path_rows[i].basename);
+		free(snap->path_rows[i].name);
+	}
+	free(snap->path_rows);
+	free(snap->paths);
+	free(snap->commit_ids);
+	free(snap->hashes);
+	free(snap->commits);
+	free(snap->by_hash);
+	free(snap->changes);
+	free(snap->refs);
+	free(snap->tips);
+	strbuf_release(&snap->strings);
+}
+
+// Write the snapshot of a repository next to a temporary name and rename
+// it over the old one, so that readers map either snapshot whole. A sync
+// that changed nothing only writes a snapshot that is missing.
+static void
+export_snapshot(int64_t repository_id, const char *name,
+		const char *head_ref, bool changed)
+{
+	char *file = xstrfmt("%s/%s.snap", snapshot_dir, name);
+	char *tmp = xstrfmt("%s.tmp", file);
+	struct snapshot snap = {.strings = STRBUF_INIT};
+	struct strbuf out = STRBUF_INIT;
+	struct bushi_snapshot_header *h = &snap.header;
+
+	if (strchr(name, '/')) {
+		err("cannot write a snapshot of %s: name contains '/'", name);
+		goto out;
+	}
+	if (!changed && !access(file, F_OK))
+		goto out;
+
+	// One read transaction, so that the sections agree.
+	db_begin_transaction();
+	bool ok = snapshot_load_commits(&snap, repository_id) &&
+		  snapshot_load_paths(&snap, repository_id) &&
+		  snapshot_load_changes(&snap, repository_id) &&
+		  snapshot_load_refs(&snap, repository_id, head_ref);
+	db_end_transaction();
+	if (!ok || snap.strings.len >= BUSHI_SNAPSHOT_NONE) {
+		err("cannot write a snapshot of %s: inconsistent index", name);
+		goto out;
+	}
+
+	memcpy(h->magic, BUSHI_SNAPSHOT_MAGIC, sizeof(h->magic));
+	h->version = BUSHI_SNAPSHOT_VERSION;
+	h->order = BUSHI_SNAPSHOT_ORDER;
+	h->hash_len = the_hash_algo->rawsz;
+
+	strbuf_add(&out, h, sizeof(*h));
+	snapshot_section(&out, &h->hashes, snap.hashes,
+			 st_mult(h->nr_commits, h->hash_len));
+	snapshot_section(&out, &h->commits, snap.commits,
+			 st_mult(h->nr_commits, sizeof(*snap.commits)));
+	snapshot_section(&out, &h->by_hash, snap.by_hash,
+			 st_mult(h->nr_commits, sizeof(*snap.by_hash)));
+	snapshot_section(&out, &h->paths, snap.paths,
+			 st_mult(h->nr_paths, sizeof(*snap.paths)));
+	snapshot_section(&out, &h->changes, snap.changes,
+			 st_mult(h->nr_changes, sizeof(*snap.changes)));
+	snapshot_section(&out, &h->refs, snap.refs,
+			 st_mult(h->nr_refs, sizeof(*snap.refs)));
+	snapshot_section(&out, &h->tips, snap.tips,
+			 st_mult(h->nr_tips, sizeof(*snap.tips)));
+	snapshot_section(&out, &h->strings, snap.strings.buf,
+			 snap.strings.len);
+	h->strings_size = snap.strings.len;
+	h->size = out.len;
+	memcpy(out.buf, h, sizeof(*h));
+
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	bool written = fd >= 0 && write_in_full(fd, out.buf, out.len) >= 0 &&
+		       !fsync(fd);
+	if ((fd >= 0 && close(fd)) || !written || rename(tmp, file)) {
+		err("cannot write snapshot %s: %s", file, strerror(errno));
+		unlink(tmp);
+		goto out;
+	}
+
+	dbg("wrote snapshot %s: %u commits, %u paths, %u changes", file,
+	    h->nr_commits, h->nr_paths, h->nr_changes);
+out:
+	snapshot_release(&snap);
+	strbuf_release(&out);
+	free(tmp);
+	free(file);
+}
+
+// What a sync leaves for the next sync of the same repository, in a
+// process that keeps running: the repository, with the objects it parsed
+// and the packs it opened, and the commits known to be indexed. After a
+// turn cut short, also the new commits found by the bitmap walk that are
+// still to be queued, in order, and the ref delta they were found for.
+struct sync_state {
+	struct repository *repo;
+	struct commit_map commit_map;
+
+	struct commit **bitmap_commits;
+	size_t bitmap_commits_nr, bitmap_commits_alloc;
+	struct strbuf bitmap_refs;
+
+	// monotonic ms of the last snapshot written, and whether a sync
+	// changed the index since
+	int64_t snapshot_at;
+	bool snapshot_stale;
+};
+
+// The created, moved and deleted refs of a delta, as one string.
+static void
+describe_ref_delta(const struct ref_delta *delta, struct strbuf *out)
+{
+	strbuf_reset(out);
+	for (size_t i = 0; i < delta->moved_nr; i++)
+		strbuf_addf(out, "%s %s\n", oid_to_hex(&delta->moved[i].oid),
+			    delta->moved[i].name);
+	for (size_t i = 0; i < delta->recorded_nr; i++)
+		if (!delta->recorded[i].seen)
+			strbuf_addf(out, "- %s\n", delta->recorded[i].name);
+}
+
+// Take up the bitmap walk of the turn before, when the refs have not
+// changed since: the commits it left are still new, and still in order.
+static bool
+resume_bitmap_difference(struct sync_state *state,
+			 const struct ref_delta *delta)
+{
+	struct strbuf refs = STRBUF_INIT;
+	bool same;
+
+	if (!state->bitmap_commits_nr)
+		return false;
+
+	describe_ref_delta(delta, &refs);
+	same = !strcmp(refs.buf, state->bitmap_refs.buf);
+	strbuf_release(&refs);
+
+	if (same) {
+		dbg("resuming bitmap walk with %zu commits",
+		    state->bitmap_commits_nr);
+		bitmap_commits = state->bitmap_commits;
+		bitmap_commits_nr = state->bitmap_commits_nr;
+		bitmap_commits_alloc = state->bitmap_commits_alloc;
+	} else {
+		free(state->bitmap_commits);
+	}
+	state->bitmap_commits = NULL;
+	state->bitmap_commits_nr = state->bitmap_commits_alloc = 0;
+	return same;
+}
+
+// Keep what is left of the bitmap walk for the next turn.
+static void
+save_bitmap_difference(struct sync_state *state,
+		       const struct ref_delta *delta)
+{
+	state->bitmap_commits = bitmap_commits;
+	state->bitmap_commits_nr = bitmap_commits_nr;
+	state->bitmap_commits_alloc = bitmap_commits_alloc;
+	describe_ref_delta(delta, &state->bitmap_refs);
+
+	bitmap_commits = NULL;
+	bitmap_commits_nr = bitmap_commits_alloc = 0;
+}
+
+static void
+sync_state_release(struct sync_state *state)
+{
+	if (state->repo) {
+		repo_clear(state->repo);
+		FREE_AND_NULL(state->repo);
+	}
+	commit_map_clear(&state->commit_map);
+	FREE_AND_NULL(state->bitmap_commits);
+	state->bitmap_commits_nr = state->bitmap_commits_alloc = 0;
+	strbuf_release(&state->bitmap_refs);
+}
 
-	while (sqlite3_step(list_paths) == SQLITE_ROW) {
-		int64_t path_id = sqlite3_column_int64(list_paths, 0);
-		backfill_one_path(path_id, repository_id, idx, &buf);
+// Make the repository of state the_repository, opening it if needed. One
+// kept from an earlier sync only has to look for new packs and refs, and
+// drop the marks of the walks that sync ran.
+static bool
+open_sync_repository(struct sync_state *state, const char *gitdir)
+{
+	if (state->repo) {
+		the_repository = state->repo;
+		odb_reprepare(the_repository->objects);
+
+		// Loose refs stay cached for as long as the ref store lives.
+		if (the_repository->refs_private) {
+			ref_store_release(the_repository->refs_private);
+			FREE_AND_NULL(the_repository->refs_private);
+		}
+		reset_revision_walk();
+		return true;
 	}
 
-	free(buf.pending);
-	free(buf.bitmap);
-	backfill_index_free(idx);
+	struct repository *repo = xcalloc(1, sizeof(*repo));
+	if (repo_init(repo, gitdir, NULL) < 0) {
+		err("cannot initialize repository: %s", gitdir);
+		free(repo);
+		return false;
+	}
+	state->repo = the_repository = repo;
 
-	dbg("backfill done for repository %" PRId64, repository_id);
+	// Reduce Git's internal caches; we stream objects and don't need big
+	// caches.
+	the_repository->settings.delta_base_cache_limit = 0;
+	return true;
 }
 
-void
-run_sync(const char *name)
+// Sync one repository, queueing at most budget new commits. Returns true
+// when the turn stopped at the budget and the repository has more to sync;
+// the refs are only updated by the turn that completes it. With keep, the
+// repository, the known commits and the rest of a cut bitmap walk stay
+// there for the next sync of the same repository, which also writes the
+// snapshot at most every SNAPSHOT_INTERVAL_MS and marks keep when it owes
+// one; otherwise they are released before returning.
+bool
+run_sync(const char *name, uint64_t budget, struct sync_state *keep)
 {
 	sqlite3_stmt *stmt = stmts[STMT_GET_REPOSITORY_BY_NAME];
 	sqlite3_reset(stmt);
@@ -1169,66 +4895,185 @@ run_sync(const char *name)
 	int rc = sqlite3_step(stmt);
 	if (rc != SQLITE_ROW) {
 		err("repository not found: %s", name);
-		return;
+		return false;
 	}
 
 	int64_t repository_id = sqlite3_column_int64(stmt, 0);
 	char *gitdir = xstrdup((const char *)sqlite3_column_text(stmt, 1));
-
-	if (repo_init(the_repository, gitdir, NULL) < 0) {
-		err("cannot initialize repository: %s", gitdir);
+	const char *head = (const char *)sqlite3_column_text(stmt, 2);
+	char *head_ref = head ? xstrfmt("refs/heads/%s", head) : NULL;
+	struct repository *main_repository = the_repository;
+	struct sync_state once = {.bitmap_refs = STRBUF_INIT};
+	struct sync_state *state = keep ? keep : &once;
+
+	if (!open_sync_repository(state, gitdir)) {
+		free(head_ref);
 		free(gitdir);
-		return;
+		return false;
 	}
 
 	// Do not cache the raw commit object buffers; we only need parsed
 	// metadata.
 	save_commit_buffer = 0;
 
-	// Reduce Git's internal caches; we stream objects and don't need big
-	// caches.
-	the_repository->settings.delta_base_cache_limit = 0;
-
-	// Initialize on-demand cache for path lookups.
-	strmap_init(&path_map);
+	rename_limit = determine_rename_limit();
 
 	dbg("syncing repository %" PRId64 ": %s", repository_id, gitdir);
 
 	db_begin_transaction();
 
-	// Mark all existing refs for this repository as dirty
-	stmt = stmts[STMT_UPDATE_REFS_DIRTY];
-	sqlite3_reset(stmt);
-	sqlite3_bind_int64(stmt, 1, repository_id);
-	rc = sqlite3_step(stmt);
-	if (rc != SQLITE_DONE)
-		err("failed to mark refs dirty: %s", sqlite3_errmsg(conn));
+	// When no branch or tag moved there is nothing new to index.
+	struct ref_delta delta;
+	bool more = false, changed = false;
+	load_ref_delta(repository_id, &delta);
+	if (!delta.moved_nr && !delta.deleted) {
+		dbg("refs unchanged");
+		db_end_transaction();
+		goto out;
+	}
 
-	// Walk each ref's history, inserting commits and changes as we go
-	refs_for_each_ref(get_main_ref_store(the_repository), walk_ref_commits,
-			  &repository_id);
+	load_commit_map(repository_id, &state->commit_map);
+	bool use_bitmap = resume_bitmap_difference(state, &delta) ||
+			  find_bitmap_difference(repository_id, &delta);
 
-	// Upsert all current refs; this also clears is_dirty for each live ref
-	refs_for_each_ref(get_main_ref_store(the_repository), insert_ref,
-			  &repository_id);
+	// A first import stages its rows and loads them sorted at the end.
+	stage_begin(repository_id, !commit_map.size);
 
-	// Delete refs that are no longer present
-	stmt = stmts[STMT_DELETE_DIRTY_REFS];
-	sqlite3_reset(stmt);
-	sqlite3_bind_int64(stmt, 1, repository_id);
-	rc = sqlite3_step(stmt);
-	if (rc != SQLITE_DONE)
-		err("failed to delete dirty refs: %s", sqlite3_errmsg(conn));
+	// Walk the history of created and moved refs; the pipeline diffs
+	// and inserts commits and changes behind the walk. Its writer thread
+	// owns conn until pipeline_finish() returns.
+	struct sync_pipeline pipe;
+	pipeline_start(&pipe, repository_id, budget);
+	if (use_bitmap)
+		walk_bitmap_difference(&pipe);
+	else
+		walk_moved_refs(&pipe, &delta);
+	pipeline_finish(&pipe);
+
+	if (staged->bulk)
+		bulk_finish();
+
+	// A cut turn leaves the refs as they were, so the next turn finds
+	// the same delta and walks on from what this one indexed.
+	more = pipe.cut;
+	if (more) {
+		dbg("turn ended after %" PRIu64 " commits", pipe.next_walk);
+		if (use_bitmap && keep)
+			save_bitmap_difference(state, &delta);
+	} else {
+		for (size_t i = 0; i < delta.moved_nr; i++)
+			upsert_ref(repository_id, &delta.moved[i]);
+		for (size_t i = 0; i < delta.recorded_nr; i++)
+			if (!delta.recorded[i].seen)
+				delete_ref(repository_id, &delta.recorded[i]);
+	}
 
+	// Backfill in the same transaction: readers never see commits
+	// without first_depth, and the staged rows are all it has to fill.
+	backfill_repository(repository_id, staged);
+	if (!more)
+		update_branch_tips(repository_id, &delta, head_ref);
 	db_end_transaction();
 
-	strmap_clear(&path_map, 0);
+	// The walker maps each commit before the writer inserts it. When an
+	// insert failed, the map names commits the database does not hold,
+	// so the next sync loads it again rather than trust it.
+	if (staged->commits_failed) {
+		dbg("not keeping the commit map of %s", name);
+		commit_map_clear(&commit_map);
+	}
+	stage_end();
+	release_bitmap_difference();
+	state->commit_map = commit_map;
+	memset(&commit_map, 0, sizeof(commit_map));
+	changed = true;
+out:
+	if (snapshot_dir && !more) {
+		int64_t now = monotonic_ms();
+
+		state->snapshot_stale |= changed;
+		if (!state->snapshot_stale) {
+			export_snapshot(repository_id, name, head_ref, false);
+		} else if (!keep || !state->snapshot_at ||
+			   now - state->snapshot_at >= SNAPSHOT_INTERVAL_MS) {
+			export_snapshot(repository_id, name, head_ref, true);
+			state->snapshot_stale = false;
+			state->snapshot_at = now;
+		}
+	}
+	ref_delta_release(&delta);
+	free(head_ref);
 	free(gitdir);
-	repo_clear(the_repository);
+	sync_state_release(&once);
+	the_repository = main_repository;
+	return more;
+}
 
-	db_begin_transaction();
-	backfill_repository(repository_id);
-	db_end_transaction();
+struct pending_sync {
+	char *name;
+	struct sync_state state;
+};
+
+static void
+add_pending_sync(struct pending_sync **pending, size_t *nr, size_t *alloc,
+		 const char *name)
+{
+	ALLOC_GROW(*pending, *nr + 1, *alloc);
+	struct pending_sync *p = &(*pending)[(*nr)++];
+	memset(p, 0, sizeof(*p));
+	p->name = xstrdup(name);
+	strbuf_init(&p->state.bitmap_refs, 0);
+}
+
+// Sync the named repositories, or all of them when names is NULL, in one
+// process. Each pass gives every repository with work left one turn, so a
+// huge import cannot hold up the small ones; the last one left runs to the
+// end in a single turn. A repository stays open from one of its turns to
+// the next, and picks up where the turn before stopped.
+void
+run_batch(const char *const *names)
+{
+	struct pending_sync *pending = NULL;
+	size_t pending_nr = 0, pending_alloc = 0;
+
+	if (names) {
+		for (; *names; names++)
+			add_pending_sync(&pending, &pending_nr, &pending_alloc,
+					 *names);
+	} else {
+		sqlite3_stmt *stmt = stmts[STMT_LIST_REPOSITORIES];
+		sqlite3_reset(stmt);
+
+		int rc;
+		while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+			add_pending_sync(
+			    &pending, &pending_nr, &pending_alloc,
+			    (const char *)sqlite3_column_text(stmt, 0));
+		if (rc != SQLITE_DONE)
+			err("failed to list repositories: %s",
+			    sqlite3_errmsg(conn));
+	}
+
+	while (pending_nr) {
+		uint64_t budget =
+		    pending_nr > 1 ? SYNC_TURN_COMMITS : UINT64_MAX;
+		size_t kept = 0;
+
+		dbg("sync pass over %zu repositories", pending_nr);
+		for (size_t i = 0; i < pending_nr; i++) {
+			struct pending_sync *p = &pending[i];
+
+			if (run_sync(p->name, budget, &p->state)) {
+				pending[kept++] = *p;
+				continue;
+			}
+			sync_state_release(&p->state);
+			free(p->name);
+		}
+		pending_nr = kept;
+	}
+
+	free(pending);
 }
 
 void
@@ -1290,24 +5135,498 @@ run_status(const char *name)
 	printf("(branches: %" PRId64 ", tags: %" PRId64 ")\n", branches, tags);
 }
 
+// Time to let further ref updates of a repository arrive after the first
+// one before syncing it, so that a push updating many refs costs one sync.
+#define WATCH_SETTLE_MS 10
+
+#define WATCH_REFS_MASK                                                        \
+	(IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO)
+
+struct watched_repo {
+	char *name;
+	char *gitdir;
+	int64_t due; // monotonic ms of the pending sync, 0 if none
+	struct sync_state state;
+};
+
+// What an inotify watch descriptor refers to.
+struct watch_target {
+	char *path; // NULL once the watch is gone
+	size_t repo;
+	bool gitdir; // the gitdir itself, where only packed-refs matters
+};
+
+static struct watched_repo *watched;
+static size_t watched_nr, watched_alloc;
+
+// Indexed by watch descriptor, which the kernel hands out densely.
+static struct watch_target *watch_targets;
+static size_t watch_targets_nr, watch_targets_alloc;
+
+static volatile sig_atomic_t watch_stop = 0;
+
+static void
+watch_stop_handler(int sig UNUSED)
+{
+	watch_stop = 1;
+}
+
+// Sync r once further updates had WATCH_SETTLE_MS to arrive. Not extended
+// by later events, so a steady stream of updates cannot postpone the sync
+// forever, but brought forward when only a held back snapshot was due.
+static void
+watch_schedule(struct watched_repo *r, int64_t now)
+{
+	if (!r->due || r->due > now + WATCH_SETTLE_MS)
+		r->due = now + WATCH_SETTLE_MS;
+}
+
+static bool
+watch_add(int fd, const char *path, uint32_t mask, size_t repo, bool gitdir)
+{
+	int wd = inotify_add_watch(fd, path, mask | IN_ONLYDIR);
+	if (wd < 0) {
+		// Missing directories are normal: reftable or loose refs
+		// may not be in use, and a new directory can vanish again.
+		if (errno != ENOENT && errno != ENOTDIR)
+			err("cannot watch '%s': %s", path, strerror(errno));
+		return false;
+	}
+
+	ALLOC_GROW(watch_targets, (size_t)wd + 1, watch_targets_alloc);
+	while (watch_targets_nr <= (size_t)wd)
+		watch_targets[watch_targets_nr++].path = NULL;
+
+	struct watch_target *target = &watch_targets[wd];
+	free(target->path);
+	target->path = xstrdup(path);
+	target->repo = repo;
+	target->gitdir = gitdir;
+	return true;
+}
+
+// Loose refs nest arbitrarily deep, so every directory below refs/ gets
+// its own watch.
+static void
+watch_refs_dir(int fd, struct strbuf *path, size_t repo)
+{
+	if (!watch_add(fd, path->buf, WATCH_REFS_MASK, repo, false))
+		return;
+
+	DIR *dir = opendir(path->buf);
+	if (!dir)
+		return;
+
+	size_t len = path->len;
+	struct dirent *de;
+	while ((de = readdir(dir)) != NULL) {
+		if (is_dot_or_dotdot(de->d_name))
+			continue;
+		if (DTYPE(de) != DT_DIR && DTYPE(de) != DT_UNKNOWN)
+			continue;
+		strbuf_addf(path, "/%s", de->d_name);
+		watch_refs_dir(fd, path, repo);
+		strbuf_setlen(path, len);
+	}
+	closedir(dir);
+}
+
+static void
+watch_repository(int fd, size_t repo)
+{
+	const char *gitdir = watched[repo].gitdir;
+	struct strbuf path = STRBUF_INIT;
+
+	// packed-refs is replaced by renaming its lock file over it.
+	watch_add(fd, gitdir, IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE, repo,
+		  true);
+
+	strbuf_addf(&path, "%s/refs", gitdir);
+	watch_refs_dir(fd, &path, repo);
+
+	strbuf_reset(&path);
+	strbuf_addf(&path, "%s/reftable", gitdir);
+	watch_refs_dir(fd, &path, repo);
+
+	strbuf_release(&path);
+}
+
+static void
+watch_event(int fd, const struct inotify_event *ev, int64_t now)
+{
+	if (ev->mask & IN_Q_OVERFLOW) {
+		// Events were lost; any repository may have changed.
+		for (size_t i = 0; i < watched_nr; i++)
+			watch_schedule(&watched[i], now);
+		return;
+	}
+
+	if (ev->wd < 0 || (size_t)ev->wd >= watch_targets_nr)
+		return;
+
+	struct watch_target *target = &watch_targets[ev->wd];
+	if (!target->path)
+		return;
+	if (ev->mask & IN_IGNORED) {
+		FREE_AND_NULL(target->path);
+		return;
+	}
+
+	const char *name = ev->len ? ev->name : "";
+	size_t repo = target->repo;
+
+	if (target->gitdir) {
+		if (strcmp(name, "packed-refs"))
+			return;
+	} else {
+		// Lock files come and go around every ref update; only the
+		// rename that publishes the new value counts.
+		if (ends_with(name, ".lock"))
+			return;
+
+		// A new directory of loose refs may already hold refs by
+		// the time it is watched; the sync below picks them up.
+		if ((ev->mask & IN_ISDIR) &&
+		    (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+			struct strbuf path = STRBUF_INIT;
+
+			strbuf_addf(&path, "%s/%s", target->path, name);
+			watch_refs_dir(fd, &path, repo);
+			strbuf_release(&path);
+		}
+	}
+
+	watch_schedule(&watched[repo], now);
+}
+
+// Sync every repository whose settle time has passed and return how long
+// poll() may sleep until the next one is due, -1 if none is pending.
+static int
+watch_sync_due(void)
+{
+	int64_t now = monotonic_ms();
+	int64_t next = -1;
+	size_t nr_due = 0;
+
+	for (size_t i = 0; i < watched_nr; i++)
+		if (watched[i].due && watched[i].due <= now)
+			nr_due++;
+
+	// Repositories due together take turns, like a batch sync.
+	uint64_t budget = nr_due > 1 ? SYNC_TURN_COMMITS : UINT64_MAX;
+
+	for (size_t i = 0; i < watched_nr && !watch_stop; i++) {
+		struct watched_repo *r = &watched[i];
+
+		if (!r->due)
+			continue;
+		if (r->due <= now) {
+			// Cleared first: updates landing during the sync
+			// schedule another one.
+			r->due = 0;
+			if (run_sync(r->name, budget, &r->state))
+				r->due = 1;
+			// A sync that finds nothing new writes the snapshot
+			// the rate limit held back.
+			else if (r->state.snapshot_stale)
+				r->due = r->state.snapshot_at +
+					 SNAPSHOT_INTERVAL_MS;
+			if (!r->due)
+				continue;
+		}
+		if (next < 0 || r->due < next)
+			next = r->due;
+	}
+
+	if (next < 0)
+		return -1;
+	now = monotonic_ms();
+	return next > now ? (int)(next - now) : 0;
+}
+
+// Keep the database, its prepared statements and the path cache open, and
+// each repository with the commits known in it, and sync each repository
+// whenever its refs change.
+void
+run_watch(void)
+{
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		err("cannot initialize inotify: %s", strerror(errno));
+		return;
+	}
+
+	sqlite3_stmt *stmt = stmts[STMT_LIST_REPOSITORIES];
+	sqlite3_reset(stmt);
+
+	int rc;
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		ALLOC_GROW(watched, watched_nr + 1, watched_alloc);
+		struct watched_repo *r = &watched[watched_nr++];
+		r->name = xstrdup((const char *)sqlite3_column_text(stmt, 0));
+		r->gitdir = xstrdup((const char *)sqlite3_column_text(stmt, 1));
+		memset(&r->state, 0, sizeof(r->state));
+		strbuf_init(&r->state.bitmap_refs, 0);
+		// Catch up on whatever changed while nobody was watching.
+		r->due = 1;
+	}
+	if (rc != SQLITE_DONE)
+		err("failed to list repositories: %s", sqlite3_errmsg(conn));
+
+	// Watch before the first sync so no update falls in between.
+	for (size_t i = 0; i < watched_nr; i++)
+		watch_repository(fd, i);
+
+	dbg("watching %zu repositories", watched_nr);
+
+	// No SA_RESTART: a signal has to interrupt poll().
+	struct sigaction sa = {.sa_handler = watch_stop_handler};
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	char buf[4096]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	while (!watch_stop) {
+		int timeout = watch_sync_due();
+		if (watch_stop)
+			break;
+
+		if (poll(&pfd, 1, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			err("poll failed: %s", strerror(errno));
+			break;
+		}
+
+		ssize_t len;
+		while ((len = read(fd, buf, sizeof(buf))) > 0) {
+			int64_t now = monotonic_ms();
+			for (char *p = buf; p < buf + len;) {
+				const struct inotify_event *ev = (void *)p;
+				watch_event(fd, ev, now);
+				p += sizeof(*ev) + ev->len;
+			}
+		}
+		if (len < 0 && errno != EAGAIN && errno != EINTR) {
+			err("cannot read inotify events: %s", strerror(errno));
+			break;
+		}
+	}
+
+	// Write the snapshots the rate limit still holds back.
+	for (size_t i = 0; i < watched_nr; i++) {
+		struct watched_repo *r = &watched[i];
+
+		if (r->state.snapshot_stale) {
+			r->state.snapshot_at = 0;
+			run_sync(r->name, UINT64_MAX, &r->state);
+		}
+	}
+
+	dbg("stopped watching");
+
+	close(fd);
+	for (size_t i = 0; i < watch_targets_nr; i++)
+		free(watch_targets[i].path);
+	FREE_AND_NULL(watch_targets);
+	watch_targets_nr = watch_targets_alloc = 0;
+	for (size_t i = 0; i < watched_nr; i++) {
+		free(watched[i].name);
+		free(watched[i].gitdir);
+		sync_state_release(&watched[i].state);
+	}
+	FREE_AND_NULL(watched);
+	watched_nr = watched_alloc = 0;
+}
+
+static int
+print_commit(const struct bushi_commit *commit, void *data UNUSED)
+{
+	for (size_t i = 0; i < commit->hash_len; i++)
+		printf("%02x", commit->hash[i]);
+	putchar('\n');
+	return 0;
+}
+
+// With -L, the commit, its author date in UTC, its author and its subject,
+// separated by tabs, as the history query read them from the index.
+static int
+print_commit_long(const struct bushi_commit *commit, void *data UNUSED)
+{
+	time_t t = commit->author_time;
+	char date[32] = "";
+	struct tm tm;
+
+	if (gmtime_r(&t, &tm))
+		strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+	for (size_t i = 0; i < commit->hash_len; i++)
+		printf("%02x", commit->hash[i]);
+	if (commit->author_name)
+		printf("\t%s\t%s <%s>", date, commit->author_name,
+		       commit->author_email);
+	else
+		printf("\t%s\t", date);
+	printf("\t%s\n", commit->subject ? commit->subject : "");
+	return 0;
+}
+
+// Like git ls-tree, the commit comes first and the name after a tab.
+static int
+print_entry(const char *name, const unsigned char *hash, size_t hash_len,
+	    void *data UNUSED)
+{
+	for (size_t i = 0; i < hash_len; i++)
+		printf("%02x", hash[i]);
+	printf("\t%s\n", name);
+	return 0;
+}
+
+// Answer from the snapshot a sync with -S wrote, as a query server would.
+static int
+run_snapshot_query(const char *name, const char *ref, const char *path,
+		   uint64_t limit)
+{
+	struct bushi_snapshot *s;
+	char *file = xstrfmt("%s/%s.snap", snapshot_dir, name);
+
+	int rc = bushi_snapshot_open(file, &s);
+	if (!rc)
+		rc = bushi_snapshot_history(s, ref, path, limit,
+					    print_commit, NULL);
+	if (rc)
+		err("%s", bushi_snapshot_errmsg(s));
+
+	bushi_snapshot_close(s);
+	free(file);
+	return rc ? 1 : 0;
+}
+
+// Print a page and where the next one starts, unless it was the last.
+static int
+run_page_query(struct bushi_query *q, const char *name, const char *ref,
+	       const char *path, const char *cursor, uint64_t limit,
+	       bushi_commit_fn fn, void *data)
+{
+	char next[BUSHI_QUERY_CURSOR_SIZE];
+
+	if (!strcmp(cursor, "-"))
+		cursor = NULL;
+	int rc = bushi_query_history_page(q, name, ref, path, cursor, limit,
+					  fn, data, next);
+	if (!rc && *next)
+		fprintf(stderr, "cursor: %s\n", next);
+	return rc;
+}
+
+// Parse "SINCE..UNTIL" for -T, either side empty for no bound.
+static bool
+parse_time_range(const char *arg, struct bushi_query_range *range)
+{
+	const char *dots = strstr(arg, "..");
+	char *end;
+
+	if (!dots)
+		return false;
+	errno = 0;
+	range->has_since = dots != arg;
+	if (range->has_since) {
+		range->since = strtoimax(arg, &end, 10);
+		if (end != dots || errno)
+			return false;
+	}
+	range->has_until = dots[2] != '\0';
+	if (range->has_until) {
+		range->until = strtoimax(dots + 2, &end, 10);
+		if (*end || errno)
+			return false;
+	}
+	return !range->has_since || !range->has_until ||
+	       range->since <= range->until;
+}
+
+// Several paths print one history, merged as the library reads them.
+int
+run_query(const char *database, const char *name, const char *ref,
+	  const char *const *paths, size_t nr_paths, uint64_t limit,
+	  bool entries, bool follow, const char *cursor, bool long_format,
+	  const struct bushi_query_range *range)
+{
+	const char *path = nr_paths ? paths[0] : NULL;
+	struct bushi_query *q;
+
+	if (snapshot_dir)
+		return run_snapshot_query(name, ref, path, limit);
+
+	int rc = bushi_query_open(database, &q);
+
+	bushi_commit_fn fn = long_format ? print_commit_long : print_commit;
+
+	if (!rc && entries)
+		rc = bushi_query_entries(q, name, ref, path, limit,
+					 print_entry, NULL);
+	else if (!rc && follow)
+		rc = bushi_query_follow(q, name, ref, path, limit, fn, NULL);
+	else if (!rc && cursor)
+		rc = run_page_query(q, name, ref, path, cursor, limit, fn, NULL);
+	else if (!rc && range)
+		rc = bushi_query_history_range(q, name, ref, path, range,
+					       limit, fn, NULL);
+	else if (!rc && nr_paths > 1)
+		rc = bushi_query_history_paths(q, name, ref, paths, nr_paths,
+					       limit, fn, NULL);
+	else if (!rc)
+		rc = bushi_query_history(q, name, ref, path, limit, fn, NULL);
+	if (rc)
+		err("%s", bushi_query_errmsg(q));
+
+	bushi_query_close(q);
+	return rc ? 1 : 0;
+}
+
 int
 main(int argc, char *const argv[])
 {
 	const char *path = NULL;
 	const char *name = NULL;
 	const char *database = NULL;
+	const char *ref = NULL;
+	const char *const *query_paths = NULL;
+	size_t nr_query_paths = 0;
+	uint64_t limit = UINT64_MAX;
 	int i = 0;
 	enum Mode mode = MODE_SYNC;
-
-	while ((i = getopt(argc, argv, "a:t:cfsrldhv")) != -1) {
+	bool all = false;
+	bool entries = false;
+	bool follow = false;
+	bool long_format = false;
+	const char *cursor = NULL;
+	struct bushi_query_range range = {0};
+	bool ranged = false;
+
+	while ((i = getopt(argc, argv, "a:At:j:b:n:S:P:T:cfsrlwqeFLdhv")) !=
+	       -1) {
 		switch (i) {
 		case 'a':
 			path = optarg;
 			mode = MODE_ADD;
 			break;
+		case 'A':
+			all = true;
+			break;
 		case 't':
 			database = optarg;
 			break;
+		case 'j':
+			num_workers = atoi(optarg);
+			if (num_workers <= 0) {
+				err("-j requires a positive number");
+				return 1;
+			}
+			break;
 		case 'c':
 			mode = MODE_CHECK;
 			break;
@@ -1323,6 +5642,49 @@ main(int argc, char *const argv[])
 		case 'l':
 			mode = MODE_LIST;
 			break;
+		case 'w':
+			mode = MODE_WATCH;
+			break;
+		case 'q':
+			mode = MODE_QUERY;
+			break;
+		case 'e':
+			entries = true;
+			break;
+		case 'F':
+			follow = true;
+			break;
+		case 'L':
+			long_format = true;
+			break;
+		case 'P':
+			cursor = optarg;
+			break;
+		case 'b':
+			ref = optarg;
+			break;
+		case 'T':
+			if (!parse_time_range(optarg, &range)) {
+				err("-T requires SINCE..UNTIL in seconds, "
+				    "SINCE at most UNTIL");
+				return 1;
+			}
+			ranged = true;
+			break;
+		case 'n': {
+			char *end;
+
+			errno = 0;
+			limit = strtoumax(optarg, &end, 10);
+			if (!isdigit(*optarg) || *end || errno) {
+				err("-n requires a non-negative number");
+				return 1;
+			}
+			break;
+		}
+		case 'S':
+			snapshot_dir = optarg;
+			break;
 		case 'd':
 			debug = true;
 			break;
@@ -1339,10 +5701,59 @@ main(int argc, char *const argv[])
 		}
 	}
 
+	if (all && mode != MODE_SYNC) {
+		err("-A only applies to sync");
+		return 1;
+	}
+	if ((ref || limit != UINT64_MAX || entries || follow || cursor ||
+	     long_format || ranged) &&
+	    mode != MODE_QUERY) {
+		err("-e, -F, -L, -P, -T, -b and -n only apply to -q");
+		return 1;
+	}
+
+	// A ref range reads like git's: A..B leaves out what A has, and an
+	// empty B is the default branch. Ref names cannot contain "..".
+	const char *dots = ref ? strstr(ref, "..") : NULL;
+	char *exclude = NULL;
+	if (dots) {
+		if (dots == ref) {
+			err("-b A..B requires A");
+			return 1;
+		}
+		exclude = xstrndup(ref, dots - ref);
+		range.exclude = exclude;
+		ref = dots[2] ? dots + 2 : NULL;
+		ranged = true;
+	}
+	if (ranged && (entries || follow || cursor)) {
+		err("-e, -F and -P do not take ranges");
+		return 1;
+	}
+	if (entries + follow + !!cursor > 1) {
+		err("-e, -F and -P cannot be combined");
+		return 1;
+	}
+	if (entries && long_format) {
+		err("-L only applies to histories");
+		return 1;
+	}
+	if (snapshot_dir && mode != MODE_SYNC && mode != MODE_WATCH &&
+	    mode != MODE_QUERY) {
+		err("-S only applies to sync, -w and -q");
+		return 1;
+	}
+	if (snapshot_dir &&
+	    (entries || follow || cursor || long_format || ranged)) {
+		err("snapshots only answer plain history queries");
+		return 1;
+	}
+
 	if (database == NULL) {
 		database = getenv("BUSHI_DATABASE");
 	}
-	if (database == NULL) {
+	// A snapshot holds everything a query reads.
+	if (database == NULL && !(mode == MODE_QUERY && snapshot_dir)) {
 		err("database path not specified");
 		return 1;
 	}
@@ -1356,9 +5767,34 @@ main(int argc, char *const argv[])
 			err("-a does not take NAME");
 			return 1;
 		}
-	} else if (mode == MODE_LIST) {
+	} else if (mode == MODE_SYNC) {
+		// Several repositories are synced in turns; see run_batch().
+		if (all && argv[optind] != NULL) {
+			err("-A does not take NAME");
+			return 1;
+		}
+		if (!all && argv[optind] == NULL) {
+			err("NAME required");
+			return 1;
+		}
+	} else if (mode == MODE_QUERY) {
+		if (argv[optind] == NULL) {
+			err("-q requires NAME");
+			return 1;
+		}
+		name = argv[optind];
+		query_paths = (const char *const *)argv + optind + 1;
+		while (query_paths[nr_query_paths])
+			nr_query_paths++;
+		if (nr_query_paths > 1 &&
+		    (entries || follow || cursor || ranged || snapshot_dir)) {
+			err("-e, -F, -P, -S and ranges take at most one PATH");
+			return 1;
+		}
+	} else if (mode == MODE_LIST || mode == MODE_WATCH) {
 		if (argv[optind] != NULL) {
-			err("-l does not take arguments");
+			err("-%c does not take arguments",
+			    mode == MODE_LIST ? 'l' : 'w');
 			return 1;
 		}
 	} else {
@@ -1369,10 +5805,24 @@ main(int argc, char *const argv[])
 		name = argv[optind];
 	}
 
+	// Queries only read, through the library other programs link.
+	if (mode == MODE_QUERY) {
+		int rc = run_query(database, name, ref, query_paths,
+				   nr_query_paths, limit, entries, follow,
+				   cursor, long_format, ranged ? &range : NULL);
+		free(exclude);
+		return rc;
+	}
+
 	conn = db_open(database);
 	if (!conn)
 		return 1;
 
+	// Path records are shared by all repositories and never deleted, so
+	// the cache stays valid for every sync this process runs.
+	hashmap_init(&path_map, path_entry_cmp, NULL, 0);
+	strintmap_init(&author_map, 0);
+
 	switch (mode) {
 	case MODE_LIST:
 		run_list();
@@ -1384,13 +5834,18 @@ main(int argc, char *const argv[])
 		run_status(name);
 		break;
 	case MODE_SYNC:
-		run_sync(name);
+		run_batch(all ? NULL : (const char *const *)argv + optind);
+		break;
+	case MODE_WATCH:
+		run_watch();
 		break;
 	default:
 		err("mode not implemented yet");
 		break;
 	}
 
+	hashmap_clear_and_free(&path_map, struct path_entry, ent);
+	strintmap_clear(&author_map);
 	db_close();
 	return 0;
 }
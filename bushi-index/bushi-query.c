@@ -0,0 +1,2046 @@
+#include <inttypes.h>
+#include <sqlite3.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bushi-hex.h"
+#include "bushi-query.h"
+
+#define SQL(...) #__VA_ARGS__
+
+// how long a query waits for a sync to commit before giving up
+#define QUERY_BUSY_TIMEOUT_MS 5000
+
+// commits whose links are cached before the cache starts over, 32 bytes
+// each at twice the slots
+#define LINK_CACHE_MAX (1u << 20)
+
+// bytes of history results a handle keeps unless told otherwise
+#define RESULT_CACHE_BYTES (16u << 20)
+
+enum {
+	STMT_GET_REPOSITORY,
+	STMT_GET_REF,
+	STMT_GET_COMMIT_BY_HASH,
+	STMT_GET_COMMIT_REPOSITORY,
+	STMT_GET_LINKS,
+	STMT_GET_PATH_ID,
+	STMT_TIP_PATH,
+	STMT_PATH_CANDIDATES,
+	STMT_FIRST_PARENT_HISTORY,
+	STMT_FIRST_PARENT_RANGE_HISTORY,
+	STMT_PATH_HISTORY,
+	STMT_PATH_RANGE_HISTORY,
+	STMT_FOLLOW_HISTORY,
+	STMT_LAST_CHANGE,
+	STMT_TIP_ENTRIES,
+	STMT_CHILDREN,
+	STMT_ENTRY_HASH,
+	STMT_GET_COMMIT,
+	STMT_DATA_VERSION,
+	STMT_COUNT,
+};
+
+// clang-format off
+static const char *texts[STMT_COUNT] = {
+	[STMT_GET_REPOSITORY] = SQL(
+		SELECT repository_id
+		     , repository_head
+		  FROM repositories
+		 WHERE repository_name = ?1;
+	),
+	// A full ref name wins; otherwise tags come before branches, as
+	// they do when git resolves a short name.
+	[STMT_GET_REF] = SQL(
+		SELECT commit_id
+		     , full_name
+		  FROM refs
+		 WHERE repository_id = ?1
+		   AND commit_id IS NOT NULL
+		   AND full_name IN (?2
+				   , 'refs/tags/' || ?2
+				   , 'refs/heads/' || ?2)
+		 ORDER BY full_name = ?2 DESC
+		     , ref_type DESC
+		 LIMIT 1;
+	),
+	// Hashes that start with a prefix, as a range of blobs.
+	[STMT_GET_COMMIT_BY_HASH] = SQL(
+		SELECT commit_id
+		  FROM commits
+		 WHERE repository_id = ?1
+		   AND commit_hash >= ?2
+		   AND commit_hash < ?3
+		 LIMIT 2;
+	),
+	[STMT_GET_COMMIT_REPOSITORY] = SQL(
+		SELECT repository_id
+		  FROM commits
+		 WHERE commit_id = ?1;
+	),
+	[STMT_GET_LINKS] = SQL(
+		SELECT first_depth
+		     , parent_id
+		     , jump_id
+		     , chain_time
+		  FROM commits
+		 WHERE commit_id = ?1;
+	),
+	[STMT_GET_PATH_ID] = SQL(
+		SELECT path_id
+		  FROM paths
+		 WHERE parent_path_id = ?1
+		   AND basename = ?2;
+	),
+	// The tip the start points were computed for sorts first, as path 0,
+	// and a row of the branch itself before one it shares.
+	[STMT_TIP_PATH] = SQL(
+		SELECT path_id
+		     , commit_id
+		     , 0
+		  FROM tip_paths
+		 WHERE repository_id = ?1
+		   AND full_name = ?2
+		   AND path_id IN (0, ?3)
+
+		UNION ALL
+
+		SELECT tp.path_id
+		     , tp.commit_id
+		     , 1
+		  FROM tip_bases AS b
+		  JOIN tip_paths AS tp
+		    ON tp.repository_id = b.repository_id
+		   AND tp.full_name = b.base_name
+		   AND tp.path_id = ?3
+		  JOIN commits AS c
+		    ON c.commit_id = tp.commit_id
+		 WHERE b.repository_id = ?1
+		   AND b.full_name = ?2
+		   AND tp.path_id != 0
+		   AND c.first_depth <= b.base_depth
+		 ORDER BY 1, 3;
+	),
+	[STMT_PATH_CANDIDATES] = SQL(
+		SELECT cg.commit_id
+		     , c.first_depth
+		  FROM changes AS cg
+		  JOIN commits AS c
+		    ON c.commit_id = cg.commit_id
+		 WHERE cg.path_id = ?1
+		   AND c.repository_id = ?2
+		   AND c.first_depth <= ?3
+		 ORDER BY c.first_depth DESC;
+	),
+	// ORDER BY and LIMIT sit inside the recursive CTE so that SQLite
+	// stops the recursion once enough rows are produced, while still
+	// producing them in seq order.
+	[STMT_FIRST_PARENT_HISTORY] = SQL(
+		WITH RECURSIVE history(commit_id, seq) AS (
+			SELECT ?1, 0
+
+			UNION ALL
+
+			SELECT c.parent_id
+			     , h.seq + 1
+			  FROM history AS h
+			  JOIN commits AS c
+			    ON c.commit_id = h.commit_id
+			 WHERE c.parent_id IS NOT NULL
+			 ORDER BY 2
+			 LIMIT ?2
+		)
+		SELECT c.commit_hash
+		     , h.commit_id
+		     , c.author_time
+		     , a.name
+		     , a.email
+		     , c.commit_time
+		     , c.subject
+		  FROM history AS h
+		  JOIN commits AS c
+		    ON c.commit_id = h.commit_id
+		  LEFT JOIN authors AS a
+		    ON a.author_id = c.author_id;
+	),
+	// As STMT_FIRST_PARENT_HISTORY for the ?2 commits from ?1 down, and
+	// only those with commit times from ?4 to ?5, at most ?3 of them.
+	[STMT_FIRST_PARENT_RANGE_HISTORY] = SQL(
+		WITH RECURSIVE history(commit_id, seq) AS (
+			SELECT ?1, 0
+
+			UNION ALL
+
+			SELECT c.parent_id
+			     , h.seq + 1
+			  FROM history AS h
+			  JOIN commits AS c
+			    ON c.commit_id = h.commit_id
+			 WHERE c.parent_id IS NOT NULL
+			 ORDER BY 2
+			 LIMIT ?2
+		)
+		SELECT c.commit_hash
+		     , h.commit_id
+		     , c.author_time
+		     , a.name
+		     , a.email
+		     , c.commit_time
+		     , c.subject
+		  FROM history AS h
+		  JOIN commits AS c
+		    ON c.commit_id = h.commit_id
+		  LEFT JOIN authors AS a
+		    ON a.author_id = c.author_id
+		 WHERE c.commit_time >= ?4
+		   AND c.commit_time <= ?5
+		 LIMIT ?3;
+	),
+	[STMT_PATH_HISTORY] = SQL(
+		WITH RECURSIVE history(commit_id, seq) AS (
+			SELECT ?1, 0
+
+			UNION ALL
+
+			SELECT cg.last_commit_id
+			     , h.seq + 1
+			  FROM history AS h
+			  JOIN changes AS cg
+			    ON cg.commit_id = h.commit_id
+			   AND cg.path_id = ?2
+			 WHERE cg.last_commit_id != h.commit_id
+			 ORDER BY 2
+			 LIMIT ?3
+		)
+		SELECT c.commit_hash
+		     , h.commit_id
+		     , c.author_time
+		     , a.name
+		     , a.email
+		     , c.commit_time
+		     , c.subject
+		  FROM history AS h
+		  JOIN commits AS c
+		    ON c.commit_id = h.commit_id
+		  LEFT JOIN authors AS a
+		    ON a.author_id = c.author_id;
+	),
+	// As STMT_PATH_HISTORY, down to the commits at depth ?4 and below,
+	// and only those with commit times from ?5 to ?6. SQLite stops the
+	// recursion once the outer LIMIT has its rows.
+	[STMT_PATH_RANGE_HISTORY] = SQL(
+		WITH RECURSIVE history(commit_id, seq) AS (
+			SELECT ?1, 0
+
+			UNION ALL
+
+			SELECT cg.last_commit_id
+			     , h.seq + 1
+			  FROM history AS h
+			  JOIN changes AS cg
+			    ON cg.commit_id = h.commit_id
+			   AND cg.path_id = ?2
+			  JOIN commits AS l
+			    ON l.commit_id = cg.last_commit_id
+			 WHERE cg.last_commit_id != h.commit_id
+			   AND l.first_depth > ?4
+			 ORDER BY 2
+		)
+		SELECT c.commit_hash
+		     , h.commit_id
+		     , c.author_time
+		     , a.name
+		     , a.email
+		     , c.commit_time
+		     , c.subject
+		  FROM history AS h
+		  JOIN commits AS c
+		    ON c.commit_id = h.commit_id
+		  LEFT JOIN authors AS a
+		    ON a.author_id = c.author_id
+		 WHERE c.commit_time >= ?5
+		   AND c.commit_time <= ?6
+		 LIMIT ?3;
+	),
+	// As STMT_PATH_HISTORY, and where the path was renamed from.
+	[STMT_FOLLOW_HISTORY] = SQL(
+		WITH RECURSIVE history(commit_id, seq) AS (
+			SELECT ?1, 0
+
+			UNION ALL
+
+			SELECT cg.last_commit_id
+			     , h.seq + 1
+			  FROM history AS h
+			  JOIN changes AS cg
+			    ON cg.commit_id = h.commit_id
+			   AND cg.path_id = ?2
+			 WHERE cg.last_commit_id != h.commit_id
+			 ORDER BY 2
+			 LIMIT ?3
+		)
+		SELECT c.commit_hash
+		     , h.commit_id
+		     , c.author_time
+		     , a.name
+		     , a.email
+		     , c.commit_time
+		     , c.subject
+		     , r.old_path_id
+		  FROM history AS h
+		  JOIN commits AS c
+		    ON c.commit_id = h.commit_id
+		  LEFT JOIN authors AS a
+		    ON a.author_id = c.author_id
+		  LEFT JOIN renames AS r
+		    ON r.commit_id = h.commit_id
+		   AND r.path_id = ?2;
+	),
+	[STMT_LAST_CHANGE] = SQL(
+		SELECT last_commit_id
+		  FROM changes
+		 WHERE commit_id = ?1
+		   AND path_id = ?2;
+	),
+	// Rows of the branch itself, and those it shares that it has no row
+	// of its own for; a path the row's commit removed is no entry.
+	[STMT_TIP_ENTRIES] = SQL(
+		WITH entries(path_id, commit_id, deleted) AS (
+			SELECT path_id
+			     , commit_id
+			     , deleted
+			  FROM tip_paths
+			 WHERE repository_id = ?1
+			   AND full_name = ?2
+			   AND parent_path_id = ?3
+
+			UNION ALL
+
+			SELECT tp.path_id
+			     , tp.commit_id
+			     , tp.deleted
+			  FROM tip_bases AS b
+			  JOIN tip_paths AS tp
+			    ON tp.repository_id = b.repository_id
+			   AND tp.full_name = b.base_name
+			   AND tp.parent_path_id = ?3
+			  JOIN commits AS c
+			    ON c.commit_id = tp.commit_id
+			 WHERE b.repository_id = ?1
+			   AND b.full_name = ?2
+			   AND c.first_depth <= b.base_depth
+			   AND NOT EXISTS (
+				SELECT 1
+				  FROM tip_paths AS o
+				 WHERE o.repository_id = ?1
+				   AND o.full_name = ?2
+				   AND o.path_id = tp.path_id
+			       )
+		)
+		SELECT p.basename
+		     , c.commit_hash
+		  FROM entries AS e
+		  JOIN paths AS p
+		    ON p.path_id = e.path_id
+		  JOIN commits AS c
+		    ON c.commit_id = e.commit_id
+		 WHERE NOT e.deleted
+		 ORDER BY p.basename
+		 LIMIT ?4;
+	),
+	// Path records are shared by all repositories; only those some
+	// commit of this one changed are searched.
+	[STMT_CHILDREN] = SQL(
+		SELECT p.path_id
+		     , p.basename
+		  FROM paths AS p
+		 WHERE p.parent_path_id = ?1
+		   AND EXISTS (
+			SELECT 1
+			  FROM changes AS cg
+			  JOIN commits AS c
+			    ON c.commit_id = cg.commit_id
+			 WHERE cg.path_id = p.path_id
+			   AND c.repository_id = ?2
+		       )
+		 ORDER BY p.basename;
+	),
+	// No row when the commit removed the path.
+	[STMT_ENTRY_HASH] = SQL(
+		SELECT commit_hash
+		  FROM commits
+		 WHERE commit_id = ?1
+		   AND NOT EXISTS (
+			SELECT 1
+			  FROM deletions
+			 WHERE commit_id = ?1
+			   AND path_id = ?2
+		       );
+	),
+	// A commit with what a history shows of it, in the columns every
+	// history query reads it from; see row_commit().
+	[STMT_GET_COMMIT] = SQL(
+		SELECT c.commit_hash
+		     , c.commit_id
+		     , c.author_time
+		     , a.name
+		     , a.email
+		     , c.commit_time
+		     , c.subject
+		  FROM commits AS c
+		  LEFT JOIN authors AS a
+		    ON a.author_id = c.author_id
+		 WHERE c.commit_id = ?1;
+	),
+	// Changes whenever another connection, such as a sync, commits.
+	[STMT_DATA_VERSION] = SQL(
+		PRAGMA data_version;
+	),
+};
+// clang-format on
+
+// First-parent links of a commit. Backfill writes them once and commit ids
+// are never reused, so a cached entry stays valid across syncs.
+struct commit_links {
+	int64_t commit_id; // 0 marks a free slot
+	int64_t depth;
+	int64_t parent_id;
+	int64_t jump_id;
+	int64_t time; // chain_time
+};
+
+struct link_cache {
+	struct commit_links *slots;
+	size_t mask;
+	size_t nr;
+};
+
+// History of a path from a start commit, as nr commits packed into size
+// bytes by cached_commit_write(). Like links, it never changes once
+// backfill wrote the rows: a moved ref resolves to another start commit,
+// and so to another entry.
+struct cached_history {
+	int64_t start_id;
+	int64_t path_id; // 0 for the whole first-parent chain
+	struct cached_history *next; // in the same bucket
+	struct cached_history *newer, *older;
+	size_t nr;
+	size_t size;
+	bool complete; // false when more commits follow the nr kept
+	unsigned char commits[];
+};
+
+struct result_cache {
+	struct cached_history **buckets;
+	size_t mask;
+	size_t nr;
+	struct cached_history *newest, *oldest;
+	size_t bytes;
+	size_t budget;
+	int64_t data_version; // of the database the entries were read from
+
+	// The rows of the query being streamed, while they fit the budget.
+	unsigned char *scratch;
+	size_t scratch_nr, scratch_alloc;
+
+	struct bushi_query_cache_stats stats;
+};
+
+struct bushi_query {
+	sqlite3 *db;
+	sqlite3_stmt *stmts[STMT_COUNT];
+	struct link_cache links;
+	struct result_cache results;
+	char errmsg[256];
+};
+
+static int
+fail(struct bushi_query *q, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(q->errmsg, sizeof(q->errmsg), fmt, ap);
+	va_end(ap);
+	return -1;
+}
+
+static struct commit_links *
+link_cache_slot(const struct link_cache *c, int64_t commit_id)
+{
+	size_t i = (size_t)(((uint64_t)commit_id * 0x9e3779b97f4a7c15ull) >>
+			    32) &
+		   c->mask;
+
+	while (c->slots[i].commit_id && c->slots[i].commit_id != commit_id)
+		i = (i + 1) & c->mask;
+	return &c->slots[i];
+}
+
+// Make room for one more entry, keeping the table at most half full.
+static bool
+link_cache_reserve(struct link_cache *c)
+{
+	size_t size = c->slots ? c->mask + 1 : 0;
+
+	if (2 * (c->nr + 1) <= size)
+		return true;
+
+	// A long-lived handle would otherwise end up holding every commit
+	// it ever saw.
+	if (c->nr >= LINK_CACHE_MAX) {
+		memset(c->slots, 0, size * sizeof(*c->slots));
+		c->nr = 0;
+		return true;
+	}
+
+	struct link_cache grown;
+	size_t grown_size = size ? 2 * size : 1024;
+	grown.slots = calloc(grown_size, sizeof(*grown.slots));
+	if (!grown.slots)
+		return false;
+	grown.mask = grown_size - 1;
+	grown.nr = c->nr;
+
+	for (size_t i = 0; i < size; i++)
+		if (c->slots[i].commit_id)
+			*link_cache_slot(&grown, c->slots[i].commit_id) =
+			    c->slots[i];
+
+	free(c->slots);
+	*c = grown;
+	return true;
+}
+
+static int
+get_links(struct bushi_query *q, int64_t commit_id,
+	  struct commit_links *links)
+{
+	struct commit_links *slot;
+
+	if (q->links.slots) {
+		slot = link_cache_slot(&q->links, commit_id);
+		if (slot->commit_id) {
+			*links = *slot;
+			return 0;
+		}
+	}
+
+	sqlite3_stmt *stmt = q->stmts[STMT_GET_LINKS];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, commit_id);
+
+	int rc = sqlite3_step(stmt);
+	if (rc != SQLITE_ROW || sqlite3_column_type(stmt, 0) == SQLITE_NULL) {
+		if (rc == SQLITE_ROW)
+			fail(q, "commit %lld is not backfilled",
+			     (long long)commit_id);
+		else if (rc == SQLITE_DONE)
+			fail(q, "commit %lld not found", (long long)commit_id);
+		else
+			fail(q, "cannot read commit %lld: %s",
+			     (long long)commit_id, sqlite3_errmsg(q->db));
+		sqlite3_reset(stmt);
+		return -1;
+	}
+
+	links->commit_id = commit_id;
+	links->depth = sqlite3_column_int64(stmt, 0);
+	links->parent_id = sqlite3_column_int64(stmt, 1);
+	links->jump_id = sqlite3_column_int64(stmt, 2);
+	links->time = sqlite3_column_int64(stmt, 3);
+	sqlite3_reset(stmt);
+
+	// Without memory the query still works, only slower.
+	if (link_cache_reserve(&q->links)) {
+		slot = link_cache_slot(&q->links, commit_id);
+		*slot = *links;
+		q->links.nr++;
+	}
+	return 0;
+}
+
+static struct cached_history **
+result_cache_bucket(const struct result_cache *c, int64_t start_id,
+		    int64_t path_id)
+{
+	uint64_t key = (uint64_t)start_id * 0x9e3779b97f4a7c15ull ^
+		       (uint64_t)path_id * 0xc2b2ae3d27d4eb4full;
+
+	return &c->buckets[(size_t)(key >> 32) & c->mask];
+}
+
+static struct cached_history *
+result_cache_find(const struct result_cache *c, int64_t start_id,
+		  int64_t path_id)
+{
+	struct cached_history *e = NULL;
+
+	if (c->buckets)
+		e = *result_cache_bucket(c, start_id, path_id);
+	while (e && (e->start_id != start_id || e->path_id != path_id))
+		e = e->next;
+	return e;
+}
+
+static size_t
+cached_history_size(const struct cached_history *e)
+{
+	return sizeof(*e) + e->size;
+}
+
+enum {
+	CACHED_AUTHOR = 1,
+	CACHED_SUBJECT = 2,
+};
+
+// Bytes cached_commit_write() packs commit into: the length of its object
+// id and which strings follow, the id, both times, then the strings, each
+// with its NUL.
+static size_t
+cached_commit_size(const struct bushi_commit *commit)
+{
+	size_t size = 2 + commit->hash_len + 2 * sizeof(int64_t);
+
+	if (commit->author_name)
+		size += strlen(commit->author_name) +
+			strlen(commit->author_email) + 2;
+	if (commit->subject)
+		size += strlen(commit->subject) + 1;
+	return size;
+}
+
+static void
+cached_commit_write(unsigned char *p, const struct bushi_commit *commit)
+{
+	const char *strings[3] = {commit->author_name, commit->author_email,
+				  commit->subject};
+
+	*p++ = commit->hash_len;
+	*p++ = (commit->author_name ? CACHED_AUTHOR : 0) |
+	       (commit->subject ? CACHED_SUBJECT : 0);
+	memcpy(p, commit->hash, commit->hash_len);
+	p += commit->hash_len;
+	memcpy(p, &commit->author_time, sizeof(int64_t));
+	p += sizeof(int64_t);
+	memcpy(p, &commit->commit_time, sizeof(int64_t));
+	p += sizeof(int64_t);
+	for (int i = 0; i < 3; i++) {
+		if (!strings[i])
+			continue;
+		size_t len = strlen(strings[i]) + 1;
+		memcpy(p, strings[i], len);
+		p += len;
+	}
+}
+
+// Unpack the commit at p into commit, pointing into the entry, and return
+// where the next one starts.
+static const unsigned char *
+cached_commit_read(const unsigned char *p, struct bushi_commit *commit)
+{
+	const char **strings[3] = {&commit->author_name,
+				   &commit->author_email, &commit->subject};
+	unsigned flags;
+
+	commit->hash_len = *p++;
+	flags = *p++;
+	commit->hash = p;
+	p += commit->hash_len;
+	memcpy(&commit->author_time, p, sizeof(int64_t));
+	p += sizeof(int64_t);
+	memcpy(&commit->commit_time, p, sizeof(int64_t));
+	p += sizeof(int64_t);
+	for (int i = 0; i < 3; i++) {
+		*strings[i] = NULL;
+		if (!(flags & (i < 2 ? CACHED_AUTHOR : CACHED_SUBJECT)))
+			continue;
+		*strings[i] = (const char *)p;
+		p += strlen(*strings[i]) + 1;
+	}
+	return p;
+}
+
+static void
+result_cache_remove(struct result_cache *c, struct cached_history *e)
+{
+	struct cached_history **p =
+	    result_cache_bucket(c, e->start_id, e->path_id);
+
+	while (*p != e)
+		p = &(*p)->next;
+	*p = e->next;
+
+	if (e->newer)
+		e->newer->older = e->older;
+	else
+		c->newest = e->older;
+	if (e->older)
+		e->older->newer = e->newer;
+	else
+		c->oldest = e->newer;
+
+	c->nr--;
+	c->bytes -= cached_history_size(e);
+	free(e);
+}
+
+static void
+result_cache_push(struct result_cache *c, struct cached_history *e)
+{
+	e->older = c->newest;
+	e->newer = NULL;
+	if (c->newest)
+		c->newest->newer = e;
+	else
+		c->oldest = e;
+	c->newest = e;
+}
+
+// Evict the least recently used entries until the cache fits its budget.
+static void
+result_cache_trim(struct result_cache *c)
+{
+	while (c->oldest && c->bytes > c->budget) {
+		result_cache_remove(c, c->oldest);
+		c->stats.evictions++;
+	}
+}
+
+// A cached history that answers a query for limit commits, or NULL.
+static struct cached_history *
+result_cache_get(struct result_cache *c, int64_t start_id, int64_t path_id,
+		 uint64_t limit)
+{
+	if (!c->budget)
+		return NULL;
+
+	struct cached_history *e = result_cache_find(c, start_id, path_id);
+	if (!e || (!e->complete && e->nr < limit)) {
+		c->stats.misses++;
+		return NULL;
+	}
+
+	c->stats.hits++;
+	if (e != c->newest) {
+		if (e->newer)
+			e->newer->older = e->older;
+		if (e->older)
+			e->older->newer = e->newer;
+		else
+			c->oldest = e->newer;
+		result_cache_push(c, e);
+	}
+	return e;
+}
+
+// Keep one entry per bucket on average.
+static bool
+result_cache_reserve(struct result_cache *c)
+{
+	size_t size = c->buckets ? c->mask + 1 : 0;
+
+	if (c->nr < size)
+		return true;
+
+	struct result_cache grown = *c;
+	size_t grown_size = size ? 2 * size : 256;
+	grown.buckets = calloc(grown_size, sizeof(*grown.buckets));
+	if (!grown.buckets)
+		return false;
+	grown.mask = grown_size - 1;
+
+	for (size_t i = 0; i < size; i++) {
+		struct cached_history *e = c->buckets[i], *next;
+		for (; e; e = next) {
+			struct cached_history **p = result_cache_bucket(
+			    &grown, e->start_id, e->path_id);
+			next = e->next;
+			e->next = *p;
+			*p = e;
+		}
+	}
+
+	free(c->buckets);
+	*c = grown;
+	return true;
+}
+
+// Cache the nr commits in scratch as the history of path_id from
+// start_id, replacing what was kept for it before unless that is longer: a
+// callback that stopped early leaves a shorter prefix. Without memory the
+// query still works, only slower.
+static void
+result_cache_put(struct result_cache *c, int64_t start_id, int64_t path_id,
+		 size_t nr, bool complete)
+{
+	struct cached_history *e = result_cache_find(c, start_id, path_id);
+	size_t size = nr ? c->scratch_nr : 0;
+
+	if (e && (e->complete || (!complete && e->nr >= nr)))
+		return;
+	if (e)
+		result_cache_remove(c, e);
+
+	if (sizeof(*e) + size > c->budget || !result_cache_reserve(c))
+		return;
+	e = malloc(sizeof(*e) + size);
+	if (!e)
+		return;
+
+	e->start_id = start_id;
+	e->path_id = path_id;
+	e->nr = nr;
+	e->size = size;
+	e->complete = complete;
+	if (size)
+		memcpy(e->commits, c->scratch, size);
+
+	struct cached_history **p = result_cache_bucket(c, start_id, path_id);
+	e->next = *p;
+	*p = e;
+	result_cache_push(c, e);
+	c->nr++;
+	c->bytes += cached_history_size(e);
+	result_cache_trim(c);
+}
+
+// Pack one more row into scratch, the first of a query when nr is 0;
+// false once the rows no longer fit the budget.
+static bool
+result_cache_keep(struct result_cache *c, size_t nr,
+		  const struct bushi_commit *commit)
+{
+	size_t len = cached_commit_size(commit);
+
+	if (!nr)
+		c->scratch_nr = 0;
+	if (commit->hash_len > UINT8_MAX ||
+	    sizeof(struct cached_history) + c->scratch_nr + len > c->budget)
+		return false;
+
+	if (c->scratch_nr + len > c->scratch_alloc) {
+		size_t alloc = c->scratch_alloc ? 2 * c->scratch_alloc : 4096;
+		while (alloc < c->scratch_nr + len)
+			alloc *= 2;
+
+		unsigned char *grown = realloc(c->scratch, alloc);
+		if (!grown)
+			return false;
+		c->scratch = grown;
+		c->scratch_alloc = alloc;
+	}
+
+	cached_commit_write(c->scratch + c->scratch_nr, commit);
+	c->scratch_nr += len;
+	return true;
+}
+
+static void
+result_cache_clear(struct result_cache *c)
+{
+	while (c->oldest)
+		result_cache_remove(c, c->oldest);
+	free(c->buckets);
+	free(c->scratch);
+	c->buckets = NULL;
+	c->mask = 0;
+	c->scratch = NULL;
+	c->scratch_nr = c->scratch_alloc = 0;
+}
+
+// Empty the result cache when another connection, such as a sync,
+// committed since it was filled, so no answer outlives the rows it was
+// read from.
+static int
+result_cache_validate(struct bushi_query *q)
+{
+	struct result_cache *c = &q->results;
+	sqlite3_stmt *stmt = q->stmts[STMT_DATA_VERSION];
+
+	if (!c->budget)
+		return 0;
+
+	sqlite3_reset(stmt);
+	if (sqlite3_step(stmt) != SQLITE_ROW) {
+		fail(q, "cannot read data version: %s", sqlite3_errmsg(q->db));
+		sqlite3_reset(stmt);
+		return -1;
+	}
+	int64_t version = sqlite3_column_int64(stmt, 0);
+	sqlite3_reset(stmt);
+
+	if (version != c->data_version) {
+		if (c->nr)
+			c->stats.invalidations++;
+		while (c->oldest)
+			result_cache_remove(c, c->oldest);
+		c->data_version = version;
+	}
+	return 0;
+}
+
+// Move *commit_id down its first-parent chain to the commit at depth.
+// Each step takes the jump pointer unless it would pass that depth.
+static int
+descend(struct bushi_query *q, int64_t *commit_id, int64_t depth)
+{
+	struct commit_links links, jump;
+
+	for (;;) {
+		if (get_links(q, *commit_id, &links))
+			return -1;
+		if (links.depth <= depth)
+			return 0;
+
+		if (get_links(q, links.jump_id, &jump))
+			return -1;
+		*commit_id =
+		    jump.depth >= depth ? links.jump_id : links.parent_id;
+	}
+}
+
+// Nearest commit on the first-parent chain of start_id, itself included,
+// that changed path_id; 0 when there is none. Candidates come deepest
+// first, so each ancestor check resumes from where the previous one left
+// the walk down the chain instead of starting over at start_id.
+static int
+find_path_start(struct bushi_query *q, int64_t repository_id,
+		int64_t path_id, int64_t start_id, int64_t *found)
+{
+	struct commit_links links;
+
+	*found = 0;
+	if (get_links(q, start_id, &links))
+		return -1;
+
+	sqlite3_stmt *stmt = q->stmts[STMT_PATH_CANDIDATES];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, path_id);
+	sqlite3_bind_int64(stmt, 2, repository_id);
+	sqlite3_bind_int64(stmt, 3, links.depth);
+
+	int64_t current = start_id;
+	int rc;
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		int64_t candidate = sqlite3_column_int64(stmt, 0);
+		int64_t depth = sqlite3_column_int64(stmt, 1);
+
+		if (descend(q, &current, depth)) {
+			sqlite3_reset(stmt);
+			return -1;
+		}
+		if (current == candidate) {
+			*found = candidate;
+			break;
+		}
+	}
+
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		fail(q, "cannot scan changes: %s", sqlite3_errmsg(q->db));
+		sqlite3_reset(stmt);
+		return -1;
+	}
+	sqlite3_reset(stmt);
+	return 0;
+}
+
+// Follow the path trie from the root; 0 when any component is missing.
+// Components keep their trailing '/', which marks directories.
+static int
+resolve_path(struct bushi_query *q, const char *path, int64_t *path_id)
+{
+	sqlite3_stmt *stmt = q->stmts[STMT_GET_PATH_ID];
+
+	*path_id = 0;
+	while (*path) {
+		const char *slash = strchr(path, '/');
+		size_t len = slash ? (size_t)(slash - path) + 1 : strlen(path);
+
+		// The root is not a record, so "/" never matches.
+		if (len == 1 && *path == '/') {
+			*path_id = 0;
+			return 0;
+		}
+
+		sqlite3_reset(stmt);
+		sqlite3_bind_int64(stmt, 1, *path_id);
+		sqlite3_bind_text(stmt, 2, path, len, SQLITE_STATIC);
+
+		int rc = sqlite3_step(stmt);
+		if (rc != SQLITE_ROW) {
+			sqlite3_reset(stmt);
+			*path_id = 0;
+			if (rc != SQLITE_DONE)
+				return fail(q, "cannot read paths: %s",
+					    sqlite3_errmsg(q->db));
+			return 0;
+		}
+		*path_id = sqlite3_column_int64(stmt, 0);
+		path += len;
+	}
+
+	sqlite3_reset(stmt);
+	return 0;
+}
+
+// The commit of repository whose object id starts with the hex digits of
+// hash, at least 4 of them and as many as a SHA-256 id has.
+static int
+resolve_commit(struct bushi_query *q, int64_t repository_id,
+	       const char *hash, int64_t *commit_id)
+{
+	unsigned char lo[32] = {0}, hi[33];
+	size_t len = strlen(hash), lo_len = (len + 1) / 2, hi_len = lo_len;
+
+	if (len < 4 || len > 64)
+		return fail(q, "ref not found: %s", hash);
+	if (parse_hex_prefix(hash, len, lo))
+		return fail(q, "ref not found: %s", hash);
+
+	// The range ends where the last digit is one higher; past the
+	// longest object id when every digit is already 'f'.
+	memcpy(hi, lo, lo_len);
+	unsigned step = len % 2 ? 0x10 : 1;
+	size_t i = lo_len;
+	while (i && hi[i - 1] + step > 0xff) {
+		hi[i - 1] = (hi[i - 1] + step) & 0xff;
+		step = 1;
+		i--;
+	}
+	if (i) {
+		hi[i - 1] += step;
+	} else {
+		memset(hi, 0xff, sizeof(hi));
+		hi_len = sizeof(hi);
+	}
+
+	sqlite3_stmt *stmt = q->stmts[STMT_GET_COMMIT_BY_HASH];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, repository_id);
+	sqlite3_bind_blob(stmt, 2, lo, lo_len, SQLITE_STATIC);
+	sqlite3_bind_blob(stmt, 3, hi, hi_len, SQLITE_STATIC);
+
+	int nr = 0, rc;
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		*commit_id = sqlite3_column_int64(stmt, 0);
+		nr++;
+	}
+	sqlite3_reset(stmt);
+
+	if (rc != SQLITE_DONE)
+		return fail(q, "cannot read commits: %s",
+			    sqlite3_errmsg(q->db));
+	if (nr > 1)
+		return fail(q, "ambiguous commit hash: %s", hash);
+	if (!nr)
+		return fail(q, "ref not found: %s", hash);
+	return 0;
+}
+
+// Commit of ref in repository, and the full name of the ref matched, which
+// the caller frees with sqlite3_free(). A ref that names no branch or tag
+// is taken as a commit hash, with no full name.
+static int
+resolve_ref(struct bushi_query *q, const char *repository, const char *ref,
+	    int64_t *repository_id, int64_t *commit_id, char **full_name)
+{
+	*full_name = NULL;
+
+	sqlite3_stmt *stmt = q->stmts[STMT_GET_REPOSITORY];
+	sqlite3_reset(stmt);
+	sqlite3_bind_text(stmt, 1, repository, -1, SQLITE_STATIC);
+
+	if (sqlite3_step(stmt) != SQLITE_ROW) {
+		sqlite3_reset(stmt);
+		return fail(q, "repository not found: %s", repository);
+	}
+	*repository_id = sqlite3_column_int64(stmt, 0);
+
+	// Without a ref, start from the default branch.
+	char *name = NULL;
+	if (ref)
+		name = sqlite3_mprintf("%s", ref);
+	else if (sqlite3_column_type(stmt, 1) != SQLITE_NULL)
+		name = sqlite3_mprintf("refs/heads/%s",
+				       sqlite3_column_text(stmt, 1));
+	bool has_head = ref || sqlite3_column_type(stmt, 1) != SQLITE_NULL;
+	sqlite3_reset(stmt);
+
+	if (!has_head)
+		return fail(q, "repository head not set: %s", repository);
+	if (!name)
+		return fail(q, "out of memory");
+
+	stmt = q->stmts[STMT_GET_REF];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, *repository_id);
+	sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
+
+	bool found = sqlite3_step(stmt) == SQLITE_ROW;
+	if (found) {
+		*commit_id = sqlite3_column_int64(stmt, 0);
+		*full_name = sqlite3_mprintf("%s",
+					     sqlite3_column_text(stmt, 1));
+	}
+	sqlite3_reset(stmt);
+
+	int ret = 0;
+	if (found && !*full_name)
+		ret = fail(q, "out of memory");
+	else if (!found && ref)
+		ret = resolve_commit(q, *repository_id, ref, commit_id);
+	else if (!found)
+		ret = fail(q, "ref not found: %s", name);
+	sqlite3_free(name);
+	return ret;
+}
+
+// Start point of path_id that bushi-index materialized for the tip of
+// full_name, when that tip is still start_id; *known is false when it has
+// none, and a path the chain never changed has start point 0.
+static int
+find_tip_path(struct bushi_query *q, int64_t repository_id,
+	      const char *full_name, int64_t start_id, int64_t path_id,
+	      int64_t *found, bool *known)
+{
+	sqlite3_stmt *stmt = q->stmts[STMT_TIP_PATH];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, repository_id);
+	sqlite3_bind_text(stmt, 2, full_name, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 3, path_id);
+
+	int rc;
+	*found = 0;
+	*known = false;
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		int64_t commit_id = sqlite3_column_int64(stmt, 1);
+
+		if (sqlite3_column_int64(stmt, 0)) {
+			*found = commit_id;
+			break;
+		}
+		// The ref moved after the last sync that computed the rows.
+		if (commit_id != start_id)
+			break;
+		*known = true;
+	}
+
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		fail(q, "cannot read start points: %s", sqlite3_errmsg(q->db));
+		sqlite3_reset(stmt);
+		return -1;
+	}
+	sqlite3_reset(stmt);
+	return 0;
+}
+
+// Point commit at the row stmt is on: the object id in column 0 and the
+// metadata in columns 2 to 6, as STMT_GET_COMMIT reads them.
+static void
+row_commit(sqlite3_stmt *stmt, struct bushi_commit *commit)
+{
+	commit->hash = sqlite3_column_blob(stmt, 0);
+	commit->hash_len = sqlite3_column_bytes(stmt, 0);
+	commit->author_time = sqlite3_column_int64(stmt, 2);
+	commit->author_name = (const char *)sqlite3_column_text(stmt, 3);
+	commit->author_email = (const char *)sqlite3_column_text(stmt, 4);
+	commit->commit_time = sqlite3_column_int64(stmt, 5);
+	commit->subject = (const char *)sqlite3_column_text(stmt, 6);
+}
+
+// Stream the history stmt reads, at most max commits, and cache it as the
+// history of path_id from start_id.
+static int
+stream_commits(struct bushi_query *q, sqlite3_stmt *stmt, int64_t start_id,
+	       int64_t path_id, int64_t max, bushi_commit_fn fn, void *data)
+{
+	struct result_cache *c = &q->results;
+	struct bushi_commit commit;
+	bool keep = c->budget > 0;
+	size_t nr = 0;
+	int rc;
+
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		row_commit(stmt, &commit);
+		keep = keep && result_cache_keep(c, nr, &commit);
+		nr++;
+		if (fn(&commit, data))
+			break;
+	}
+
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		fail(q, "cannot read history: %s", sqlite3_errmsg(q->db));
+		sqlite3_reset(stmt);
+		return -1;
+	}
+	sqlite3_reset(stmt);
+
+	// A callback that stopped early still leaves a usable prefix.
+	if (keep)
+		result_cache_put(c, start_id, path_id, nr,
+				 rc == SQLITE_DONE && nr < (uint64_t)max);
+	return 0;
+}
+
+static int
+stream_cached(const struct cached_history *e, uint64_t limit,
+	      bushi_commit_fn fn, void *data)
+{
+	size_t nr = e->nr < limit ? e->nr : (size_t)limit;
+	const unsigned char *p = e->commits;
+	struct bushi_commit commit;
+
+	for (size_t i = 0; i < nr; i++) {
+		p = cached_commit_read(p, &commit);
+		if (fn(&commit, data))
+			break;
+	}
+	return 0;
+}
+
+int
+bushi_query_history(struct bushi_query *q, const char *repository,
+		    const char *ref, const char *path, uint64_t limit,
+		    bushi_commit_fn fn, void *data)
+{
+	int64_t repository_id, start_id;
+	char *full_name;
+
+	if (resolve_ref(q, repository, ref, &repository_id, &start_id,
+			&full_name))
+		return -1;
+
+	int64_t max = limit > INT64_MAX ? INT64_MAX : (int64_t)limit;
+	int64_t path_id = 0, commit_id;
+	struct cached_history *cached;
+	sqlite3_stmt *stmt;
+	bool known;
+	int ret = 0;
+
+	if (!limit)
+		goto out;
+	if (path) {
+		ret = resolve_path(q, path, &path_id);
+		if (ret || !path_id)
+			goto out;
+	}
+
+	ret = result_cache_validate(q);
+	if (ret)
+		goto out;
+	cached = result_cache_get(&q->results, start_id, path_id, limit);
+	if (cached) {
+		ret = stream_cached(cached, limit, fn, data);
+		goto out;
+	}
+
+	if (!path) {
+		stmt = q->stmts[STMT_FIRST_PARENT_HISTORY];
+		sqlite3_reset(stmt);
+		sqlite3_bind_int64(stmt, 1, start_id);
+		sqlite3_bind_int64(stmt, 2, max);
+		ret = stream_commits(q, stmt, start_id, 0, max, fn, data);
+		goto out;
+	}
+
+	// A tip that was synced knows where each path starts; any other
+	// commit searches the changes of the path.
+	ret = find_tip_path(q, repository_id, full_name, start_id, path_id,
+			    &commit_id, &known);
+	if (!ret && !known)
+		ret = find_path_start(q, repository_id, path_id, start_id,
+				      &commit_id);
+	if (ret)
+		goto out;
+	if (!commit_id) {
+		if (q->results.budget)
+			result_cache_put(&q->results, start_id, path_id, 0,
+					 true);
+		goto out;
+	}
+
+	stmt = q->stmts[STMT_PATH_HISTORY];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, commit_id);
+	sqlite3_bind_int64(stmt, 2, path_id);
+	sqlite3_bind_int64(stmt, 3, max);
+	ret = stream_commits(q, stmt, start_id, path_id, max, fn, data);
+out:
+	sqlite3_free(full_name);
+	return ret;
+}
+
+// Where one path of a merged history is: the next commit of its chain.
+struct chain_head {
+	int64_t depth;
+	int64_t commit_id;
+	int64_t path_id;
+};
+
+// The heap keeps the deepest head, the newest commit, on top.
+static void
+chain_heap_push(struct chain_head *heap, size_t *nr, struct chain_head head)
+{
+	size_t i = (*nr)++;
+
+	while (i && heap[(i - 1) / 2].depth < head.depth) {
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap[i] = head;
+}
+
+static void
+chain_heap_sift_down(struct chain_head *heap, size_t nr, size_t i)
+{
+	struct chain_head head = heap[i];
+
+	for (;;) {
+		size_t child = 2 * i + 1;
+		if (child >= nr)
+			break;
+		if (child + 1 < nr && heap[child + 1].depth > heap[child].depth)
+			child++;
+		if (heap[child].depth <= head.depth)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = head;
+}
+
+// Move the head on top to the previous change of its path, or drop it at
+// the end of the chain.
+static int
+chain_heap_advance(struct bushi_query *q, struct chain_head *heap, size_t *nr)
+{
+	sqlite3_stmt *stmt = q->stmts[STMT_LAST_CHANGE];
+	struct commit_links links;
+	int64_t last = 0;
+
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, heap[0].commit_id);
+	sqlite3_bind_int64(stmt, 2, heap[0].path_id);
+
+	int rc = sqlite3_step(stmt);
+	if (rc == SQLITE_ROW)
+		last = sqlite3_column_int64(stmt, 0);
+	sqlite3_reset(stmt);
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+		return fail(q, "cannot read changes: %s",
+			    sqlite3_errmsg(q->db));
+
+	// The first change of a path points to itself.
+	if (last && last != heap[0].commit_id) {
+		if (get_links(q, last, &links))
+			return -1;
+		heap[0].commit_id = last;
+		heap[0].depth = links.depth;
+	} else {
+		heap[0] = heap[--*nr];
+	}
+	chain_heap_sift_down(heap, *nr, 0);
+	return 0;
+}
+
+int
+bushi_query_history_paths(struct bushi_query *q, const char *repository,
+			  const char *ref, const char *const *paths,
+			  size_t nr_paths, uint64_t limit, bushi_commit_fn fn,
+			  void *data)
+{
+	if (nr_paths == 1)
+		return bushi_query_history(q, repository, ref, paths[0], limit,
+					   fn, data);
+
+	int64_t repository_id, start_id;
+	char *full_name;
+
+	if (resolve_ref(q, repository, ref, &repository_id, &start_id,
+			&full_name))
+		return -1;
+
+	sqlite3_stmt *stmt = q->stmts[STMT_GET_COMMIT];
+	struct chain_head *heap = NULL;
+	struct bushi_commit commit;
+	size_t nr = 0;
+	int ret = 0;
+
+	if (!limit || !nr_paths)
+		goto out;
+	heap = malloc(nr_paths * sizeof(*heap));
+	if (!heap) {
+		ret = fail(q, "out of memory");
+		goto out;
+	}
+
+	for (size_t i = 0; i < nr_paths; i++) {
+		struct chain_head head = {0};
+		struct commit_links links;
+		bool known;
+
+		ret = resolve_path(q, paths[i], &head.path_id);
+		if (ret)
+			goto out;
+		if (!head.path_id)
+			continue;
+
+		ret = find_tip_path(q, repository_id, full_name, start_id,
+				    head.path_id, &head.commit_id, &known);
+		if (!ret && !known)
+			ret = find_path_start(q, repository_id, head.path_id,
+					      start_id, &head.commit_id);
+		if (!ret && head.commit_id)
+			ret = get_links(q, head.commit_id, &links);
+		if (ret)
+			goto out;
+		if (!head.commit_id)
+			continue;
+
+		head.depth = links.depth;
+		chain_heap_push(heap, &nr, head);
+	}
+
+	// Every chain runs down the first-parent chain of start_id, where no
+	// two commits have the same depth: heads of equal depth are the same
+	// commit, streamed once.
+	int64_t streamed = -1;
+	while (nr && limit) {
+		if (heap[0].depth != streamed) {
+			streamed = heap[0].depth;
+			limit--;
+
+			sqlite3_reset(stmt);
+			sqlite3_bind_int64(stmt, 1, heap[0].commit_id);
+			if (sqlite3_step(stmt) != SQLITE_ROW) {
+				ret = fail(q, "cannot read commit: %s",
+					   sqlite3_errmsg(q->db));
+				break;
+			}
+			row_commit(stmt, &commit);
+			if (fn(&commit, data))
+				break;
+		}
+
+		ret = chain_heap_advance(q, heap, &nr);
+		if (ret)
+			break;
+	}
+	sqlite3_reset(stmt);
+out:
+	free(heap);
+	sqlite3_free(full_name);
+	return ret;
+}
+
+// Where the page after cursor starts: a commit of the history of path_id,
+// or of the first-parent chain when path_id is 0. The cursor has to come
+// from a page of the same repository and path.
+static int
+resume_cursor(struct bushi_query *q, const char *repository,
+	      const char *path, const char *cursor, int64_t *path_id,
+	      int64_t *commit_id)
+{
+	uint64_t commit, cursor_path;
+	int64_t repository_id = 0, expected = 0;
+	int end = 0;
+
+	if (sscanf(cursor, "%" SCNx64 ".%" SCNx64 "%n", &commit, &cursor_path,
+		   &end) != 2 ||
+	    cursor[end] || !commit || commit > INT64_MAX ||
+	    cursor_path > INT64_MAX)
+		return fail(q, "invalid cursor: %s", cursor);
+	*commit_id = commit;
+	*path_id = cursor_path;
+
+	sqlite3_stmt *stmt = q->stmts[STMT_GET_REPOSITORY];
+	sqlite3_reset(stmt);
+	sqlite3_bind_text(stmt, 1, repository, -1, SQLITE_STATIC);
+	bool found = sqlite3_step(stmt) == SQLITE_ROW;
+	if (found)
+		repository_id = sqlite3_column_int64(stmt, 0);
+	sqlite3_reset(stmt);
+	if (!found)
+		return fail(q, "repository not found: %s", repository);
+
+	if (path && resolve_path(q, path, &expected))
+		return -1;
+
+	stmt = q->stmts[STMT_GET_COMMIT_REPOSITORY];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, *commit_id);
+	found = sqlite3_step(stmt) == SQLITE_ROW &&
+		sqlite3_column_int64(stmt, 0) == repository_id;
+	sqlite3_reset(stmt);
+
+	// The page starts at a change of the path, or it would end there.
+	if (found && *path_id) {
+		stmt = q->stmts[STMT_LAST_CHANGE];
+		sqlite3_reset(stmt);
+		sqlite3_bind_int64(stmt, 1, *commit_id);
+		sqlite3_bind_int64(stmt, 2, *path_id);
+		found = sqlite3_step(stmt) == SQLITE_ROW;
+		sqlite3_reset(stmt);
+	}
+
+	if (!found || *path_id != expected)
+		return fail(q, "cursor does not match the query: %s", cursor);
+	return 0;
+}
+
+int
+bushi_query_history_page(struct bushi_query *q, const char *repository,
+			 const char *ref, const char *path,
+			 const char *cursor, uint64_t limit,
+			 bushi_commit_fn fn, void *data,
+			 char next[BUSHI_QUERY_CURSOR_SIZE])
+{
+	int64_t repository_id, start_id, path_id = 0, commit_id = 0;
+	char *full_name = NULL;
+	bool known;
+	int ret = 0;
+
+	next[0] = '\0';
+	if (cursor && *cursor) {
+		ret = resume_cursor(q, repository, path, cursor, &path_id,
+				    &commit_id);
+	} else {
+		ret = resolve_ref(q, repository, ref, &repository_id,
+				  &start_id, &full_name);
+		if (!ret && path)
+			ret = resolve_path(q, path, &path_id);
+		if (!ret && !path)
+			commit_id = start_id;
+		if (!ret && path_id)
+			ret = find_tip_path(q, repository_id, full_name,
+					    start_id, path_id, &commit_id,
+					    &known);
+		if (!ret && path_id && !known)
+			ret = find_path_start(q, repository_id, path_id,
+					      start_id, &commit_id);
+	}
+	if (ret || !commit_id || !limit)
+		goto out;
+
+	// One row more than the page tells where the next one starts.
+	int64_t max = limit >= INT64_MAX ? INT64_MAX : (int64_t)limit + 1;
+	sqlite3_stmt *stmt;
+	if (path_id) {
+		stmt = q->stmts[STMT_PATH_HISTORY];
+		sqlite3_reset(stmt);
+		sqlite3_bind_int64(stmt, 1, commit_id);
+		sqlite3_bind_int64(stmt, 2, path_id);
+		sqlite3_bind_int64(stmt, 3, max);
+	} else {
+		stmt = q->stmts[STMT_FIRST_PARENT_HISTORY];
+		sqlite3_reset(stmt);
+		sqlite3_bind_int64(stmt, 1, commit_id);
+		sqlite3_bind_int64(stmt, 2, max);
+	}
+
+	struct bushi_commit commit;
+	uint64_t nr = 0;
+	bool stopped = false;
+	int rc;
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (nr == limit || stopped) {
+			snprintf(next, BUSHI_QUERY_CURSOR_SIZE,
+				 "%" PRIx64 ".%" PRIx64,
+				 (uint64_t)sqlite3_column_int64(stmt, 1),
+				 (uint64_t)path_id);
+			break;
+		}
+		nr++;
+		row_commit(stmt, &commit);
+		stopped = fn(&commit, data);
+	}
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+		ret = fail(q, "cannot read history: %s", sqlite3_errmsg(q->db));
+	sqlite3_reset(stmt);
+out:
+	sqlite3_free(full_name);
+	return ret;
+}
+
+// Deepest commit on the first-parent chains of both a and b, or 0 when
+// they share none. Jumps only depend on depth, so once a and b are at the
+// same depth they can jump together for as long as their jumps differ.
+static int
+first_parent_meet(struct bushi_query *q, int64_t a, int64_t b,
+		  int64_t *meet)
+{
+	struct commit_links la, lb;
+
+	*meet = 0;
+	if (get_links(q, a, &la) || get_links(q, b, &lb) ||
+	    descend(q, &a, lb.depth) || descend(q, &b, la.depth) ||
+	    get_links(q, a, &la) || get_links(q, b, &lb))
+		return -1;
+
+	while (a != b) {
+		// Two different roots.
+		if (!la.depth)
+			return 0;
+
+		if (la.jump_id != lb.jump_id) {
+			a = la.jump_id;
+			b = lb.jump_id;
+		} else {
+			a = la.parent_id;
+			b = lb.parent_id;
+		}
+		if (get_links(q, a, &la) || get_links(q, b, &lb))
+			return -1;
+	}
+	*meet = a;
+	return 0;
+}
+
+// Move *commit_id down its first-parent chain to the latest commit with a
+// chain time before time, or to 0 when there is none. Chain times never
+// decrease towards the tip, so this searches like descend().
+static int
+descend_to_time(struct bushi_query *q, int64_t *commit_id, int64_t time)
+{
+	struct commit_links links, jump;
+
+	while (*commit_id) {
+		if (get_links(q, *commit_id, &links))
+			return -1;
+		if (links.time < time)
+			return 0;
+
+		if (get_links(q, links.jump_id, &jump))
+			return -1;
+		*commit_id = jump.time >= time && links.jump_id != *commit_id
+				 ? links.jump_id
+				 : links.parent_id;
+	}
+	return 0;
+}
+
+// Where the range of the first-parent chain of start_id ends: commits at
+// *floor and below are out. Commit times are not ordered along the chain,
+// so only since bounds it, through the chain times; until leaves it be.
+static int
+resolve_range(struct bushi_query *q, const char *repository,
+	      const struct bushi_query_range *range, int64_t start_id,
+	      int64_t *floor)
+{
+	struct commit_links links;
+	int64_t repository_id, bound;
+	char *full_name;
+
+	*floor = -1;
+	if (range->exclude) {
+		if (resolve_ref(q, repository, range->exclude, &repository_id,
+				&bound, &full_name))
+			return -1;
+		sqlite3_free(full_name);
+		if (first_parent_meet(q, start_id, bound, &bound))
+			return -1;
+		if (bound) {
+			if (get_links(q, bound, &links))
+				return -1;
+			*floor = links.depth;
+		}
+	}
+
+	if (range->has_since) {
+		bound = start_id;
+		if (descend_to_time(q, &bound, range->since))
+			return -1;
+		if (bound) {
+			if (get_links(q, bound, &links))
+				return -1;
+			if (links.depth > *floor)
+				*floor = links.depth;
+		}
+	}
+	return 0;
+}
+
+int
+bushi_query_history_range(struct bushi_query *q, const char *repository,
+			  const char *ref, const char *path,
+			  const struct bushi_query_range *range,
+			  uint64_t limit, bushi_commit_fn fn, void *data)
+{
+	int64_t repository_id, start_id, floor, path_id = 0;
+	int64_t since = range->has_since ? range->since : INT64_MIN;
+	int64_t until = range->has_until ? range->until : INT64_MAX;
+	struct commit_links links;
+	char *full_name;
+	bool known;
+
+	if (since > until)
+		return fail(q, "time range ends before it starts: %" PRId64
+			    "..%" PRId64, since, until);
+	if (resolve_ref(q, repository, ref, &repository_id, &start_id,
+			&full_name))
+		return -1;
+
+	int ret = resolve_range(q, repository, range, start_id, &floor);
+	if (ret || !limit)
+		goto out;
+	ret = get_links(q, start_id, &links);
+	if (ret || links.depth <= floor)
+		goto out;
+
+	int64_t max = limit > INT64_MAX ? INT64_MAX : (int64_t)limit;
+	sqlite3_stmt *stmt;
+	if (!path) {
+		// Exactly the commits above the floor, then those in time.
+		stmt = q->stmts[STMT_FIRST_PARENT_RANGE_HISTORY];
+		sqlite3_reset(stmt);
+		sqlite3_bind_int64(stmt, 1, start_id);
+		sqlite3_bind_int64(stmt, 2, links.depth - floor);
+		sqlite3_bind_int64(stmt, 3, max);
+		sqlite3_bind_int64(stmt, 4, since);
+		sqlite3_bind_int64(stmt, 5, until);
+	} else {
+		int64_t commit_id = 0;
+
+		ret = resolve_path(q, path, &path_id);
+		if (ret || !path_id)
+			goto out;
+		ret = find_tip_path(q, repository_id, full_name, start_id,
+				    path_id, &commit_id, &known);
+		if (!ret && !known)
+			ret = find_path_start(q, repository_id, path_id,
+					      start_id, &commit_id);
+		if (ret || !commit_id)
+			goto out;
+		ret = get_links(q, commit_id, &links);
+		if (ret || links.depth <= floor)
+			goto out;
+
+		stmt = q->stmts[STMT_PATH_RANGE_HISTORY];
+		sqlite3_reset(stmt);
+		sqlite3_bind_int64(stmt, 1, commit_id);
+		sqlite3_bind_int64(stmt, 2, path_id);
+		sqlite3_bind_int64(stmt, 3, max);
+		sqlite3_bind_int64(stmt, 4, floor);
+		sqlite3_bind_int64(stmt, 5, since);
+		sqlite3_bind_int64(stmt, 6, until);
+	}
+
+	struct bushi_commit commit;
+	int rc;
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		row_commit(stmt, &commit);
+		if (fn(&commit, data))
+			break;
+	}
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+		ret = fail(q, "cannot read history: %s", sqlite3_errmsg(q->db));
+	sqlite3_reset(stmt);
+out:
+	sqlite3_free(full_name);
+	return ret;
+}
+
+// Stream the history of path_id from commit_id, a commit that changed it,
+// and on into the history of the file it was renamed from. *max counts
+// down the commits left to stream, and drops to 0 when the callback stops.
+static int
+follow_renames(struct bushi_query *q, int64_t repository_id,
+	       int64_t path_id, int64_t commit_id, int64_t *max,
+	       bushi_commit_fn fn, void *data)
+{
+	sqlite3_stmt *stmt = q->stmts[STMT_FOLLOW_HISTORY];
+	struct commit_links links;
+	struct bushi_commit commit;
+	int rc;
+
+	// Each rename leads to an older commit, so this ends.
+	while (commit_id && *max) {
+		int64_t renamed_at = 0, old_path_id = 0;
+
+		sqlite3_reset(stmt);
+		sqlite3_bind_int64(stmt, 1, commit_id);
+		sqlite3_bind_int64(stmt, 2, path_id);
+		sqlite3_bind_int64(stmt, 3, *max);
+		while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+			(*max)--;
+			row_commit(stmt, &commit);
+			if (fn(&commit, data)) {
+				*max = 0;
+				break;
+			}
+			if (sqlite3_column_type(stmt, 7) != SQLITE_NULL) {
+				renamed_at = sqlite3_column_int64(stmt, 1);
+				old_path_id = sqlite3_column_int64(stmt, 7);
+				break;
+			}
+		}
+		if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+			fail(q, "cannot read history: %s",
+			     sqlite3_errmsg(q->db));
+			sqlite3_reset(stmt);
+			return -1;
+		}
+		sqlite3_reset(stmt);
+		if (!renamed_at || !*max)
+			break;
+
+		// The old name lives on from the first parent of the commit
+		// that renamed it.
+		if (get_links(q, renamed_at, &links))
+			return -1;
+		commit_id = 0;
+		path_id = old_path_id;
+		if (links.depth && find_path_start(q, repository_id, path_id,
+						   links.parent_id, &commit_id))
+			return -1;
+	}
+	return 0;
+}
+
+int
+bushi_query_follow(struct bushi_query *q, const char *repository,
+		   const char *ref, const char *path, uint64_t limit,
+		   bushi_commit_fn fn, void *data)
+{
+	int64_t repository_id, start_id;
+	char *full_name;
+
+	if (resolve_ref(q, repository, ref, &repository_id, &start_id,
+			&full_name))
+		return -1;
+
+	int64_t max = limit > INT64_MAX ? INT64_MAX : (int64_t)limit;
+	int64_t path_id = 0, commit_id = 0;
+	bool known;
+	int ret = 0;
+
+	if (!path || !*path || path[strlen(path) - 1] == '/') {
+		ret = fail(q, "only files can be followed: %s",
+			   path ? path : "(null)");
+		goto out;
+	}
+	if (!limit)
+		goto out;
+
+	ret = resolve_path(q, path, &path_id);
+	if (ret || !path_id)
+		goto out;
+
+	ret = find_tip_path(q, repository_id, full_name, start_id, path_id,
+			    &commit_id, &known);
+	if (!ret && !known)
+		ret = find_path_start(q, repository_id, path_id, start_id,
+				      &commit_id);
+	if (!ret)
+		ret = follow_renames(q, repository_id, path_id, commit_id,
+				     &max, fn, data);
+out:
+	sqlite3_free(full_name);
+	return ret;
+}
+
+// Entries of a directory at a commit that is not a synced branch tip: one
+// start-point search per child the repository has.
+static int
+search_entries(struct bushi_query *q, int64_t repository_id,
+	       int64_t start_id, int64_t dir_id, int64_t max,
+	       bushi_entry_fn fn, void *data)
+{
+	sqlite3_stmt *stmt = q->stmts[STMT_CHILDREN];
+	sqlite3_stmt *hash = q->stmts[STMT_ENTRY_HASH];
+	int rc = SQLITE_DONE, ret = 0;
+
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, dir_id);
+	sqlite3_bind_int64(stmt, 2, repository_id);
+	while (max && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		int64_t path_id = sqlite3_column_int64(stmt, 0);
+		int64_t commit_id;
+
+		ret = find_path_start(q, repository_id, path_id, start_id,
+				      &commit_id);
+		if (ret)
+			break;
+		if (!commit_id)
+			continue;
+
+		sqlite3_reset(hash);
+		sqlite3_bind_int64(hash, 1, commit_id);
+		sqlite3_bind_int64(hash, 2, path_id);
+		int hash_rc = sqlite3_step(hash);
+		if (hash_rc == SQLITE_DONE)
+			continue;
+		if (hash_rc != SQLITE_ROW) {
+			ret = fail(q, "cannot read commit: %s",
+				   sqlite3_errmsg(q->db));
+			break;
+		}
+		max--;
+		if (fn((const char *)sqlite3_column_text(stmt, 1),
+		       sqlite3_column_blob(hash, 0),
+		       sqlite3_column_bytes(hash, 0), data))
+			break;
+	}
+
+	if (!ret && max && rc != SQLITE_ROW && rc != SQLITE_DONE)
+		ret = fail(q, "cannot read paths: %s", sqlite3_errmsg(q->db));
+	sqlite3_reset(hash);
+	sqlite3_reset(stmt);
+	return ret;
+}
+
+int
+bushi_query_entries(struct bushi_query *q, const char *repository,
+		    const char *ref, const char *path, uint64_t limit,
+		    bushi_entry_fn fn, void *data)
+{
+	int64_t repository_id, start_id;
+	char *full_name, *dir = NULL;
+
+	if (resolve_ref(q, repository, ref, &repository_id, &start_id,
+			&full_name))
+		return -1;
+
+	int64_t max = limit > INT64_MAX ? INT64_MAX : (int64_t)limit;
+	int64_t dir_id = 0, commit_id;
+	bool known;
+	int ret = 0;
+
+	// Listing always means a directory; the root is "" or NULL.
+	if (path && *path) {
+		size_t len = strlen(path);
+
+		dir = sqlite3_mprintf("%s%s", path,
+				      path[len - 1] == '/' ? "" : "/");
+		ret = dir ? resolve_path(q, dir, &dir_id)
+			  : fail(q, "out of memory");
+		if (!ret && !dir_id)
+			ret = fail(q, "path not found: %s", path);
+	}
+	if (ret || !limit)
+		goto out;
+
+	ret = find_tip_path(q, repository_id, full_name, start_id, 0,
+			    &commit_id, &known);
+	if (ret)
+		goto out;
+	if (!known) {
+		ret = search_entries(q, repository_id, start_id, dir_id, max,
+				     fn, data);
+		goto out;
+	}
+
+	sqlite3_stmt *stmt = q->stmts[STMT_TIP_ENTRIES];
+	sqlite3_reset(stmt);
+	sqlite3_bind_int64(stmt, 1, repository_id);
+	sqlite3_bind_text(stmt, 2, full_name, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 3, dir_id);
+	sqlite3_bind_int64(stmt, 4, max);
+
+	int rc;
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+		if (fn((const char *)sqlite3_column_text(stmt, 0),
+		       sqlite3_column_blob(stmt, 1),
+		       sqlite3_column_bytes(stmt, 1), data))
+			break;
+
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+		ret = fail(q, "cannot read entries: %s", sqlite3_errmsg(q->db));
+	sqlite3_reset(stmt);
+out:
+	sqlite3_free(dir);
+	sqlite3_free(full_name);
+	return ret;
+}
+
+// user_version of the database, or -1 when it cannot be read.
+static int
+schema_version(sqlite3 *db)
+{
+	sqlite3_stmt *stmt = NULL;
+	int version = -1;
+
+	if (sqlite3_prepare_v2(db, "PRAGMA user_version", -1, &stmt, NULL) !=
+	    SQLITE_OK)
+		return -1;
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		version = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+	return version;
+}
+
+int
+bushi_query_open(const char *database, struct bushi_query **qp)
+{
+	struct bushi_query *q = calloc(1, sizeof(*q));
+
+	*qp = q;
+	if (!q)
+		return -1;
+	q->results.budget = RESULT_CACHE_BYTES;
+
+	int rc = sqlite3_open_v2(database, &q->db, SQLITE_OPEN_READONLY, NULL);
+	if (rc != SQLITE_OK)
+		return fail(q, "cannot open database '%s': %s", database,
+			    sqlite3_errmsg(q->db));
+
+	sqlite3_busy_timeout(q->db, QUERY_BUSY_TIMEOUT_MS);
+
+	int version = schema_version(q->db);
+	if (version != BUSHI_SCHEMA_VERSION)
+		return fail(q, "database '%s' has schema %d, expected %d",
+			    database, version, BUSHI_SCHEMA_VERSION);
+
+	for (int i = 0; i < STMT_COUNT; i++) {
+		rc = sqlite3_prepare_v3(q->db, texts[i], -1,
+					SQLITE_PREPARE_PERSISTENT,
+					&q->stmts[i], NULL);
+		if (rc != SQLITE_OK)
+			return fail(q, "cannot prepare statement %d: %s", i,
+				    sqlite3_errmsg(q->db));
+	}
+
+	return 0;
+}
+
+void
+bushi_query_close(struct bushi_query *q)
+{
+	if (!q)
+		return;
+
+	for (int i = 0; i < STMT_COUNT; i++)
+		sqlite3_finalize(q->stmts[i]);
+	sqlite3_close(q->db);
+	free(q->links.slots);
+	result_cache_clear(&q->results);
+	free(q);
+}
+
+void
+bushi_query_set_cache_size(struct bushi_query *q, size_t budget)
+{
+	q->results.budget = budget;
+	result_cache_trim(&q->results);
+	if (!budget)
+		result_cache_clear(&q->results);
+}
+
+void
+bushi_query_cache_stats(const struct bushi_query *q,
+			struct bushi_query_cache_stats *stats)
+{
+	*stats = q->results.stats;
+	stats->entries = q->results.nr;
+	stats->bytes = q->results.bytes;
+}
+
+const char *
+bushi_query_errmsg(const struct bushi_query *q)
+{
+	return q ? q->errmsg : "out of memory";
+}
@@ -0,0 +1,190 @@
+#ifndef BUSHI_QUERY_H
+#define BUSHI_QUERY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Path history queries over a database written by bushi-index.
+//
+// A handle owns a read-only connection, its prepared statements and a
+// cache of first-parent links. Handles are not thread-safe; open one per
+// thread. Paths follow the index: a trailing '/' names a directory,
+// anything else a file, and there is no leading '/'.
+
+// user_version of the database layout that bushi-index writes and this
+// library reads. Bumped whenever init.sql changes incompatibly.
+#define BUSHI_SCHEMA_VERSION 11
+
+struct bushi_query;
+
+// A commit of a history: its raw object id of hash_len bytes and what
+// bushi-index stored of it when it indexed it, read by the same query, so
+// that a listing need not open the repository. Everything belongs to the
+// query and is only valid during the callback.
+struct bushi_commit {
+	const unsigned char *hash;
+	size_t hash_len;
+	const char *author_name; // NULL when the author line was unparsable
+	const char *author_email;
+	int64_t author_time; // seconds since the epoch
+	int64_t commit_time;
+	const char *subject; // first paragraph, at most 256 bytes of UTF-8
+};
+
+// Called for each commit of a history, newest first. Returning non-zero
+// stops the query early.
+typedef int (*bushi_commit_fn)(const struct bushi_commit *commit,
+			       void *data);
+
+// Open database read-only. Like sqlite3_open(), *q is set even when this
+// fails, so that bushi_query_errmsg() can tell why; close it either way.
+// Returns 0 on success and -1 on failure.
+int bushi_query_open(const char *database, struct bushi_query **q);
+
+void bushi_query_close(struct bushi_query *q);
+
+// Why the last call on q failed.
+const char *bushi_query_errmsg(const struct bushi_query *q);
+
+// Stream the first-parent history of path in repository, starting at ref
+// and returning at most limit commits. ref is a full ref name such as
+// "refs/tags/v1.0", a branch or tag name, or a commit hash of at least 4
+// hex digits; NULL means the default branch.
+// A NULL path streams every commit of the first-parent chain; a path that
+// was never changed streams nothing. Returns 0 on success, including when
+// the callback stops the query, and -1 on failure.
+int bushi_query_history(struct bushi_query *q, const char *repository,
+			const char *ref, const char *path, uint64_t limit,
+			bushi_commit_fn fn, void *data);
+
+// The commits that changed any of nr_paths paths, files or directories,
+// as one first-parent history from ref: newest first, each once, and at
+// most limit of them. The path histories are merged as they are read, so
+// the query reads about as many changes as it streams commits. Paths that
+// were never changed add nothing. Unlike single paths, merged histories
+// are not cached.
+int bushi_query_history_paths(struct bushi_query *q, const char *repository,
+			      const char *ref, const char *const *paths,
+			      size_t nr_paths, uint64_t limit,
+			      bushi_commit_fn fn, void *data);
+
+// Size of a cursor, NUL included.
+#define BUSHI_QUERY_CURSOR_SIZE 40
+
+// As bushi_query_history(), one page of at most limit commits at a time.
+// cursor is NULL or "" for the first page, which starts at ref. Each later
+// page passes the cursor the page before it wrote to next and resumes
+// right there, ignoring ref, so it costs the same at any depth and does
+// not shift when the ref moves. next is set to "" after the last page, and
+// when the callback stops early it points just past that commit. Cursors
+// are opaque strings, valid for the same repository and path until the
+// database is regenerated. Pages are not cached.
+int bushi_query_history_page(struct bushi_query *q, const char *repository,
+			     const char *ref, const char *path,
+			     const char *cursor, uint64_t limit,
+			     bushi_commit_fn fn, void *data,
+			     char next[BUSHI_QUERY_CURSOR_SIZE]);
+
+// Bounds of bushi_query_history_range().
+struct bushi_query_range {
+	// The A of A..ref: a ref or commit, resolved as ref is, whose own
+	// first-parent history is left out. NULL for none.
+	const char *exclude;
+	// Commit times in seconds since the epoch, both inclusive, each
+	// only a bound when its flag is set.
+	bool has_since, has_until;
+	int64_t since;
+	int64_t until;
+};
+
+// As bushi_query_history(), within a range of the first-parent chain of
+// ref. With exclude, the history ends above the first commit the chain
+// shares with that of exclude, which is exclude itself when it is a
+// first-parent ancestor of ref. With since and until, it keeps only the
+// commits whose commit time lies between them. Commit times need not
+// decrease along a chain, so the history still starts at ref, but it ends
+// before the first commit whose chain time is earlier than since: the
+// chain time of a commit is the latest commit time from the root of its
+// chain to it, so no commit below that one is recent enough. That bound is
+// found along the jump pointers in O(log n), and each chain stops as soon
+// as it passes it. Fails when since is later than until. Ranges are not
+// cached.
+int bushi_query_history_range(struct bushi_query *q, const char *repository,
+			      const char *ref, const char *path,
+			      const struct bushi_query_range *range,
+			      uint64_t limit, bushi_commit_fn fn, void *data);
+
+// As bushi_query_history(), for the file path, and past the commits that
+// renamed it into the history of its old name. Renames are only known for
+// repositories bushi-index detects them in; see bushi.renameLimit. These
+// histories are not cached.
+int bushi_query_follow(struct bushi_query *q, const char *repository,
+		       const char *ref, const char *path, uint64_t limit,
+		       bushi_commit_fn fn, void *data);
+
+// History query results a handle kept. They are keyed on the commit a ref
+// resolved to and the path, so a sync that moves the ref sends the next
+// query to a new entry. Every commit to the database by another
+// connection, a sync included, still empties the cache at the next
+// history query and counts as one invalidation, so a long-lived handle
+// never answers from rows a sync has since replaced.
+struct bushi_query_cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t invalidations;
+	size_t entries;
+	size_t bytes;
+};
+
+// Keep up to budget bytes of history query results on q, 16 MiB unless
+// set, evicting the least recently used first. 0 turns the cache off and
+// empties it.
+void bushi_query_set_cache_size(struct bushi_query *q, size_t budget);
+
+void bushi_query_cache_stats(const struct bushi_query *q,
+			     struct bushi_query_cache_stats *stats);
+
+// Called for each entry of a directory, in name order, with its name (a
+// trailing '/' marks a directory) and the raw object id of the last
+// commit that changed it. Returning non-zero stops the listing early.
+typedef int (*bushi_entry_fn)(const char *name, const unsigned char *hash,
+			      size_t hash_len, void *data);
+
+// List at most limit entries of the directory path, NULL or "" for the
+// root, as of ref, which is resolved as for bushi_query_history(). Only
+// entries changed on the first-parent chain of ref are listed, including
+// deleted ones. Synced branch tips answer from one index range; anything
+// else searches the start point of every entry. Returns 0 on success and
+// -1 on failure, including when path is not a directory of the index.
+int bushi_query_entries(struct bushi_query *q, const char *repository,
+			const char *ref, const char *path, uint64_t limit,
+			bushi_entry_fn fn, void *data);
+
+// Snapshots answer the same history queries for one repository from the
+// file bushi-index -S writes, mapped read-only, without SQLite. A handle is
+// not thread-safe, but any number of them can map the same file. Open,
+// close and errmsg work as for a database handle.
+struct bushi_snapshot;
+
+int bushi_snapshot_open(const char *file, struct bushi_snapshot **s);
+
+void bushi_snapshot_close(struct bushi_snapshot *s);
+
+const char *bushi_snapshot_errmsg(const struct bushi_snapshot *s);
+
+// bushi-index replaces a snapshot after a sync by renaming a new file over
+// it. Map the new file if that happened since s mapped it. Returns 1 when
+// it did, 0 when the file is the same and -1 on failure, in which case the
+// old mapping stays in use.
+int bushi_snapshot_refresh(struct bushi_snapshot *s);
+
+// As bushi_query_history(), within the repository of the snapshot.
+// Snapshots keep no metadata: commits come with only their object ids,
+// NULL strings and times of 0.
+int bushi_snapshot_history(struct bushi_snapshot *s, const char *ref,
+			   const char *path, uint64_t limit,
+			   bushi_commit_fn fn, void *data);
+
+#endif
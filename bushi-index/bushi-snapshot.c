@@ -0,0 +1,517 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bushi-hex.h"
+#include "bushi-query.h"
+#include "bushi-snapshot.h"
+
+#define NONE BUSHI_SNAPSHOT_NONE
+
+struct snapshot_map {
+	const unsigned char *base;
+	size_t size;
+	dev_t dev;
+	ino_t ino;
+
+	const struct bushi_snapshot_header *header;
+	const unsigned char *hashes;
+	const struct bushi_snapshot_commit *commits;
+	const uint32_t *by_hash;
+	const struct bushi_snapshot_path *paths;
+	const struct bushi_snapshot_change *changes;
+	const struct bushi_snapshot_ref *refs;
+	const struct bushi_snapshot_tip *tips;
+	const char *strings;
+};
+
+struct bushi_snapshot {
+	char *file;
+	struct snapshot_map map;
+	char errmsg[256];
+};
+
+static int
+fail(struct bushi_snapshot *s, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(s->errmsg, sizeof(s->errmsg), fmt, ap);
+	va_end(ap);
+	return -1;
+}
+
+// Whether nr items of size bytes at offset fit in the file.
+static bool
+section_fits(const struct snapshot_map *m, uint64_t offset, uint64_t nr,
+	     size_t size)
+{
+	return offset % 8 == 0 && offset <= m->size &&
+	       nr <= (m->size - offset) / size;
+}
+
+// Check what the queries rely on to stay inside the mapping and to end:
+// the header, the sections and the ranges they point to, and that every
+// parent, jump and previous change link leads to a commit of lower depth,
+// so that no walk comes back to where it was.
+static int
+check_map(struct bushi_snapshot *s, struct snapshot_map *m)
+{
+	const struct bushi_snapshot_header *h = m->header;
+
+	if (m->size < sizeof(*h) || memcmp(h->magic, BUSHI_SNAPSHOT_MAGIC, 8))
+		return fail(s, "not a snapshot: %s", s->file);
+	if (h->order != BUSHI_SNAPSHOT_ORDER)
+		return fail(s, "snapshot of another byte order: %s", s->file);
+	if (h->version != BUSHI_SNAPSHOT_VERSION)
+		return fail(s, "snapshot '%s' has version %u, expected %d",
+			    s->file, h->version, BUSHI_SNAPSHOT_VERSION);
+
+	if (h->size != m->size || !h->hash_len ||
+	    !section_fits(m, h->hashes, h->nr_commits, h->hash_len) ||
+	    !section_fits(m, h->commits, h->nr_commits,
+			  sizeof(*m->commits)) ||
+	    !section_fits(m, h->by_hash, h->nr_commits, sizeof(uint32_t)) ||
+	    !section_fits(m, h->paths, h->nr_paths, sizeof(*m->paths)) ||
+	    !section_fits(m, h->changes, h->nr_changes, sizeof(*m->changes)) ||
+	    !section_fits(m, h->refs, h->nr_refs, sizeof(*m->refs)) ||
+	    !section_fits(m, h->tips, h->nr_tips, sizeof(*m->tips)) ||
+	    !section_fits(m, h->strings, h->strings_size, 1) ||
+	    (h->head != NONE && h->head >= h->nr_refs))
+		return fail(s, "corrupt snapshot: %s", s->file);
+
+	m->hashes = m->base + h->hashes;
+	m->commits = (const void *)(m->base + h->commits);
+	m->by_hash = (const void *)(m->base + h->by_hash);
+	m->paths = (const void *)(m->base + h->paths);
+	m->changes = (const void *)(m->base + h->changes);
+	m->refs = (const void *)(m->base + h->refs);
+	m->tips = (const void *)(m->base + h->tips);
+	m->strings = (const char *)(m->base + h->strings);
+
+	for (uint32_t i = 0; i < h->nr_paths; i++) {
+		const struct bushi_snapshot_path *p = &m->paths[i];
+		if ((uint64_t)p->name + p->name_len >= h->strings_size ||
+		    p->changes > h->nr_changes ||
+		    p->nr_changes > h->nr_changes - p->changes)
+			return fail(s, "corrupt snapshot: %s", s->file);
+	}
+	for (uint32_t i = 0; i < h->nr_refs; i++) {
+		const struct bushi_snapshot_ref *r = &m->refs[i];
+		if ((uint64_t)r->name + r->name_len >= h->strings_size ||
+		    r->commit >= h->nr_commits || r->tips > h->nr_tips ||
+		    r->nr_tips > h->nr_tips - r->tips)
+			return fail(s, "corrupt snapshot: %s", s->file);
+	}
+
+	// A root's jump is itself, but no walk takes it.
+	for (uint32_t i = 0; i < h->nr_commits; i++) {
+		const struct bushi_snapshot_commit *c = &m->commits[i];
+		if ((c->parent != NONE &&
+		     (c->parent >= h->nr_commits ||
+		      m->commits[c->parent].depth >= c->depth)) ||
+		    (c->depth &&
+		     (c->jump >= h->nr_commits ||
+		      m->commits[c->jump].depth >= c->depth)))
+			return fail(s, "corrupt snapshot: %s", s->file);
+	}
+	// The first change of a path's chain points to itself.
+	for (uint32_t i = 0; i < h->nr_changes; i++) {
+		const struct bushi_snapshot_change *c = &m->changes[i];
+		if (c->commit >= h->nr_commits || c->last >= h->nr_changes ||
+		    m->changes[c->last].commit >= h->nr_commits ||
+		    (c->last != i &&
+		     m->commits[m->changes[c->last].commit].depth >=
+			 m->commits[c->commit].depth))
+			return fail(s, "corrupt snapshot: %s", s->file);
+	}
+	return 0;
+}
+
+static int
+map_file(struct bushi_snapshot *s, struct snapshot_map *m)
+{
+	struct stat st;
+	int fd = open(s->file, O_RDONLY | O_CLOEXEC);
+
+	memset(m, 0, sizeof(*m));
+	if (fd < 0)
+		return fail(s, "cannot open snapshot '%s': %s", s->file,
+			    strerror(errno));
+	if (fstat(fd, &st)) {
+		close(fd);
+		return fail(s, "cannot stat snapshot '%s': %s", s->file,
+			    strerror(errno));
+	}
+	if (!st.st_size) {
+		close(fd);
+		return fail(s, "not a snapshot: %s", s->file);
+	}
+
+	void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return fail(s, "cannot map snapshot '%s': %s", s->file,
+			    strerror(errno));
+
+	m->base = base;
+	m->size = st.st_size;
+	m->dev = st.st_dev;
+	m->ino = st.st_ino;
+	m->header = base;
+	if (check_map(s, m)) {
+		munmap(base, m->size);
+		m->base = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+int
+bushi_snapshot_open(const char *file, struct bushi_snapshot **sp)
+{
+	struct bushi_snapshot *s = calloc(1, sizeof(*s));
+
+	*sp = s;
+	if (!s)
+		return -1;
+	s->file = strdup(file);
+	if (!s->file)
+		return fail(s, "out of memory");
+	return map_file(s, &s->map);
+}
+
+void
+bushi_snapshot_close(struct bushi_snapshot *s)
+{
+	if (!s)
+		return;
+
+	if (s->map.base)
+		munmap((void *)s->map.base, s->map.size);
+	free(s->file);
+	free(s);
+}
+
+const char *
+bushi_snapshot_errmsg(const struct bushi_snapshot *s)
+{
+	return s ? s->errmsg : "out of memory";
+}
+
+int
+bushi_snapshot_refresh(struct bushi_snapshot *s)
+{
+	struct snapshot_map m;
+	struct stat st;
+
+	if (stat(s->file, &st))
+		return fail(s, "cannot stat snapshot '%s': %s", s->file,
+			    strerror(errno));
+	if (s->map.base && st.st_dev == s->map.dev && st.st_ino == s->map.ino)
+		return 0;
+
+	if (map_file(s, &m))
+		return -1;
+	if (s->map.base)
+		munmap((void *)s->map.base, s->map.size);
+	s->map = m;
+	return 1;
+}
+
+// Compare name with the len bytes at offset in strings, as memcmp() would
+// order them.
+static int
+cmp_name(const struct snapshot_map *m, const char *name, size_t len,
+	 uint32_t offset, uint32_t name_len)
+{
+	int c = memcmp(name, m->strings + offset,
+		       len < name_len ? len : name_len);
+	if (c)
+		return c;
+	return len < name_len ? -1 : len > name_len;
+}
+
+static uint32_t
+find_ref(const struct snapshot_map *m, const char *name, size_t len)
+{
+	uint32_t lo = 0, hi = m->header->nr_refs;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		int c = cmp_name(m, name, len, m->refs[mid].name,
+				 m->refs[mid].name_len);
+		if (!c)
+			return mid;
+		if (c < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return NONE;
+}
+
+// Whether the object id of commit starts with the nr hex digits in
+// prefix, two to a byte.
+static bool
+hash_has_prefix(const struct snapshot_map *m, uint32_t commit,
+		const unsigned char *prefix, size_t nr)
+{
+	const unsigned char *hash =
+	    m->hashes + (size_t)commit * m->header->hash_len;
+
+	if (memcmp(hash, prefix, nr / 2))
+		return false;
+	return nr % 2 == 0 || (hash[nr / 2] & 0xf0) == prefix[nr / 2];
+}
+
+// The commit whose object id starts with the hex digits of hash, at least
+// 4 of them, found in the sorted table of object ids.
+static int
+resolve_commit(struct bushi_snapshot *s, const char *hash, uint32_t *found)
+{
+	const struct snapshot_map *m = &s->map;
+	size_t hash_len = m->header->hash_len, len = strlen(hash);
+	unsigned char prefix[64] = {0};
+
+	if (len < 4 || len > 2 * hash_len || hash_len > sizeof(prefix))
+		return fail(s, "ref not found: %s", hash);
+	if (parse_hex_prefix(hash, len, prefix))
+		return fail(s, "ref not found: %s", hash);
+
+	// The first id not below the prefix padded with zeros.
+	uint32_t lo = 0, hi = m->header->nr_commits;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		uint32_t commit = m->by_hash[mid];
+		if (commit >= m->header->nr_commits)
+			return fail(s, "corrupt snapshot: %s", s->file);
+		if (memcmp(m->hashes + (size_t)commit * hash_len, prefix,
+			   hash_len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == m->header->nr_commits ||
+	    !hash_has_prefix(m, m->by_hash[lo], prefix, len))
+		return fail(s, "ref not found: %s", hash);
+	if (lo + 1 < m->header->nr_commits &&
+	    m->by_hash[lo + 1] < m->header->nr_commits &&
+	    hash_has_prefix(m, m->by_hash[lo + 1], prefix, len))
+		return fail(s, "ambiguous commit hash: %s", hash);
+	*found = m->by_hash[lo];
+	return 0;
+}
+
+// Like the database: a full name wins, then tags before branches, then
+// commit hashes. *ref is NONE for a commit.
+static int
+resolve_ref(struct bushi_snapshot *s, const char *name, uint32_t *ref,
+	    uint32_t *commit)
+{
+	static const char *const prefixes[] = {"", "refs/tags/",
+					       "refs/heads/"};
+	const struct snapshot_map *m = &s->map;
+
+	*ref = *commit = NONE;
+	if (!name) {
+		*ref = m->header->head;
+		if (*ref == NONE)
+			return fail(s, "repository head not set");
+		*commit = m->refs[*ref].commit;
+		return 0;
+	}
+
+	size_t len = strlen(name);
+	for (size_t i = 0; i < sizeof(prefixes) / sizeof(*prefixes); i++) {
+		size_t prefix_len = strlen(prefixes[i]);
+		char *full_name = malloc(prefix_len + len + 1);
+		if (!full_name)
+			return fail(s, "out of memory");
+		memcpy(full_name, prefixes[i], prefix_len);
+		memcpy(full_name + prefix_len, name, len + 1);
+
+		*ref = find_ref(m, full_name, prefix_len + len);
+		free(full_name);
+		if (*ref != NONE) {
+			*commit = m->refs[*ref].commit;
+			return 0;
+		}
+	}
+	return resolve_commit(s, name, commit);
+}
+
+static uint32_t
+find_path(const struct snapshot_map *m, const char *path)
+{
+	uint32_t lo = 0, hi = m->header->nr_paths;
+	size_t len = strlen(path);
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		int c = cmp_name(m, path, len, m->paths[mid].name,
+				 m->paths[mid].name_len);
+		if (!c)
+			return mid;
+		if (c < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return NONE;
+}
+
+static const struct bushi_snapshot_commit *
+get_commit(struct bushi_snapshot *s, uint32_t commit)
+{
+	if (commit >= s->map.header->nr_commits) {
+		fail(s, "corrupt snapshot: %s", s->file);
+		return NULL;
+	}
+	return &s->map.commits[commit];
+}
+
+// Walk commit down its first-parent chain to depth, by jump pointer
+// unless the jump overshoots, as the database queries do.
+static int
+descend(struct bushi_snapshot *s, uint32_t *commit, uint32_t depth)
+{
+	const struct bushi_snapshot_commit *c = get_commit(s, *commit);
+
+	while (c && c->depth > depth) {
+		const struct bushi_snapshot_commit *j = get_commit(s, c->jump);
+		if (!j)
+			return -1;
+		*commit = j->depth >= depth ? c->jump : c->parent;
+		c = get_commit(s, *commit);
+	}
+	return c ? 0 : -1;
+}
+
+// The change of path at the latest commit on the first-parent chain of
+// start that changed it, or NONE. ref is the ref start is the tip of, or
+// NONE.
+static int
+find_path_start(struct bushi_snapshot *s, uint32_t start, uint32_t ref,
+		uint32_t path, uint32_t *found)
+{
+	const struct snapshot_map *m = &s->map;
+	const struct bushi_snapshot_ref *r = ref != NONE ? &m->refs[ref] : NULL;
+	const struct bushi_snapshot_path *p = &m->paths[path];
+
+	*found = NONE;
+
+	// A synced branch tip knows where each path starts.
+	if (r && r->materialized) {
+		const struct bushi_snapshot_tip *tips = m->tips + r->tips;
+		uint32_t lo = 0, hi = r->nr_tips;
+
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			if (tips[mid].path == path) {
+				*found = tips[mid].change;
+				break;
+			}
+			if (tips[mid].path < path)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (*found != NONE && *found >= m->header->nr_changes)
+			return fail(s, "corrupt snapshot: %s", s->file);
+		return 0;
+	}
+
+	// Otherwise check the candidates deepest first, resuming the walk
+	// down the chain where the previous check left it.
+	const struct bushi_snapshot_change *changes = m->changes + p->changes;
+	const struct bushi_snapshot_commit *c;
+	uint32_t current = start;
+	uint32_t lo = 0, hi = p->nr_changes;
+
+	if (!(c = get_commit(s, current)))
+		return -1;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		const struct bushi_snapshot_commit *mc =
+		    get_commit(s, changes[mid].commit);
+		if (!mc)
+			return -1;
+		if (mc->depth > c->depth)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (uint32_t i = lo; i < p->nr_changes; i++) {
+		const struct bushi_snapshot_commit *candidate =
+		    get_commit(s, changes[i].commit);
+		if (!candidate || descend(s, &current, candidate->depth))
+			return -1;
+		if (current == changes[i].commit) {
+			*found = p->changes + i;
+			break;
+		}
+	}
+	return 0;
+}
+
+int
+bushi_snapshot_history(struct bushi_snapshot *s, const char *ref,
+		       const char *path, uint64_t limit, bushi_commit_fn fn,
+		       void *data)
+{
+	const struct snapshot_map *m = &s->map;
+	struct bushi_commit commit = {.hash_len = m->header->hash_len};
+	uint32_t r, start;
+
+	if (resolve_ref(s, ref, &r, &start))
+		return -1;
+
+	if (!path) {
+		uint32_t i = start;
+
+		for (; limit && i != NONE; limit--) {
+			const struct bushi_snapshot_commit *c =
+			    get_commit(s, i);
+			if (!c)
+				return -1;
+			commit.hash = m->hashes + (size_t)i * commit.hash_len;
+			if (fn(&commit, data))
+				break;
+			i = c->parent;
+		}
+		return 0;
+	}
+
+	uint32_t p = find_path(m, path), change;
+	if (p == NONE)
+		return 0;
+	if (find_path_start(s, start, r, p, &change))
+		return -1;
+
+	// The chain ends at the change that points to itself.
+	for (; limit && change != NONE; limit--) {
+		const struct bushi_snapshot_change *c = &m->changes[change];
+		if (c->last >= m->header->nr_changes)
+			return fail(s, "corrupt snapshot: %s", s->file);
+		if (!get_commit(s, c->commit))
+			return -1;
+		commit.hash = m->hashes + (size_t)c->commit * commit.hash_len;
+		if (fn(&commit, data))
+			break;
+		change = c->last == change ? NONE : c->last;
+	}
+	return 0;
+}
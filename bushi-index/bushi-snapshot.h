@@ -0,0 +1,84 @@
+#ifndef BUSHI_SNAPSHOT_H
+#define BUSHI_SNAPSHOT_H
+
+#include <stdint.h>
+
+// Layout of the read-only snapshot bushi-index -S writes for each
+// repository and the query library maps. Every section is an array at a
+// byte offset from the start of the file, aligned to 8 bytes, with fields
+// in the byte order of the host that wrote it; order tells which.
+//
+// Commits, paths and refs are numbered by their position in their
+// section, not by their ids in the database, so the arrays are dense.
+
+#define BUSHI_SNAPSHOT_MAGIC "BUSHISNP"
+#define BUSHI_SNAPSHOT_VERSION 1
+#define BUSHI_SNAPSHOT_ORDER 0x01020304u
+#define BUSHI_SNAPSHOT_NONE UINT32_MAX
+
+struct bushi_snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t order;
+	uint32_t hash_len;
+	uint32_t head; // ref of the default branch, or NONE
+
+	uint32_t nr_commits;
+	uint32_t nr_paths;
+	uint32_t nr_changes;
+	uint32_t nr_refs;
+	uint32_t nr_tips;
+	uint32_t reserved;
+
+	// Section offsets.
+	uint64_t hashes;  // nr_commits raw object ids of hash_len bytes
+	uint64_t commits; // struct bushi_snapshot_commit
+	uint64_t by_hash; // uint32_t commits in object id order
+	uint64_t paths;	  // struct bushi_snapshot_path
+	uint64_t changes; // struct bushi_snapshot_change
+	uint64_t refs;	  // struct bushi_snapshot_ref
+	uint64_t tips;	  // struct bushi_snapshot_tip
+	uint64_t strings; // names, each followed by a NUL
+	uint64_t strings_size;
+	uint64_t size; // of the whole file
+};
+
+// First-parent links, as in the commits table.
+struct bushi_snapshot_commit {
+	uint32_t parent; // NONE for a root
+	uint32_t jump;
+	uint32_t depth;
+};
+
+// Paths the repository changed, sorted by full name: "src/" comes before
+// "src/main.c", and a trailing '/' marks a directory.
+struct bushi_snapshot_path {
+	uint32_t name; // offset into strings
+	uint32_t name_len;
+	uint32_t changes; // first change of the path
+	uint32_t nr_changes;
+};
+
+// The commits that changed a path, deepest first, then by commit.
+struct bushi_snapshot_change {
+	uint32_t commit;
+	uint32_t last; // change of the previous commit, itself at the first
+};
+
+// Branches and tags, sorted by full name.
+struct bushi_snapshot_ref {
+	uint32_t name; // offset into strings
+	uint32_t name_len;
+	uint32_t commit;
+	uint32_t materialized; // tips holds every path changed on the chain
+	uint32_t tips;	       // first start point, sorted by path
+	uint32_t nr_tips;
+};
+
+// The latest change of a path on the first-parent chain of a ref.
+struct bushi_snapshot_tip {
+	uint32_t path;
+	uint32_t change;
+};
+
+#endif
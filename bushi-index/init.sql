@@ -1,8 +1,10 @@
 -- It's use to initialize the SQLite database. We don't have migration for now.
 -- Regenerating the database won't cause any data loss.
+-- bushi-index records the schema version in PRAGMA user_version and refuses
+-- to open a database created by an older, incompatible version.
 
--- https://sqlite.org/pragma.html#pragma_synchronous
-PRAGMA synchronous = OFF;
+-- Only schema statements live here: bushi-index runs this file again inside
+-- a transaction to rebuild the indexes a bulk import drops.
 
 CREATE TABLE IF NOT EXISTS repositories
 (      repository_id    INTEGER PRIMARY KEY AUTOINCREMENT
@@ -11,47 +13,28 @@ CREATE TABLE IF NOT EXISTS repositories
      , repository_head  TEXT                    -- default branch
 ) STRICT;
 
-CREATE TABLE IF NOT EXISTS ancestors
-(      commit_id        INTEGER NOT NULL
-     , exponent         INTEGER NOT NULL
-     , ancestor_id      INTEGER NOT NULL
-     , PRIMARY KEY (commit_id, exponent)
-) WITHOUT ROWID, STRICT;
-
+-- Object ids are raw hash bytes: 20 for SHA-1, 32 for SHA-256.
 CREATE TABLE IF NOT EXISTS commits
 (      commit_id        INTEGER PRIMARY KEY AUTOINCREMENT
-     , commit_hash      TEXT    NOT NULL
-     , parent_hash      TEXT                    -- only first parent
+     , commit_hash      BLOB    NOT NULL
+     , parent_hash      BLOB                    -- only first parent
+     , parent_id        INTEGER                 -- only first parent
      , first_depth      INTEGER                 -- only first parent
+     , jump_id          INTEGER                 -- skew-binary jump pointer
+     , chain_time       INTEGER                 -- see below
      , repository_id    INTEGER NOT NULL
+     , author_id        INTEGER                 -- NULL if unparsable
+     , author_time      INTEGER                 -- seconds since the epoch
+     , commit_time      INTEGER                 -- committer's, likewise
+     , subject          TEXT                    -- see below
 ) STRICT;
 
-CREATE TRIGGER IF NOT EXISTS tgr_commits_first_depth_ancestors
-AFTER UPDATE OF first_depth ON commits
-WHEN NEW.parent_hash IS NOT NULL
-BEGIN
-    INSERT OR IGNORE INTO ancestors (commit_id, exponent, ancestor_id)
-    WITH RECURSIVE skip_list(commit_id, exponent, ancestor_id) AS (
-        SELECT NEW.commit_id,
-               0,
-               parent.commit_id
-          FROM commits AS parent
-         WHERE parent.repository_id = NEW.repository_id
-           AND parent.commit_hash = NEW.parent_hash
-
-        UNION ALL
-
-        SELECT s.commit_id,
-               s.exponent + 1,
-               a.ancestor_id
-          FROM skip_list AS s
-          JOIN ancestors AS a
-            ON a.commit_id = s.ancestor_id
-           AND a.exponent = s.exponent
-    )
-    SELECT commit_id, exponent, ancestor_id
-      FROM skip_list;
-END;
+-- parent_id, first_depth, jump_id and chain_time are filled in by
+-- backfill. Every first-parent chain ends in a root with first_depth 0 and
+-- jump_id pointing to itself; see ALGORITHM.md for how jump_id is chosen.
+-- chain_time is the latest commit_time from the root of the chain to the
+-- commit, so unlike commit_time it never decreases towards the tip, and
+-- time ranges can be searched with the jump pointers.
 
 CREATE INDEX IF NOT EXISTS idx_commit_hash
     ON commits (
@@ -70,14 +53,40 @@ CREATE INDEX IF NOT EXISTS idx_commit_hash_only
        commit_hash
        );
 
+-- What a history listing shows of a commit is stored with it, so a page of
+-- results is read from here without opening the repository. subject is
+-- the first paragraph of the message on one line, as git log --format=%s
+-- prints it, cut to at most 256 bytes at a character boundary. Subjects
+-- and author names are UTF-8: commits with another encoding header are
+-- converted, and where that fails, non-ASCII bytes are stored as '?'.
+
+-- Commits backfill has not reached yet.
+CREATE INDEX IF NOT EXISTS idx_commits_unfilled
+    ON commits (
+       repository_id
+       )
+ WHERE first_depth IS NULL;
+
+-- Authors are shared by all repositories, as paths are.
+CREATE TABLE IF NOT EXISTS authors
+(      author_id        INTEGER PRIMARY KEY AUTOINCREMENT
+     , name             TEXT    NOT NULL
+     , email            TEXT    NOT NULL
+     , UNIQUE (name, email)
+) STRICT;
+
+-- Paths form a trie: each record is one component below its parent
+-- directory record, so the directories of a path are its parent links.
 CREATE TABLE IF NOT EXISTS paths
 (      path_id          INTEGER PRIMARY KEY AUTOINCREMENT
-     , name             TEXT    UNIQUE NOT NULL -- just like the hashmap
+     , parent_path_id   INTEGER NOT NULL        -- 0 for top-level entries
+     , basename         TEXT    NOT NULL
+     , UNIQUE (parent_path_id, basename)        -- also lists children
 ) STRICT;
 
--- File vs directory is encoded in paths.name:
---   file paths never end with '/'
---   directory paths always end with '/'
+-- File vs directory is encoded in paths.basename:
+--   file names never end with '/'
+--   directory names always end with '/'
 --   root is not stored as a path record
 -- last_commit_id semantics:
 --   IS NULL         : not backfilled yet (incompleted)
@@ -97,29 +106,92 @@ CREATE INDEX IF NOT EXISTS idx_changes_path_last
      , last_commit_id
        );
 
+-- Files a commit moved, when the repository sets bushi.renameLimit: path_id
+-- was added by commit_id with the content old_path_id had in its first
+-- parent, where the commit deleted it. similarity is the percentage of
+-- content kept, 100 for a file moved unchanged.
+CREATE TABLE IF NOT EXISTS renames
+(      commit_id        INTEGER NOT NULL
+     , path_id          INTEGER NOT NULL  -- new name
+     , old_path_id      INTEGER NOT NULL
+     , similarity       INTEGER NOT NULL
+     , PRIMARY KEY (commit_id, path_id)
+) WITHOUT ROWID, STRICT;
+
+-- Paths a commit removed: files missing from its tree that its first
+-- parent had, and directories left with no file. Each also has a changes
+-- row; a later commit adding the path back has one of its own.
+CREATE TABLE IF NOT EXISTS deletions
+(      commit_id        INTEGER NOT NULL
+     , path_id          INTEGER NOT NULL
+     , PRIMARY KEY (commit_id, path_id)
+) WITHOUT ROWID, STRICT;
+
 CREATE TABLE IF NOT EXISTS refs
 (      full_name        TEXT    NOT NULL  -- e.g. refs/heads/fix/issue-1
      , show_name        TEXT    NOT NULL  -- e.g. fix:issue-1
-     , commit_id        INTEGER NOT NULL  -- always commit_id
-     , ref_time         INTEGER NOT NULL  -- commit timestamp
+     , commit_id        INTEGER           -- always commit_id, see below
+     , ref_time         INTEGER           -- commit timestamp
      , ref_type         INTEGER NOT NULL  -- 0 is branch, 1 is tag
-     , is_dirty         INTEGER DEFAULT NULL
+     , ref_oid          BLOB    NOT NULL  -- as read, before peeling
      , repository_id    INTEGER NOT NULL
      , PRIMARY KEY (repository_id, full_name)
      , UNIQUE (repository_id, ref_type, show_name)
 ) WITHOUT ROWID, STRICT;
 
+-- A ref that peels to a tree or blob, or to a commit that was not indexed,
+-- is still recorded with its ref_oid so the next sync sees it unchanged;
+-- commit_id and ref_time are NULL then, and queries ignore it.
+
 CREATE INDEX IF NOT EXISTS idx_refs_time
     ON refs (
        repository_id
      , ref_time
        );
 
-CREATE INDEX IF NOT EXISTS idx_refs_dirty
-    ON refs (
+-- Where a history query from a branch tip starts, and what a tree view
+-- shows: for each path, the latest commit on the first-parent chain of
+-- the tip that changed it. path_id 0, which is never a path record, holds
+-- the tip the rows were computed for. A path the commit removed keeps its
+-- row, where its history starts, but is no entry of the tree.
+CREATE TABLE IF NOT EXISTS tip_paths
+(      repository_id    INTEGER NOT NULL
+     , full_name        TEXT    NOT NULL  -- branch the tip belongs to
+     , path_id          INTEGER NOT NULL
+     , parent_path_id   INTEGER           -- NULL for the tip row
+     , commit_id        INTEGER NOT NULL
+     , deleted          INTEGER NOT NULL  -- commit_id removed the path
+     , PRIMARY KEY (repository_id, full_name, path_id)
+) WITHOUT ROWID, STRICT;
+
+-- Lists the entries of a directory at a tip.
+CREATE INDEX IF NOT EXISTS idx_tip_paths_parent
+    ON tip_paths (
        repository_id
-     , is_dirty
-       )
- WHERE is_dirty IS NOT NULL;
+     , full_name
+     , parent_path_id
+       );
+
+-- A branch created from another one, usually the default branch, shares
+-- its rows instead of copying them: a row of base_name whose commit has
+-- first_depth at most base_depth, the depth where the two chains part,
+-- counts for full_name too unless full_name has a row of its own for the
+-- path. Before base_name moves a shared row it leaves a copy under
+-- full_name, and a branch that would share rows above where the chains
+-- now part copies them all and stops sharing. Only a branch without a base
+-- is ever a base.
+CREATE TABLE IF NOT EXISTS tip_bases
+(      repository_id    INTEGER NOT NULL
+     , full_name        TEXT    NOT NULL
+     , base_name        TEXT    NOT NULL
+     , base_depth       INTEGER NOT NULL
+     , PRIMARY KEY (repository_id, full_name)
+) WITHOUT ROWID, STRICT;
+
+CREATE INDEX IF NOT EXISTS idx_tip_bases_base
+    ON tip_bases (
+       repository_id
+     , base_name
+       );
 
 -- vim: set expandtab ts=4:
@@ -1,6 +1,7 @@
 #!/usr/bin/env python3
 
 import argparse
+import heapq
 import os
 import signal
 import sqlite3
@@ -9,7 +10,10 @@ import sys
 
 signal.signal(signal.SIGPIPE, signal.SIG_DFL)
 
-USAGE = "usage: demo-cli.py [-t DATABASE] [-n LIMIT] REPO_NAME -- [FIlE_PATH]"
+USAGE = (
+    "usage: demo-cli.py [-t DATABASE] [-n LIMIT] [-b REF | -c COMMIT] [-l] "
+    "REPO_NAME -- [FIlE_PATH...]"
+)
 
 
 def print_usage(file=sys.stdout):
@@ -62,6 +66,22 @@ def parse_args(argv):
         default=None,
         help="Limit the number of commits shown",
     )
+    parser.add_argument(
+        "-b",
+        dest="ref",
+        help="Start from REF, a branch, tag or full ref name, instead of head",
+    )
+    parser.add_argument(
+        "-c",
+        dest="commit",
+        help="Start from COMMIT (full or abbreviated hash) instead of head",
+    )
+    parser.add_argument(
+        "-l",
+        dest="list",
+        action="store_true",
+        help="List the entries of a directory instead of its history",
+    )
     parser.add_argument(
         "repo",
         help="Repository name",
@@ -69,7 +89,7 @@ def parse_args(argv):
     parser.add_argument(
         "paths",
         nargs="*",
-        help="Optional file path filter",
+        help="Optional file path filters",
     )
     return parser.parse_args(argv)
 
@@ -107,7 +127,9 @@ def get_repository_head(conn, repository_id):
 
 
 def get_start_commit_id(conn, repository_id):
+    """Return the full ref name and commit_id of the default branch."""
     head = get_repository_head(conn, repository_id)
+    full_name = f"refs/heads/{head}"
     row = conn.execute(
         """
         SELECT commit_id
@@ -115,11 +137,80 @@ def get_start_commit_id(conn, repository_id):
          WHERE repository_id = ?
            AND full_name = ?
         """,
-        (repository_id, f"refs/heads/{head}"),
+        (repository_id, full_name),
     ).fetchone()
     if row is None:
         raise ValueError("no ref")
-    return row[0]
+    return full_name, row[0]
+
+
+HEX_DIGITS = frozenset("0123456789abcdef")
+
+
+def get_ref_commit_id(conn, repository_id, ref):
+    """Return the full name and commit_id of a branch, tag or full ref name.
+
+    A full name wins; otherwise tags come before branches, as they do when
+    git resolves a short name.
+    """
+    row = conn.execute(
+        """
+        SELECT full_name
+             , commit_id
+          FROM refs
+         WHERE repository_id = ?1
+           AND full_name IN (?2, 'refs/tags/' || ?2, 'refs/heads/' || ?2)
+         ORDER BY full_name = ?2 DESC
+             , ref_type DESC
+         LIMIT 1
+        """,
+        (repository_id, ref),
+    ).fetchone()
+    if row is None:
+        raise ValueError(f"ref not found: {ref}")
+    return row[0], row[1]
+
+
+def hash_prefix_range(prefix):
+    """Return the [low, high) BLOB range of hashes starting with prefix.
+
+    Hashes are stored as raw bytes, so an odd-length hex prefix is padded
+    with a zero nibble. high is None when the prefix is all 'f'.
+    """
+    pad = len(prefix) % 2
+    low = bytes.fromhex(prefix + "0" * pad)
+
+    value = int(prefix, 16) + 1
+    if value >> (4 * len(prefix)):
+        return low, None
+    high = bytes.fromhex(f"{value:0{len(prefix)}x}" + "0" * pad)
+    return low, high
+
+
+def resolve_commit_prefix(conn, repository_id, prefix):
+    """Resolve a full or abbreviated hex commit hash to its commit_id."""
+    prefix = prefix.lower()
+    if not 4 <= len(prefix) <= 64 or not set(prefix) <= HEX_DIGITS:
+        raise ValueError(f"invalid commit hash: {prefix}")
+
+    low, high = hash_prefix_range(prefix)
+    sql = """
+        SELECT commit_id
+          FROM commits
+         WHERE repository_id = ?
+           AND commit_hash >= ?
+        """
+    params = [repository_id, low]
+    if high is not None:
+        sql += " AND commit_hash < ?"
+        params.append(high)
+
+    rows = conn.execute(sql + " LIMIT 2", params).fetchall()
+    if not rows:
+        raise ValueError(f"commit not found: {prefix}")
+    if len(rows) > 1:
+        raise ValueError(f"ambiguous commit hash: {prefix}")
+    return rows[0][0]
 
 
 def get_commit_depth(conn, commit_id):
@@ -132,14 +223,24 @@ def get_commit_depth(conn, commit_id):
     return row[0]
 
 
-def get_ancestor(conn, commit_id, exponent):
+def get_first_parent_links(conn, commit_id):
+    """Return (depth, parent_id, jump_id, jump_depth) of a commit."""
     row = conn.execute(
-        "SELECT ancestor_id FROM ancestors WHERE commit_id = ? AND exponent = ?",
-        (commit_id, exponent),
+        """
+        SELECT c.first_depth
+             , c.parent_id
+             , c.jump_id
+             , j.first_depth
+          FROM commits AS c
+          JOIN commits AS j
+            ON j.commit_id = c.jump_id
+         WHERE c.commit_id = ?
+        """,
+        (commit_id,),
     ).fetchone()
     if row is None:
-        raise ValueError("ancestor not found")
-    return row[0]
+        raise ValueError("commit not found")
+    return row
 
 
 def is_first_parent_ancestor(conn, candidate_id, input_id):
@@ -148,19 +249,18 @@ def is_first_parent_ancestor(conn, candidate_id, input_id):
         return True
 
     da = get_commit_depth(conn, candidate_id)
-    db = get_commit_depth(conn, input_id)
+    current = input_id
+    depth, parent_id, jump_id, jump_depth = get_first_parent_links(conn, current)
 
-    if da > db:
+    if da > depth:
         return False
 
-    current = input_id
-    delta = db - da
-    exponent = 0
-    while delta:
-        if delta & 1:
-            current = get_ancestor(conn, current, exponent)
-        delta >>= 1
-        exponent += 1
+    # Take the jump pointer unless it overshoots the candidate's depth.
+    while depth > da:
+        current = jump_id if jump_depth >= da else parent_id
+        depth, parent_id, jump_id, jump_depth = get_first_parent_links(
+            conn, current
+        )
 
     return current == candidate_id
 
@@ -178,12 +278,12 @@ def query_no_path(conn, start_commit_id, limit):
 
             UNION ALL
 
-            SELECT a.ancestor_id,
+            SELECT c.parent_id,
                    h.seq + 1
               FROM history AS h
-              JOIN ancestors AS a
-                ON a.commit_id = h.commit_id
-               AND a.exponent = 0
+              JOIN commits AS c
+                ON c.commit_id = h.commit_id
+             WHERE c.parent_id IS NOT NULL
              ORDER BY 2
              LIMIT ?
         )
@@ -193,7 +293,7 @@ def query_no_path(conn, start_commit_id, limit):
             ON c.commit_id = h.commit_id
         """
     cursor = conn.execute(sql, [start_commit_id, limit])
-    return [row[0] for row in cursor]
+    return [row[0].hex() for row in cursor]
 
 
 def find_path_start_commit(conn, repository_id, path_id, input_commit_id):
@@ -222,22 +322,195 @@ def find_path_start_commit(conn, repository_id, path_id, input_commit_id):
     return None
 
 
-def query_path_history(conn, repository_id, query_path, input_commit_id, limit):
+def find_tip_path_start(conn, repository_id, full_name, path_id, input_commit_id):
+    """Look up the start point bushi-index materialized for a ref tip.
+
+    Returns (known, commit_id): known is False when the rows were not
+    computed for input_commit_id, and commit_id is None for a path the
+    first-parent chain never changed. A row the ref shares with its base
+    branch counts unless the ref has its own.
+    """
+    rows = dict(
+        conn.execute(
+            """
+            SELECT tp.path_id
+                 , tp.commit_id
+              FROM tip_bases AS b
+              JOIN tip_paths AS tp
+                ON tp.repository_id = b.repository_id
+               AND tp.full_name = b.base_name
+               AND tp.path_id = ?3
+              JOIN commits AS c
+                ON c.commit_id = tp.commit_id
+             WHERE b.repository_id = ?1
+               AND b.full_name = ?2
+               AND c.first_depth <= b.base_depth
+            """,
+            (repository_id, full_name, path_id),
+        ).fetchall()
+    )
+    rows.update(
+        conn.execute(
+            """
+            SELECT path_id
+                 , commit_id
+              FROM tip_paths
+             WHERE repository_id = ?
+               AND full_name = ?
+               AND path_id IN (0, ?)
+            """,
+            (repository_id, full_name, path_id),
+        ).fetchall()
+    )
+    if rows.get(0) != input_commit_id:
+        return False, None
+    return True, rows.get(path_id)
+
+
+def split_path(query_path):
+    """Split a path into trie components, keeping each directory's '/'."""
+    parts = query_path.split("/")
+    names = [name + "/" for name in parts[:-1]]
+    if parts[-1]:
+        names.append(parts[-1])
+    return names
+
+
+def get_path_id(conn, query_path):
+    """Follow the path trie from the root; None if any component is missing.
+
+    The root itself is not a path record and has id 0.
+    """
+    path_id = 0
+    for name in split_path(query_path):
+        if name == "/":
+            return None
+        row = conn.execute(
+            """
+            SELECT path_id
+              FROM paths
+             WHERE parent_path_id = ?
+               AND basename = ?
+            """,
+            (path_id, name),
+        ).fetchone()
+        if row is None:
+            return None
+        path_id = row[0]
+    return path_id
+
+
+def list_children(conn, repository_id, path_id):
+    """Return the entries directly below a directory record, sorted.
+
+    Path records are shared by all repositories, so only entries that
+    this repository ever changed are listed.
+    """
+    cursor = conn.execute(
+        """
+        SELECT p.basename
+          FROM paths AS p
+         WHERE p.parent_path_id = ?
+           AND EXISTS (
+               SELECT 1
+                 FROM changes AS cg
+                 JOIN commits AS c
+                   ON c.commit_id = cg.commit_id
+                WHERE cg.path_id = p.path_id
+                  AND c.repository_id = ?
+               )
+         ORDER BY p.basename
+        """,
+        (path_id, repository_id),
+    )
+    return [row[0] for row in cursor]
+
+
+def find_query_path_start(
+    conn, repository_id, query_path, input_commit_id, full_name
+):
+    """Return (path_id, commit_id) of the newest change of query_path.
+
+    commit_id is None when the path does not exist or the first-parent
+    chain of input_commit_id never changed it.
+    """
+    path_id = get_path_id(conn, query_path)
+    if path_id is None:
+        return None, None
+
+    known = False
+    if full_name is not None:
+        known, start_commit_id = find_tip_path_start(
+            conn, repository_id, full_name, path_id, input_commit_id
+        )
+    if not known:
+        start_commit_id = find_path_start_commit(
+            conn, repository_id, path_id, input_commit_id
+        )
+    return path_id, start_commit_id
+
+
+def query_paths_history(
+    conn, repository_id, query_paths, input_commit_id, limit, full_name=None
+):
+    """Return commits that touched any of query_paths, newest first.
+
+    The last_commit_id chains of the paths are read one change at a time
+    and merged by first_depth. They all run down the first-parent chain
+    of input_commit_id, where depths are unique, so a commit several
+    paths changed is listed once.
+    """
+    heap = []
+    for query_path in query_paths:
+        path_id, commit_id = find_query_path_start(
+            conn, repository_id, query_path, input_commit_id, full_name
+        )
+        if commit_id is not None:
+            depth = get_commit_depth(conn, commit_id)
+            heap.append((-depth, commit_id, path_id))
+    heapq.heapify(heap)
+
+    results = []
+    last_depth = None
+    while heap and len(results) < limit:
+        depth, commit_id, path_id = heap[0]
+        if depth != last_depth:
+            last_depth = depth
+            row = conn.execute(
+                "SELECT commit_hash FROM commits WHERE commit_id = ?",
+                (commit_id,),
+            ).fetchone()
+            results.append(row[0].hex())
+
+        row = conn.execute(
+            """
+            SELECT last_commit_id
+              FROM changes
+             WHERE commit_id = ?
+               AND path_id = ?
+            """,
+            (commit_id, path_id),
+        ).fetchone()
+        last_id = row[0] if row else None
+        if last_id is None or last_id == commit_id:
+            heapq.heappop(heap)
+        else:
+            depth = get_commit_depth(conn, last_id)
+            heapq.heapreplace(heap, (-depth, last_id, path_id))
+    return results
+
+
+def query_path_history(
+    conn, repository_id, query_path, input_commit_id, limit, full_name=None
+):
     """Return commits that touched query_path, newest first.
 
     query_path is used verbatim: a trailing slash queries a directory,
-    no trailing slash queries a file.
+    no trailing slash queries a file. full_name is the ref whose tip
+    input_commit_id is, if any.
     """
-    row = conn.execute(
-        "SELECT path_id FROM paths WHERE name = ? LIMIT 1",
-        (query_path,),
-    ).fetchone()
-    if row is None:
-        return []
-    path_id = row[0]
-
-    start_commit_id = find_path_start_commit(
-        conn, repository_id, path_id, input_commit_id
+    path_id, start_commit_id = find_query_path_start(
+        conn, repository_id, query_path, input_commit_id, full_name
     )
     if start_commit_id is None:
         return []
@@ -266,7 +539,7 @@ def query_path_history(conn, repository_id, query_path, input_commit_id, limit):
             ON c.commit_id = h.commit_id
         """
     cursor = conn.execute(sql, [start_commit_id, path_id, limit])
-    return [row[0] for row in cursor]
+    return [row[0].hex() for row in cursor]
 
 
 def main(argv=None):
@@ -278,12 +551,11 @@ def main(argv=None):
     if args.limit is None:
         args.limit = U32_MAX
 
-    if args.paths:
-        if len(args.paths) > 1:
-            fail("only one path is supported")
-        query_path = args.paths[0]
-    else:
-        query_path = None
+    if args.ref is not None and args.commit is not None:
+        fail("-b and -c cannot be combined")
+    if len(args.paths) > 1 and args.list:
+        fail("only one path can be listed")
+    query_path = args.paths[0] if args.paths else None
 
     database = args.database or os.environ.get("BUSHI_DATABASE")
     if not database:
@@ -296,13 +568,46 @@ def main(argv=None):
 
     try:
         repository_id = get_repository_id(conn, args.repo)
-        start_commit_id = get_start_commit_id(conn, repository_id)
+        full_name = None
+        if args.ref is not None:
+            full_name, start_commit_id = get_ref_commit_id(
+                conn, repository_id, args.ref
+            )
+        elif args.commit is None:
+            full_name, start_commit_id = get_start_commit_id(
+                conn, repository_id
+            )
+        else:
+            start_commit_id = resolve_commit_prefix(
+                conn, repository_id, args.commit
+            )
 
-        if query_path is None:
+        if args.list:
+            # Listing always means a directory; the root is ''.
+            directory = query_path.rstrip("/") + "/" if query_path else ""
+            path_id = get_path_id(conn, directory)
+            if path_id is None:
+                raise ValueError("path not found")
+            results = list_children(conn, repository_id, path_id)
+        elif query_path is None:
             results = query_no_path(conn, start_commit_id, args.limit)
+        elif len(args.paths) > 1:
+            results = query_paths_history(
+                conn,
+                repository_id,
+                args.paths,
+                start_commit_id,
+                args.limit,
+                full_name,
+            )
         else:
             results = query_path_history(
-                conn, repository_id, query_path, start_commit_id, args.limit
+                conn,
+                repository_id,
+                query_path,
+                start_commit_id,
+                args.limit,
+                full_name,
             )
 
     except (sqlite3.Error, ValueError) as exc: